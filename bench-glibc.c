@@ -0,0 +1,276 @@
+/* End-to-end benchmark through glibc's NSS dispatch.
+ * Build and run against synthetic policies with: make bench
+ * Run against a given policy with:
+ *   ./rs-nss-bench-glibc [-l LIBRARY] POLICY_FILE [ITERATIONS]
+ *
+ * Unlike rs-nss-bench this goes through getpwnam(3) and friends, so it
+ * includes glibc's nsswitch dispatch, its internal buffer handling and the
+ * ERANGE retry loops callers run around the _r functions. The passwd, group,
+ * shadow and initgroups databases are pointed at "rightscale" with
+ * __nss_configure_lookup, so /etc/nsswitch.conf is not used or modified.
+ *
+ * LIBRARY defaults to the installed module; see use_nss_module. nscd is not
+ * bypassed, so stop it if it is running.
+ */
+
+#include "bench-utils.h"
+
+#include <errno.h>
+#include <grp.h>
+#include <pwd.h>
+#include <shadow.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MAX_KEYS 4096
+
+/* Names and uids of users sampled from the policy, used as lookup keys */
+static char *names[MAX_KEYS];
+static uid_t uids[MAX_KEYS];
+static int num_keys;
+static int num_entries;
+
+static int total_errors;
+static uint64_t *latencies;
+
+/* ERANGE retries done by the case that just ran */
+static long retries;
+
+/* Sample up to MAX_KEYS users evenly by enumerating them through glibc */
+static void load_keys(void) {
+    struct passwd *pwd;
+
+    setpwent();
+    while ((pwd = getpwent()) != NULL) {
+        num_entries++;
+    }
+    endpwent();
+
+    int stride = num_entries / MAX_KEYS + 1;
+    int i = 0;
+    setpwent();
+    while ((pwd = getpwent()) != NULL) {
+        if (i++ % stride == 0 && num_keys < MAX_KEYS) {
+            names[num_keys] = strdup(pwd->pw_name);
+            uids[num_keys] = pwd->pw_uid;
+            num_keys++;
+        }
+    }
+    endpwent();
+}
+
+static int bench_getpwnam_hit(int i) {
+    return getpwnam(names[i % num_keys]) != NULL;
+}
+
+static int bench_getpwnam_miss(int i) {
+    (void)i;
+    return getpwnam("nosuchuser") != NULL;
+}
+
+static int bench_getpwuid_hit(int i) {
+    return getpwuid(uids[i % num_keys]) != NULL;
+}
+
+static int bench_getpwuid_miss(int i) {
+    return getpwuid(3000000000u + i % 1000) != NULL;
+}
+
+static int bench_getspnam_hit(int i) {
+    return getspnam(names[i % num_keys]) != NULL;
+}
+
+static int bench_getgrnam_hit(int i) {
+    return getgrnam(names[i % num_keys]) != NULL;
+}
+
+static int bench_getgrnam_rightscale(int i) {
+    (void)i;
+    return getgrnam("rightscale") != NULL;
+}
+
+static int bench_getgrnam_miss(int i) {
+    (void)i;
+    return getgrnam("nosuchgroup") != NULL;
+}
+
+static int bench_getgrgid_hit(int i) {
+    return getgrgid(uids[i % num_keys]) != NULL;
+}
+
+static int bench_getgrgid_miss(int i) {
+    return getgrgid(3000000000u + i % 1000) != NULL;
+}
+
+/* getgrnam_r the way most callers use it: start from the size sysconf
+ * suggests and double the buffer on ERANGE */
+static int getgrnam_retry(const char *name) {
+    struct group grp;
+    struct group *result = NULL;
+    long size = sysconf(_SC_GETGR_R_SIZE_MAX);
+    if (size <= 0) {
+        size = 1024;
+    }
+    char *buf = malloc(size);
+
+    while (buf != NULL && getgrnam_r(name, &grp, buf, size, &result) == ERANGE) {
+        retries++;
+        size *= 2;
+        free(buf);
+        buf = malloc(size);
+    }
+    free(buf);
+    return result != NULL;
+}
+
+static int bench_getgrnam_r_hit(int i) {
+    return getgrnam_retry(names[i % num_keys]);
+}
+
+static int bench_getgrnam_r_rightscale(int i) {
+    (void)i;
+    return getgrnam_retry("rightscale");
+}
+
+/* getgrouplist the way initgroups(3) callers such as sshd use it: guess a
+ * size and retry with the size it reports */
+static int grouplist(const char *name, gid_t group) {
+    int ngroups = 16;
+    gid_t *groups = malloc(ngroups * sizeof(gid_t));
+    int res = -1;
+
+    while (groups != NULL && (res = getgrouplist(name, group, groups, &ngroups)) < 0) {
+        retries++;
+        free(groups);
+        groups = malloc(ngroups * sizeof(gid_t));
+    }
+    free(groups);
+    return res;
+}
+
+static int bench_getgrouplist_hit(int i) {
+    /* Besides the primary group, users are in rightscale and maybe rightscale_sudo */
+    return grouplist(names[i % num_keys], uids[i % num_keys]) > 1;
+}
+
+static int bench_getgrouplist_miss(int i) {
+    (void)i;
+    return grouplist("nosuchuser", 3000000000u);
+}
+
+/* A full pass over the database, as getent passwd or a directory service
+ * sync would do */
+static int bench_getpwent_pass(int i) {
+    (void)i;
+    int n = 0;
+    setpwent();
+    while (getpwent() != NULL) {
+        n++;
+    }
+    endpwent();
+    return n == num_entries;
+}
+
+static int bench_getgrent_pass(int i) {
+    (void)i;
+    int n = 0;
+    setgrent();
+    while (getgrent() != NULL) {
+        n++;
+    }
+    endgrent();
+    return n > 0;
+}
+
+static struct bench_case cases[] = {
+    { "getpwnam hit", bench_getpwnam_hit, 1 },
+    { "getpwnam miss", bench_getpwnam_miss, 0 },
+    { "getpwuid hit", bench_getpwuid_hit, 1 },
+    { "getpwuid miss", bench_getpwuid_miss, 0 },
+    { "getspnam hit", bench_getspnam_hit, 1 },
+    { "getgrnam hit", bench_getgrnam_hit, 1 },
+    { "getgrnam rightscale", bench_getgrnam_rightscale, 1 },
+    { "getgrnam miss", bench_getgrnam_miss, 0 },
+    { "getgrgid hit", bench_getgrgid_hit, 1 },
+    { "getgrgid miss", bench_getgrgid_miss, 0 },
+    { "getgrnam_r retry hit", bench_getgrnam_r_hit, 1 },
+    { "getgrnam_r retry rightscale", bench_getgrnam_r_rightscale, 1 },
+    { "getgrouplist hit", bench_getgrouplist_hit, 1 },
+    { "getgrouplist miss", bench_getgrouplist_miss, 1 },
+    { "getpwent full pass", bench_getpwent_pass, 1 },
+    { "getgrent full pass", bench_getgrent_pass, 1 },
+};
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-l LIBRARY] POLICY_FILE [ITERATIONS]\n", prog);
+    exit(2);
+}
+
+int main(int argc, char *argv[]) {
+    const char *library = "libnss_rightscale.so.2";
+    struct stat st;
+    int iterations = 20000;
+    int opt;
+    int c;
+
+    while ((opt = getopt(argc, argv, "l:h")) != -1) {
+        switch (opt) {
+        case 'l':
+            library = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 && optind != argc - 2) {
+        usage(argv[0]);
+    }
+    const char *policy_file = argv[optind];
+    if (optind == argc - 2) {
+        iterations = atoi(argv[optind + 1]);
+    }
+    if (stat(policy_file, &st) != 0) {
+        fprintf(stderr, "Cannot stat %s: %s\n", policy_file, strerror(errno));
+        return 1;
+    }
+
+    uint64_t dlopen_ns;
+    if (use_nss_module(library, policy_file, &dlopen_ns) != 0) {
+        return 1;
+    }
+
+    latencies = malloc(sizeof(uint64_t) * iterations);
+    if (latencies == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    /* The first lookup in a process pays for the NSS setup and loading the policy */
+    uint64_t start = now_ns();
+    getpwnam("nosuchuser");
+    uint64_t first_ns = now_ns() - start;
+
+    load_keys();
+    if (num_keys == 0) {
+        fprintf(stderr, "Cannot read users from %s through NSS\n", policy_file);
+        return 1;
+    }
+
+    printf("Policy %s through glibc: %d passwd entries, %ld bytes\n", policy_file, num_entries, (long)st.st_size);
+    printf("dlopen: %lu ns, first lookup: %lu ns\n", (unsigned long)dlopen_ns, (unsigned long)first_ns);
+
+    print_bench_header();
+    for (c = 0; c < (int)(sizeof(cases) / sizeof(cases[0])); c++) {
+        retries = 0;
+        total_errors += run_bench_case(&cases[c], iterations, latencies);
+        if (retries) {
+            printf("%-28s %ld ERANGE retries\n", "", retries);
+        }
+    }
+    printf("\n");
+
+    return total_errors ? 1 : 0;
+}
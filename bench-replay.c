@@ -0,0 +1,290 @@
+/* Replay a trace of NSS calls against the module through glibc.
+ * Run the canned traces against a synthetic policy with: make replay
+ * Run a trace with:
+ *   ./rs-nss-replay [-l LIBRARY] [-p PROCS] [-n LOOPS] [-m] [-c] POLICY_FILE TRACE
+ *
+ * A trace has one call per line: "TIME_MS OP KEY [GID]", where OP is one of
+ * getpwnam, getpwuid, getspnam, getgrnam, getgrgid or getgrouplist (which
+ * takes the user's primary GID). Everything after a '#' is a comment.
+ *
+ * PROCS processes (default 4) each replay the trace LOOPS times (default 10),
+ * at the recorded pace or, with -m, as fast as possible. At the recorded pace
+ * the processes are staggered over the length of the trace, and latency is
+ * measured from the time a call was due rather than when it was made, so a
+ * slow call also counts against the calls queued up behind it. With -c each
+ * loop runs in a freshly forked process that has not done any lookup yet,
+ * the way every sshd session, sudo or ls pays for loading the policy.
+ */
+
+#include "bench-utils.h"
+
+#include <errno.h>
+#include <grp.h>
+#include <pwd.h>
+#include <shadow.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+enum trace_op {
+    OP_GETPWNAM,
+    OP_GETPWUID,
+    OP_GETSPNAM,
+    OP_GETGRNAM,
+    OP_GETGRGID,
+    OP_GETGROUPLIST,
+    NUM_OPS
+};
+
+static const char *op_names[NUM_OPS] = {
+    "getpwnam", "getpwuid", "getspnam", "getgrnam", "getgrgid", "getgrouplist"
+};
+
+struct trace_call {
+    uint64_t time_ns;
+    enum trace_op op;
+    char *key;
+    unsigned long id; /* key as a uid/gid, or the primary gid for getgrouplist */
+};
+
+static struct trace_call *calls;
+static int num_calls;
+
+/* Results of every call, indexed by process, loop and call, shared with the
+ * worker processes */
+static uint64_t *latencies;
+static char *hits;
+
+static int max_speed;
+static int cold;
+
+static int parse_trace(const char *file) {
+    char line[1024];
+    int line_no = 0;
+    int allocated = 0;
+    FILE *fp = fopen(file, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "Cannot open %s: %s\n", file, strerror(errno));
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        char *saveptr;
+        line_no++;
+        line[strcspn(line, "#\n")] = '\0';
+        char *time = strtok_r(line, " \t", &saveptr);
+        if (time == NULL) {
+            continue;
+        }
+        char *op = strtok_r(NULL, " \t", &saveptr);
+        char *key = strtok_r(NULL, " \t", &saveptr);
+        char *gid = strtok_r(NULL, " \t", &saveptr);
+        if (key == NULL) {
+            fprintf(stderr, "%s:%d: expected TIME_MS OP KEY\n", file, line_no);
+            fclose(fp);
+            return -1;
+        }
+
+        if (num_calls == allocated) {
+            allocated = allocated ? allocated * 2 : 64;
+            calls = realloc(calls, allocated * sizeof(struct trace_call));
+            if (calls == NULL) {
+                fprintf(stderr, "Out of memory\n");
+                fclose(fp);
+                return -1;
+            }
+        }
+        struct trace_call *call = &calls[num_calls];
+        int o;
+        for (o = 0; o < NUM_OPS && strcmp(op, op_names[o]) != 0; o++);
+        if (o == NUM_OPS) {
+            fprintf(stderr, "%s:%d: unknown operation %s\n", file, line_no, op);
+            fclose(fp);
+            return -1;
+        }
+        call->op = o;
+        call->time_ns = (uint64_t)(strtod(time, NULL) * 1000000);
+        call->key = strdup(key);
+        call->id = strtoul(o == OP_GETGROUPLIST ? (gid ? gid : "0") : key, NULL, 10);
+        num_calls++;
+    }
+    fclose(fp);
+    if (num_calls == 0) {
+        fprintf(stderr, "%s: no calls\n", file);
+        return -1;
+    }
+    return 0;
+}
+
+static int make_call(struct trace_call *call) {
+    gid_t groups[64];
+    int ngroups = sizeof(groups) / sizeof(groups[0]);
+
+    switch (call->op) {
+    case OP_GETPWNAM:
+        return getpwnam(call->key) != NULL;
+    case OP_GETPWUID:
+        return getpwuid(call->id) != NULL;
+    case OP_GETSPNAM:
+        return getspnam(call->key) != NULL;
+    case OP_GETGRNAM:
+        return getgrnam(call->key) != NULL;
+    case OP_GETGRGID:
+        return getgrgid(call->id) != NULL;
+    case OP_GETGROUPLIST:
+        /* Only the primary group is returned for users we don't know */
+        return getgrouplist(call->key, call->id, groups, &ngroups) != 1;
+    default:
+        return 0;
+    }
+}
+
+static void sleep_until(uint64_t ns) {
+    struct timespec ts = { ns / 1000000000, ns % 1000000000 };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+static void replay(int proc, int loop, int loops, uint64_t offset) {
+    size_t base = ((size_t)proc * loops + loop) * num_calls;
+    uint64_t start = now_ns() + offset;
+    int i;
+
+    for (i = 0; i < num_calls; i++) {
+        uint64_t due = now_ns();
+        if (!max_speed) {
+            due = start + calls[i].time_ns;
+            sleep_until(due);
+        }
+        hits[base + i] = make_call(&calls[i]);
+        latencies[base + i] = now_ns() - due;
+    }
+}
+
+static void worker(int proc, int procs, int loops) {
+    uint64_t offset = 0;
+    int loop;
+
+    if (!max_speed) {
+        offset = calls[num_calls - 1].time_ns * proc / procs;
+    }
+    for (loop = 0; loop < loops; loop++) {
+        if (cold) {
+            pid_t pid = fork();
+            if (pid == 0) {
+                replay(proc, loop, loops, offset);
+                _exit(0);
+            }
+            waitpid(pid, NULL, 0);
+        } else {
+            replay(proc, loop, loops, offset);
+        }
+        offset = 0;
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-l LIBRARY] [-p PROCS] [-n LOOPS] [-m] [-c] POLICY_FILE TRACE\n", prog);
+    exit(2);
+}
+
+int main(int argc, char *argv[]) {
+    const char *library = "libnss_rightscale.so.2";
+    int procs = 4;
+    int loops = 10;
+    int opt;
+    int p;
+    int o;
+    size_t i;
+
+    while ((opt = getopt(argc, argv, "l:p:n:mch")) != -1) {
+        switch (opt) {
+        case 'l':
+            library = optarg;
+            break;
+        case 'p':
+            procs = atoi(optarg);
+            break;
+        case 'n':
+            loops = atoi(optarg);
+            break;
+        case 'm':
+            max_speed = 1;
+            break;
+        case 'c':
+            cold = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 2 || procs < 1 || loops < 1) {
+        usage(argv[0]);
+    }
+    const char *policy_file = argv[optind];
+    const char *trace_file = argv[optind + 1];
+
+    if (parse_trace(trace_file) != 0) {
+        return 1;
+    }
+    uint64_t dlopen_ns;
+    if (use_nss_module(library, policy_file, &dlopen_ns) != 0) {
+        return 1;
+    }
+
+    size_t results = (size_t)procs * loops * num_calls;
+    latencies = mmap(NULL, results * sizeof(uint64_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    hits = mmap(NULL, results, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    uint64_t *op_latencies = malloc(results * sizeof(uint64_t));
+    if (latencies == MAP_FAILED || hits == MAP_FAILED || op_latencies == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    printf("Trace %s: %d calls over %.1f ms, %d processes x %d loops, %s%s\n",
+        trace_file, num_calls, calls[num_calls - 1].time_ns / 1e6, procs, loops,
+        max_speed ? "maximum speed" : "recorded speed", cold ? ", cold processes" : "");
+
+    uint64_t start = now_ns();
+    for (p = 0; p < procs; p++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            fprintf(stderr, "Cannot fork: %s\n", strerror(errno));
+            return 1;
+        }
+        if (pid == 0) {
+            worker(p, procs, loops);
+            _exit(0);
+        }
+    }
+    while (wait(NULL) > 0);
+    uint64_t wall = now_ns() - start;
+
+    print_bench_header();
+    for (o = 0; o <= NUM_OPS; o++) {
+        uint64_t total = 0;
+        int misses = 0;
+        int n = 0;
+        for (i = 0; i < results; i++) {
+            if (o < NUM_OPS && (int)calls[i % num_calls].op != o) {
+                continue;
+            }
+            op_latencies[n++] = latencies[i];
+            total += latencies[i];
+            misses += !hits[i];
+        }
+        if (n == 0) {
+            continue;
+        }
+        print_latencies(o < NUM_OPS ? op_names[o] : "all", op_latencies, n, total);
+        if (misses) {
+            printf("  %d misses", misses);
+        }
+        printf("\n");
+    }
+    printf("Wall time: %.1f ms, %.0f calls/s\n\n", wall / 1e6, results * 1e9 / wall);
+
+    return 0;
+}
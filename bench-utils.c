@@ -0,0 +1,107 @@
+/*
+ * bench-utils.c : Timing and reporting shared by the benchmarks.
+ */
+
+#include "bench-utils.h"
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <nss.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(uint64_t *latencies, int n, double p) {
+    int i = (int)(p * (n - 1));
+    return latencies[i];
+}
+
+void print_bench_header(void) {
+    printf("%-28s %8s %9s %9s %9s %9s %10s %12s\n",
+        "case", "calls", "p50 ns", "p90 ns", "p99 ns", "p99.9 ns", "max ns", "calls/s");
+}
+
+/* Sort latencies and print their percentiles and the throughput, without
+ * ending the line so callers can add notes */
+void print_latencies(const char *name, uint64_t *latencies, int n, uint64_t total) {
+    if (n == 0) {
+        printf("%-28s %8d", name, 0);
+        return;
+    }
+    qsort(latencies, n, sizeof(uint64_t), compare_u64);
+    printf("%-28s %8d %9lu %9lu %9lu %9lu %10lu %12.0f",
+        name, n,
+        (unsigned long)percentile(latencies, n, 0.50),
+        (unsigned long)percentile(latencies, n, 0.90),
+        (unsigned long)percentile(latencies, n, 0.99),
+        (unsigned long)percentile(latencies, n, 0.999),
+        (unsigned long)latencies[n - 1],
+        total ? n * 1e9 / total : 0.0);
+}
+
+/* Time up to iterations calls of a case, then print its latency percentiles
+ * and throughput. latencies must have room for iterations entries.
+ * Returns the number of calls that didn't return the expected status. */
+int run_bench_case(struct bench_case *bench, int iterations, uint64_t *latencies) {
+    uint64_t total = 0;
+    int errors = 0;
+    int i;
+
+    for (i = 0; i < iterations && total < CASE_TIME_LIMIT_NS; i++) {
+        uint64_t start = now_ns();
+        int res = bench->fn(i);
+        latencies[i] = now_ns() - start;
+        total += latencies[i];
+        if (res != bench->expected) {
+            errors++;
+        }
+    }
+    print_latencies(bench->name, latencies, i, total);
+    if (errors) {
+        printf("  %d unexpected results", errors);
+    }
+    printf("\n");
+    return errors;
+}
+
+/* Route the passwd, group, shadow and initgroups databases to the module
+ * without touching /etc/nsswitch.conf. library is dlopen'ed first so the
+ * policy file can be set in it; glibc then finds it already loaded by its
+ * soname. Must be called before the first lookup. */
+int use_nss_module(const char *library, const char *policy_file, uint64_t *dlopen_ns) {
+    uint64_t start = now_ns();
+    void *handle = dlopen(library, RTLD_NOW | RTLD_GLOBAL);
+    *dlopen_ns = now_ns() - start;
+    if (handle == NULL) {
+        fprintf(stderr, "Cannot load %s: %s\n", library, dlerror());
+        return -1;
+    }
+    void (*set_policy_file)(const char *) = (void (*)(const char *))dlsym(handle, "set_policy_file");
+    if (set_policy_file == NULL) {
+        fprintf(stderr, "Cannot find set_policy_file in %s\n", library);
+        return -1;
+    }
+    set_policy_file(policy_file);
+
+    if (__nss_configure_lookup("passwd", "rightscale") != 0 ||
+        __nss_configure_lookup("group", "rightscale") != 0 ||
+        __nss_configure_lookup("shadow", "rightscale") != 0 ||
+        __nss_configure_lookup("initgroups", "rightscale") != 0) {
+        fprintf(stderr, "Cannot configure NSS lookups: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,23 @@
+#ifndef NSS_RIGHTSCALE_BENCH_UTILS_H
+#define NSS_RIGHTSCALE_BENCH_UTILS_H
+
+#include <stdint.h>
+
+/* Cases stop early once they have run this long, so slow ones don't dominate */
+#define CASE_TIME_LIMIT_NS 2000000000ULL
+
+/* A benchmarked call. fn gets the iteration number and returns a status that
+ * is compared with expected */
+struct bench_case {
+    const char *name;
+    int (*fn)(int);
+    int expected;
+};
+
+uint64_t now_ns(void);
+void print_bench_header(void);
+void print_latencies(const char *, uint64_t *, int, uint64_t);
+int run_bench_case(struct bench_case *, int, uint64_t *);
+int use_nss_module(const char *, const char *, uint64_t *);
+
+#endif
@@ -0,0 +1,489 @@
+/* Micro-benchmark for the _nss_rightscale_* entry points.
+ * Build and run against synthetic policies with: make bench
+ * Run against a given policy with:
+ *   ./rs-nss-bench [-t THREADS] POLICY_FILE [ITERATIONS]
+ *
+ * Each entry point is called directly, for names/uids that are in the policy
+ * (hit) and that aren't (miss), with a buffer large enough to never need an
+ * ERANGE retry. Latency percentiles and throughput are reported per case;
+ * a case stops early after two seconds.
+ *
+ * Then the policy file is parsed with each delimiter scanner the CPU supports,
+ * both to build the snapshot index and to scan for a missing user, and with
+ * the fgets/strsep/sscanf parser the module used to have, to report parse
+ * throughput in GB/s.
+ *
+ * Then getpwnam_r, getpwuid_r and getgrgid_r hits are run from 1, 2, 4, ...
+ * up to THREADS threads at once (default: one per online CPU) to show how
+ * throughput scales with the number of threads.
+ */
+
+#include "nss-rightscale.h"
+#include "utils.h"
+#include "policy.h"
+#include "scan.h"
+#include "bench-utils.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_KEYS 4096
+#define BENCH_BUF_SIZE (64 * 1024 * 1024)
+
+/* How long each thread count runs in the scaling benchmark */
+#define SCALING_TIME_NS 1000000000ULL
+#define THREAD_BUF_SIZE 16384
+
+/* How long each parser runs in the parse throughput benchmark */
+#define PARSE_TIME_NS 1000000000ULL
+
+/* Names and uids of users sampled from the policy, used as lookup keys */
+static char *names[MAX_KEYS];
+static uid_t uids[MAX_KEYS];
+static int num_keys;
+static int num_users;
+
+static char *buf;
+static int nss_errno;
+static int total_errors;
+
+static uint64_t *latencies;
+
+/* Sample up to MAX_KEYS users evenly from the policy file */
+static int load_keys(void) {
+    char line[POLICY_BUF_SIZE];
+    struct rs_user entry;
+    int line_no = 1;
+    struct rs_policy_file *pf = open_policy_file();
+    if (pf == NULL) {
+        return -1;
+    }
+    while (read_policy_entry(pf, line, sizeof(line), &entry, &line_no)) {
+        num_users++;
+    }
+    seek_policy_file(pf, 0);
+    line_no = 1;
+    int stride = num_users / MAX_KEYS + 1;
+    int i = 0;
+    while (read_policy_entry(pf, line, sizeof(line), &entry, &line_no)) {
+        if (i++ % stride == 0 && num_keys < MAX_KEYS) {
+            names[num_keys] = strdup(has_preferred_name(&entry) ? entry.preferred_name : entry.unique_name);
+            uids[num_keys] = entry.local_uid;
+            num_keys++;
+        }
+    }
+    close_policy_file(pf);
+    return 0;
+}
+
+static int bench_getpwnam_hit(int i) {
+    struct passwd pwd;
+    return _nss_rightscale_getpwnam_r(names[i % num_keys], &pwd, buf, BENCH_BUF_SIZE, &nss_errno);
+}
+
+static int bench_getpwnam_miss(int i) {
+    struct passwd pwd;
+    (void)i;
+    return _nss_rightscale_getpwnam_r("nosuchuser", &pwd, buf, BENCH_BUF_SIZE, &nss_errno);
+}
+
+static int bench_getpwuid_hit(int i) {
+    struct passwd pwd;
+    return _nss_rightscale_getpwuid_r(uids[i % num_keys], &pwd, buf, BENCH_BUF_SIZE, &nss_errno);
+}
+
+static int bench_getpwuid_miss(int i) {
+    struct passwd pwd;
+    return _nss_rightscale_getpwuid_r(3000000000u + i % 1000, &pwd, buf, BENCH_BUF_SIZE, &nss_errno);
+}
+
+static int bench_getspnam_hit(int i) {
+    struct spwd sp;
+    return _nss_rightscale_getspnam_r(names[i % num_keys], &sp, buf, BENCH_BUF_SIZE, &nss_errno);
+}
+
+static int bench_getspnam_miss(int i) {
+    struct spwd sp;
+    (void)i;
+    return _nss_rightscale_getspnam_r("nosuchuser", &sp, buf, BENCH_BUF_SIZE, &nss_errno);
+}
+
+static int bench_getgrnam_hit(int i) {
+    struct group grp;
+    return _nss_rightscale_getgrnam_r(names[i % num_keys], &grp, buf, BENCH_BUF_SIZE, &nss_errno);
+}
+
+static int bench_getgrnam_rightscale(int i) {
+    struct group grp;
+    (void)i;
+    return _nss_rightscale_getgrnam_r(RS_GROUP_NAME, &grp, buf, BENCH_BUF_SIZE, &nss_errno);
+}
+
+static int bench_getgrnam_miss(int i) {
+    struct group grp;
+    (void)i;
+    return _nss_rightscale_getgrnam_r("nosuchgroup", &grp, buf, BENCH_BUF_SIZE, &nss_errno);
+}
+
+static int bench_getgrgid_hit(int i) {
+    struct group grp;
+    return _nss_rightscale_getgrgid_r(uids[i % num_keys], &grp, buf, BENCH_BUF_SIZE, &nss_errno);
+}
+
+static int bench_getgrgid_sudo(int i) {
+    struct group grp;
+    (void)i;
+    return _nss_rightscale_getgrgid_r(RS_SUDO_GROUP_GID, &grp, buf, BENCH_BUF_SIZE, &nss_errno);
+}
+
+static int bench_getgrgid_miss(int i) {
+    struct group grp;
+    return _nss_rightscale_getgrgid_r(3000000000u + i % 1000, &grp, buf, BENCH_BUF_SIZE, &nss_errno);
+}
+
+static int bench_initgroups(const char *name) {
+    long int start = 0;
+    long int size = 8;
+    gid_t *groups = malloc(size * sizeof(gid_t));
+    int res = _nss_rightscale_initgroups_dyn(name, 0, &start, &size, &groups, 0, &nss_errno);
+    free(groups);
+    return res;
+}
+
+static int bench_initgroups_hit(int i) {
+    return bench_initgroups(names[i % num_keys]);
+}
+
+static int bench_initgroups_miss(int i) {
+    (void)i;
+    return bench_initgroups("nosuchuser");
+}
+
+static int bench_getpwent(int i) {
+    struct passwd pwd;
+    (void)i;
+    int res = _nss_rightscale_getpwent_r(&pwd, buf, BENCH_BUF_SIZE, &nss_errno);
+    if (res == NSS_STATUS_NOTFOUND) {
+        /* Start over once the whole policy has been enumerated */
+        _nss_rightscale_setpwent();
+        res = _nss_rightscale_getpwent_r(&pwd, buf, BENCH_BUF_SIZE, &nss_errno);
+    }
+    return res;
+}
+
+static int bench_getspent(int i) {
+    struct spwd sp;
+    (void)i;
+    int res = _nss_rightscale_getspent_r(&sp, buf, BENCH_BUF_SIZE, &nss_errno);
+    if (res == NSS_STATUS_NOTFOUND) {
+        _nss_rightscale_setspent();
+        res = _nss_rightscale_getspent_r(&sp, buf, BENCH_BUF_SIZE, &nss_errno);
+    }
+    return res;
+}
+
+static int bench_getgrent(int i) {
+    struct group grp;
+    (void)i;
+    int res = _nss_rightscale_getgrent_r(&grp, buf, BENCH_BUF_SIZE, &nss_errno);
+    if (res == NSS_STATUS_NOTFOUND) {
+        _nss_rightscale_setgrent();
+        res = _nss_rightscale_getgrent_r(&grp, buf, BENCH_BUF_SIZE, &nss_errno);
+    }
+    return res;
+}
+
+static struct bench_case cases[] = {
+    { "getpwnam_r hit", bench_getpwnam_hit, NSS_STATUS_SUCCESS },
+    { "getpwnam_r miss", bench_getpwnam_miss, NSS_STATUS_NOTFOUND },
+    { "getpwuid_r hit", bench_getpwuid_hit, NSS_STATUS_SUCCESS },
+    { "getpwuid_r miss", bench_getpwuid_miss, NSS_STATUS_NOTFOUND },
+    { "getspnam_r hit", bench_getspnam_hit, NSS_STATUS_SUCCESS },
+    { "getspnam_r miss", bench_getspnam_miss, NSS_STATUS_NOTFOUND },
+    { "getgrnam_r hit", bench_getgrnam_hit, NSS_STATUS_SUCCESS },
+    { "getgrnam_r rightscale", bench_getgrnam_rightscale, NSS_STATUS_SUCCESS },
+    { "getgrnam_r miss", bench_getgrnam_miss, NSS_STATUS_NOTFOUND },
+    { "getgrgid_r hit", bench_getgrgid_hit, NSS_STATUS_SUCCESS },
+    { "getgrgid_r sudo", bench_getgrgid_sudo, NSS_STATUS_SUCCESS },
+    { "getgrgid_r miss", bench_getgrgid_miss, NSS_STATUS_NOTFOUND },
+    { "initgroups_dyn hit", bench_initgroups_hit, NSS_STATUS_SUCCESS },
+    { "initgroups_dyn miss", bench_initgroups_miss, NSS_STATUS_NOTFOUND },
+    { "getpwent_r", bench_getpwent, NSS_STATUS_SUCCESS },
+    { "getspent_r", bench_getspent, NSS_STATUS_SUCCESS },
+    { "getgrent_r", bench_getgrent, NSS_STATUS_SUCCESS },
+};
+
+struct scaling_thread {
+    pthread_t thread;
+    int id;
+    uint64_t calls;
+    int errors;
+};
+
+static pthread_barrier_t scaling_start;
+static int scaling_stop;
+
+/* Cycle through getpwnam_r, getpwuid_r and getgrgid_r hits until told to stop */
+static void * scaling_worker(void *arg) {
+    struct scaling_thread *thread = arg;
+    char thread_buf[THREAD_BUF_SIZE];
+    struct passwd pwd;
+    struct group grp;
+    int err;
+    int res;
+    int i = thread->id * 7919;
+
+    pthread_barrier_wait(&scaling_start);
+    while (!__atomic_load_n(&scaling_stop, __ATOMIC_RELAXED)) {
+        int key = i % num_keys;
+        switch (i % 3) {
+        case 0:
+            res = _nss_rightscale_getpwnam_r(names[key], &pwd, thread_buf, sizeof(thread_buf), &err);
+            break;
+        case 1:
+            res = _nss_rightscale_getpwuid_r(uids[key], &pwd, thread_buf, sizeof(thread_buf), &err);
+            break;
+        default:
+            res = _nss_rightscale_getgrgid_r(uids[key], &grp, thread_buf, sizeof(thread_buf), &err);
+            break;
+        }
+        if (res != NSS_STATUS_SUCCESS) {
+            thread->errors++;
+        }
+        thread->calls++;
+        i++;
+    }
+    return NULL;
+}
+
+/* Run the worker from num_threads threads for SCALING_TIME_NS.
+ * Returns the total number of calls per second. */
+static double run_scaling(int num_threads, double base) {
+    struct scaling_thread *threads = calloc(num_threads, sizeof(struct scaling_thread));
+    uint64_t calls = 0;
+    int errors = 0;
+    int t;
+
+    scaling_stop = 0;
+    pthread_barrier_init(&scaling_start, NULL, num_threads + 1);
+    for (t = 0; t < num_threads; t++) {
+        threads[t].id = t;
+        pthread_create(&threads[t].thread, NULL, scaling_worker, &threads[t]);
+    }
+    pthread_barrier_wait(&scaling_start);
+    uint64_t start = now_ns();
+    struct timespec ts = { SCALING_TIME_NS / 1000000000, SCALING_TIME_NS % 1000000000 };
+    nanosleep(&ts, NULL);
+    __atomic_store_n(&scaling_stop, 1, __ATOMIC_RELAXED);
+    for (t = 0; t < num_threads; t++) {
+        pthread_join(threads[t].thread, NULL);
+        calls += threads[t].calls;
+        errors += threads[t].errors;
+    }
+    uint64_t elapsed = now_ns() - start;
+    pthread_barrier_destroy(&scaling_start);
+    free(threads);
+
+    double rate = calls * 1e9 / elapsed;
+    printf("%-8d %14.0f %14.0f %8.2fx", num_threads, rate, rate / num_threads,
+        base > 0 ? rate / base : 1.0);
+    if (errors) {
+        printf("  %d unexpected results", errors);
+    }
+    printf("\n");
+    total_errors += errors;
+    return rate;
+}
+
+/* The parser the module used to have, as a baseline: fgets into a fixed
+ * buffer, then strsep and sscanf per field. Returns the number of users. */
+static int parse_strsep(const char *policy_file) {
+    char line[POLICY_BUF_SIZE];
+    int users = 0;
+    FILE *fp = fopen(policy_file, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        uid_t rs_uid = 0;
+        uid_t local_uid = 0;
+        if (strlen(line) < 2) {
+            continue;
+        }
+        char *p = line;
+        char *preferred_name = strsep(&p, ":");
+        char *unique_name = strsep(&p, ":");
+        char *rs_uid_s = strsep(&p, ":");
+        char *local_uid_s = strsep(&p, ":");
+        if (local_uid_s != NULL) {
+            sscanf(local_uid_s, "%u", &local_uid);
+        }
+        if (rs_uid_s != NULL) {
+            sscanf(rs_uid_s, "%u", &rs_uid);
+        }
+        char *superuser_s = strsep(&p, ":");
+        char *gecos = strsep(&p, ":");
+        if (preferred_name != NULL && unique_name != NULL && superuser_s != NULL &&
+            gecos != NULL && rs_uid > 0 && local_uid > 500) {
+            users++;
+        }
+    }
+    fclose(fp);
+    return users;
+}
+
+/* Build the snapshot index from the text policy. Returns the number of users */
+static int parse_index(const char *policy_file) {
+    int err;
+    (void)policy_file;
+    struct rs_policy_file *pf = open_policy_file();
+    if (pf == NULL) {
+        return -1;
+    }
+    struct rs_policy_header *header = build_policy_image(pf, 0, &err);
+    close_policy_file(pf);
+    if (header == NULL) {
+        return -1;
+    }
+    int users = header->num_users;
+    free(header);
+    return users;
+}
+
+/* Scan the whole policy for a user that isn't there, as lookups do when
+ * there is no snapshot */
+static int parse_scan(const char *policy_file) {
+    char line[POLICY_BUF_SIZE];
+    struct rs_user entry;
+    int use_preferred;
+    (void)policy_file;
+    struct rs_policy_file *pf = open_policy_file();
+    if (pf == NULL) {
+        return -1;
+    }
+    int found = find_policy_entry_by_name(pf, line, sizeof(line), "nosuchuser", &entry, &use_preferred);
+    close_policy_file(pf);
+    return found ? -1 : 0;
+}
+
+/* Parse throughput in GB/s of running a parser for PARSE_TIME_NS, or a
+ * negative value if it fails */
+static double parse_throughput(int (*parse)(const char *), const char *policy_file, off_t size) {
+    uint64_t start = now_ns();
+    uint64_t elapsed;
+    long passes = 0;
+    do {
+        if (parse(policy_file) < 0) {
+            total_errors++;
+            return -1;
+        }
+        passes++;
+        elapsed = now_ns() - start;
+    } while (elapsed < PARSE_TIME_NS);
+    return (double)size * passes / elapsed;
+}
+
+static void run_parse_bench(const char *policy_file, off_t size) {
+    int i;
+
+    printf("\n%-12s %14s %14s\n", "parser", "index GB/s", "scan GB/s");
+    printf("%-12s %14s %14.2f\n", "strsep", "-", parse_throughput(parse_strsep, policy_file, size));
+    const char *scanner = get_policy_scanner();
+    for (i = 0; policy_scanner_names[i] != NULL; i++) {
+        if (!set_policy_scanner(policy_scanner_names[i])) {
+            continue;
+        }
+        double index = parse_throughput(parse_index, policy_file, size);
+        double scan = parse_throughput(parse_scan, policy_file, size);
+        printf("%-12s %14.2f %14.2f\n", policy_scanner_names[i], index, scan);
+    }
+    set_policy_scanner(scanner);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-t THREADS] POLICY_FILE [ITERATIONS]\n", prog);
+    exit(2);
+}
+
+int main(int argc, char *argv[]) {
+    struct passwd pwd;
+    struct stat st;
+    int iterations = 20000;
+    int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+    int c;
+
+    while ((opt = getopt(argc, argv, "t:h")) != -1) {
+        switch (opt) {
+        case 't':
+            max_threads = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 && optind != argc - 2) {
+        usage(argv[0]);
+    }
+    char *policy_file = argv[optind];
+    if (optind == argc - 2) {
+        iterations = atoi(argv[optind + 1]);
+    }
+    if (max_threads < 1) {
+        max_threads = 1;
+    }
+    set_policy_file(policy_file);
+    if (stat(policy_file, &st) != 0 || load_keys() != 0 || num_keys == 0) {
+        fprintf(stderr, "Cannot read users from %s\n", policy_file);
+        return 1;
+    }
+
+    buf = malloc(BENCH_BUF_SIZE);
+    latencies = malloc(sizeof(uint64_t) * iterations);
+    if (buf == NULL || latencies == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    printf("Policy %s: %d users, %ld bytes\n", policy_file, num_users, (long)st.st_size);
+
+    /* The first lookup in a process pays for loading the policy */
+    uint64_t start = now_ns();
+    _nss_rightscale_getpwnam_r(names[0], &pwd, buf, BENCH_BUF_SIZE, &nss_errno);
+    printf("First lookup: %lu ns\n", (unsigned long)(now_ns() - start));
+
+    print_bench_header();
+    for (c = 0; c < (int)(sizeof(cases) / sizeof(cases[0])); c++) {
+        total_errors += run_bench_case(&cases[c], iterations, latencies);
+    }
+    _nss_rightscale_endpwent();
+    _nss_rightscale_endspent();
+    _nss_rightscale_endgrent();
+
+    run_parse_bench(policy_file, st.st_size);
+
+    printf("\n%-8s %14s %14s %9s\n", "threads", "calls/s", "per thread", "scaling");
+    double base = 0;
+    int threads;
+    for (threads = 1; ; threads *= 2) {
+        if (threads > max_threads) {
+            threads = max_threads;
+        }
+        double rate = run_scaling(threads, base);
+        if (base == 0) {
+            base = rate;
+        }
+        if (threads == max_threads) {
+            break;
+        }
+    }
+    printf("\n");
+
+    return total_errors ? 1 : 0;
+}
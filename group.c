@@ -4,231 +4,229 @@
 
 #include "nss-rightscale.h"
 #include "utils.h"
+#include "policy.h"
+#include "nssd.h"
+#include "stats.h"
+#include "trace.h"
 
 #include <errno.h>
 #include <grp.h>
 #include <malloc.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <string.h>
 #include <unistd.h>
 
-/* struct used to store data used by getgrent. */
-struct group_data {
-    int group_counter;
-    struct group **users;
-    int num_users;
-    struct group *rightscale;
-    struct group *rightscale_sudo;
-};
-
-static struct group_data grent_data = { -1, NULL, 0, NULL, NULL };
-
-/* Reads through the entire policy file and compiles a list of groups. Currently
- * each user gets their own group and also belongs to the rightscale group.
- * Superusers additionally belong to the rightscale_sudo group */
-enum nss_status populate_groups(struct group_data *rs_groups) {
-    /* Rewind in case setgrent was called again */
-    rs_groups->group_counter = 0;
-
-    if (rs_groups->users != NULL) {
-        return NSS_STATUS_SUCCESS;
+/* struct used to store data used by getgrent. Groups are never stored: each
+ * user's private group is derived from the snapshot's users as we go. */
+static struct {
+    struct rs_policy *policy; /* Snapshot being enumerated, NULL before setgrent */
+    uint32_t user;            /* User whose private group(s) come next */
+    int preferred_seen;       /* The group named after their preferred name was returned */
+    int fixed_group;          /* Which of rightscale/rightscale_sudo comes next */
+} grent_data = { NULL, 0, FALSE, 0 };
+/* Guards grent_data, like pwent_lock */
+static pthread_mutex_t grent_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static enum nss_status setgrent_locked(void) {
+    trace_event(RS_EVENT_SETGRENT, 0);
+
+    int err;
+    struct rs_policy *policy = acquire_policy(&err);
+    if (policy == NULL) {
+        return policy_error_status(err);
     }
-    
-    FILE *fp = open_policy_file();
-    if (fp == NULL) {
-        return NSS_STATUS_UNAVAIL;
+    if (grent_data.policy != NULL) {
+        release_policy(grent_data.policy);
     }
-
-    int num_superusers = 0;
-    rs_groups->num_users = 0;
-    int line_no = 1;
-    struct rs_user *entry;
-    int rs_size = 16; /* initial size. we'll dynamically reallocate as needed */
-    int rs_sudo_size = 16; /* initial size. we'll dynamically reallocate as needed */
-
-    rs_groups->users = malloc(sizeof(struct group *)*rs_size);
-    rs_groups->rightscale = malloc(sizeof(struct group));
-    rs_groups->rightscale->gr_name = "rightscale";
-    rs_groups->rightscale->gr_passwd = "x";
-    rs_groups->rightscale->gr_gid = 10000;
-    rs_groups->rightscale->gr_mem = malloc(sizeof(char *)*rs_size);
-    rs_groups->rightscale_sudo = malloc(sizeof(struct group));
-    rs_groups->rightscale_sudo->gr_name = "rightscale_sudo";
-    rs_groups->rightscale_sudo->gr_passwd = "x";
-    rs_groups->rightscale_sudo->gr_gid = 10001;
-    rs_groups->rightscale_sudo->gr_mem = malloc(sizeof(char *)*rs_sudo_size);
-
-    // All users are part of the rightscale group.
-    // Only superusers are also part of the rightscale_sudo group.
-    while (entry = read_next_policy_entry(fp, &line_no)) {
-        if (entry->superuser == TRUE) {
-            if (strlen(entry->preferred_name) != 0 && strcmp(entry->preferred_name, entry->unique_name) != 0) {
-                rs_groups->rightscale_sudo->gr_mem[num_superusers] =
-                    malloc(sizeof(char)*(strlen(entry->preferred_name) + 1));
-                strcpy(rs_groups->rightscale_sudo->gr_mem[num_superusers], entry->preferred_name);
-                num_superusers += 1;
-            }
-            rs_groups->rightscale_sudo->gr_mem[num_superusers] =
-                malloc(sizeof(char)*(strlen(entry->unique_name) + 1));
-            strcpy(rs_groups->rightscale_sudo->gr_mem[num_superusers], entry->unique_name);
-            num_superusers += 1;
-            if (num_superusers > (rs_sudo_size - 2)) {
-                rs_sudo_size *= 2;
-                rs_groups->rightscale_sudo->gr_mem = realloc(rs_groups->rightscale_sudo->gr_mem, rs_sudo_size * sizeof(char *));
-            }
-        }
-        if (strlen(entry->preferred_name) != 0 && strcmp(entry->preferred_name, entry->unique_name) != 0) {
-            rs_groups->rightscale->gr_mem[rs_groups->num_users] = malloc(sizeof(char)*(strlen(entry->preferred_name) + 1));
-            strcpy(rs_groups->rightscale->gr_mem[rs_groups->num_users], entry->preferred_name);
-            rs_groups->users[rs_groups->num_users] = malloc(sizeof(struct group));
-            rs_groups->users[rs_groups->num_users]->gr_name = rs_groups->rightscale->gr_mem[rs_groups->num_users];
-            rs_groups->users[rs_groups->num_users]->gr_passwd = "x";
-            rs_groups->users[rs_groups->num_users]->gr_gid = entry->local_uid;
-            rs_groups->users[rs_groups->num_users]->gr_mem = malloc(sizeof(char *));
-            rs_groups->users[rs_groups->num_users]->gr_mem[0] = NULL;
-            rs_groups->num_users += 1;
-        }
-        rs_groups->rightscale->gr_mem[rs_groups->num_users] = malloc(sizeof(char)*(strlen(entry->unique_name) + 1));
-        strcpy(rs_groups->rightscale->gr_mem[rs_groups->num_users], entry->unique_name);
-        rs_groups->users[rs_groups->num_users] = malloc(sizeof(struct group));
-        rs_groups->users[rs_groups->num_users]->gr_name = rs_groups->rightscale->gr_mem[rs_groups->num_users];
-        rs_groups->users[rs_groups->num_users]->gr_passwd = "x";
-        rs_groups->users[rs_groups->num_users]->gr_gid = entry->local_uid;
-        rs_groups->users[rs_groups->num_users]->gr_mem = malloc(sizeof(char *));
-        rs_groups->users[rs_groups->num_users]->gr_mem[0] = NULL;
-        rs_groups->num_users += 1;
-
-        if (rs_groups->num_users > (rs_size - 2)) {
-            rs_size *= 2;
-            rs_groups->rightscale->gr_mem = realloc(rs_groups->rightscale->gr_mem, rs_size * sizeof(char *));
-            rs_groups->users = realloc(rs_groups->users, rs_size * sizeof(struct group *));
-        }
-
-        free_rs_user(entry);
-    }
-    rs_groups->rightscale_sudo->gr_mem[num_superusers] = NULL;
-    rs_groups->rightscale->gr_mem[rs_groups->num_users] = NULL;
-
-    close_policy_file(fp);
+    grent_data.policy = policy;
+    grent_data.user = 0;
+    grent_data.preferred_seen = FALSE;
+    grent_data.fixed_group = 0;
 
     return NSS_STATUS_SUCCESS;
 }
 
-/* Undoes everything done by populate_groups and free's all resources */
-void free_groups(struct group_data *rs_groups) {
-    int i;
-    rs_groups->group_counter = -1;
-    if (rs_groups->rightscale_sudo != NULL) {
-        for(i = 0; rs_groups->rightscale_sudo->gr_mem[i] != NULL; i++) {
-            free(rs_groups->rightscale_sudo->gr_mem[i]);
-        }
-        free(rs_groups->rightscale_sudo->gr_mem);
-        free(rs_groups->rightscale_sudo);
-        rs_groups->rightscale_sudo = NULL;
-
-    }
-    if (rs_groups->rightscale != NULL) {
-        for(i = 0; rs_groups->rightscale->gr_mem[i] != NULL; i++) {
-            free(rs_groups->rightscale->gr_mem[i]);
-        }
-        free(rs_groups->rightscale->gr_mem);
-        free(rs_groups->rightscale);
-        rs_groups->rightscale = NULL;
-    }
-    if (rs_groups->users != NULL) {
-        for(i = 0; i < rs_groups->num_users; i++) {
-            free(rs_groups->users[i]->gr_mem);
-            free(rs_groups->users[i]);
-        }
-        free(rs_groups->users);
-        rs_groups->num_users = 0;
-        rs_groups->users = NULL;
-    }
-
-}
-
 /* Setup everything needed to retrieve group entries. */
 enum nss_status _nss_rightscale_setgrent() {
-    NSS_DEBUG("rightscale setgrent\n");
-
-    enum nss_status res = populate_groups(&grent_data);
-    if (res != NSS_STATUS_SUCCESS) {
-        return res;
-    }
-
-    return NSS_STATUS_SUCCESS;
+    pthread_mutex_lock(&grent_lock);
+    enum nss_status res = setgrent_locked();
+    pthread_mutex_unlock(&grent_lock);
+    return res;
 }
 
 /* Free getgrent resources. */
 enum nss_status _nss_rightscale_endgrent() {
-    NSS_DEBUG("rightscale endgrent\n");
-    free_groups(&grent_data);
+    trace_event(RS_EVENT_ENDGRENT, 0);
+    pthread_mutex_lock(&grent_lock);
+    if (grent_data.policy != NULL) {
+        release_policy(grent_data.policy);
+        grent_data.policy = NULL;
+    }
+    pthread_mutex_unlock(&grent_lock);
     return NSS_STATUS_SUCCESS;
 }
 
-/* Return next group entry. */
-enum nss_status _nss_rightscale_getgrent_r(struct group *grbuf, char *buf,
+static enum nss_status getgrent_locked(struct group *grbuf, char *buf,
             size_t buflen, int *errnop) {
 
     enum nss_status res;
-    NSS_DEBUG("rightscale getgrent_r\n");
-    if (grent_data.group_counter == -1) {
-        res = _nss_rightscale_setgrent();
+    if (grent_data.policy == NULL) {
+        res = setgrent_locked();
         if (res != NSS_STATUS_SUCCESS) {
             *errnop = ENOENT;
             return res;
         }
     }
 
-    struct group *target_group;
-    if (grent_data.group_counter < grent_data.num_users) {
-        target_group = grent_data.users[grent_data.group_counter];
-    } else if (grent_data.group_counter == grent_data.num_users) {
-        target_group = grent_data.rightscale;
-    } else if (grent_data.group_counter == (grent_data.num_users + 1)) {
-        target_group = grent_data.rightscale_sudo;
+    struct rs_policy *policy = grent_data.policy;
+    if (grent_data.user < policy->num_users) {
+        struct rs_user entry;
+        get_policy_user(policy, grent_data.user, &entry);
+        int use_preferred = !grent_data.preferred_seen && has_preferred_name(&entry);
+        res = fill_policy_group(grbuf, buf, buflen,
+            use_preferred ? entry.preferred_name : entry.unique_name, entry.local_uid,
+            policy->strings, NULL, 0, errnop);
+        /* buffer was long enough this time */
+        if (!(res == NSS_STATUS_TRYAGAIN && (*errnop) == ERANGE)) {
+            if (use_preferred) {
+                grent_data.preferred_seen = TRUE;
+            } else {
+                grent_data.user += 1;
+                grent_data.preferred_seen = FALSE;
+            }
+        }
+        return res;
+    }
+
+    if (grent_data.fixed_group == 0) {
+        res = fill_rendered_group(grbuf, buf, buflen, policy->group, RS_GROUP_GID, errnop);
+    } else if (grent_data.fixed_group == 1) {
+        res = fill_rendered_group(grbuf, buf, buflen, policy->sudo_group,
+            RS_SUDO_GROUP_GID, errnop);
     } else {
         *errnop = ENOENT;
         return NSS_STATUS_NOTFOUND;
     }
-    res = fill_group(grbuf, buf, buflen, target_group, errnop);
     /* buffer was long enough this time */
-    if(!(res == NSS_STATUS_TRYAGAIN && (*errnop) == ERANGE)) {
-        grent_data.group_counter += 1;
+    if (!(res == NSS_STATUS_TRYAGAIN && (*errnop) == ERANGE)) {
+        grent_data.fixed_group += 1;
+    }
+    return res;
+}
+
+/* Return next group entry. Each user's private group comes first, under their
+ * preferred name if they have one and under their unique name, followed by
+ * rightscale and rightscale_sudo. */
+enum nss_status _nss_rightscale_getgrent_r(struct group *grbuf, char *buf,
+            size_t buflen, int *errnop) {
+    struct rs_call call;
+    start_call(&call);
+    pthread_mutex_lock(&grent_lock);
+    enum nss_status res = getgrent_locked(grbuf, buf, buflen, errnop);
+    pthread_mutex_unlock(&grent_lock);
+    end_call(&call, RS_STAT_GETGRENT, NULL, 0, res, *errnop);
+    return res;
+}
+
+/* Fill a group from a policy snapshot: rightscale, rightscale_sudo, or the
+ * private group of the given user */
+static enum nss_status fill_snapshot_group(struct rs_policy *policy, struct group *grbuf,
+            char *buf, size_t buflen, int group, int index, int use_preferred, int *errnop) {
+    struct rs_user entry;
+
+    if (group == RS_GROUP_GID) {
+        return fill_rendered_group(grbuf, buf, buflen, policy->group, RS_GROUP_GID, errnop);
+    }
+    if (group == RS_SUDO_GROUP_GID) {
+        return fill_rendered_group(grbuf, buf, buflen, policy->sudo_group,
+            RS_SUDO_GROUP_GID, errnop);
+    }
+
+    /* Each user has their own group with no members, derived from the user */
+    get_policy_user(policy, index, &entry);
+    return fill_policy_group(grbuf, buf, buflen,
+        use_preferred ? entry.preferred_name : entry.unique_name, entry.local_uid,
+        policy->strings, NULL, 0, errnop);
+}
+
+static enum nss_status lookup_grnam(const char *name, struct group *grbuf, char *buf,
+            size_t buflen, int *errnop) {
+    enum nss_status res;
+    if (nssd_getgrnam(name, grbuf, buf, buflen, errnop, &res)) {
+        return res;
     }
+
+    struct rs_policy *policy = acquire_policy(errnop);
+    if (policy == NULL) {
+        return policy_error_status(*errnop);
+    }
+
+    int index = -1;
+    int use_preferred = FALSE;
+    int group = 0;
+    if (strcmp(name, RS_GROUP_NAME) == 0) {
+        group = RS_GROUP_GID;
+    } else if (strcmp(name, RS_SUDO_GROUP_NAME) == 0) {
+        group = RS_SUDO_GROUP_GID;
+    } else {
+        index = find_policy_user_by_name(policy, name, &use_preferred);
+    }
+
+    if (group != 0 || index >= 0) {
+        res = fill_snapshot_group(policy, grbuf, buf, buflen, group, index, use_preferred, errnop);
+    } else {
+        res = NSS_STATUS_NOTFOUND;
+        *errnop = ENOENT;
+    }
+    release_policy(policy);
+
     return res;
 }
 
 /* Get group by name */
 enum nss_status _nss_rightscale_getgrnam_r(const char *name, struct group *grbuf,
             char *buf, size_t buflen, int *errnop) {
+    struct rs_call call;
+    start_call(&call);
+    enum nss_status res = lookup_grnam(name, grbuf, buf, buflen, errnop);
+    end_call(&call, RS_STAT_GETGRNAM, name, 0, res, *errnop);
+    return res;
+}
 
-    struct group_data rs_groups = { -1, NULL, 0, NULL, NULL };
-    enum nss_status res = populate_groups(&rs_groups);
-    if (res != NSS_STATUS_SUCCESS) {
+static enum nss_status lookup_grgid(gid_t gid, struct group *grbuf, char *buf,
+            size_t buflen, int *errnop) {
+    enum nss_status res;
+    if (nssd_getgrgid(gid, grbuf, buf, buflen, errnop, &res)) {
         return res;
     }
 
-    NSS_DEBUG("rightscale getgrnam_r: Looking for group %s\n", name);
-    if (strcmp(name, rs_groups.rightscale->gr_name) == 0) {
-        res = fill_group(grbuf, buf, buflen, rs_groups.rightscale, errnop);
-    } else if (strcmp(name, rs_groups.rightscale_sudo->gr_name) == 0) {
-        res = fill_group(grbuf, buf, buflen, rs_groups.rightscale_sudo, errnop);
+    struct rs_policy *policy = acquire_policy(errnop);
+    if (policy == NULL) {
+        return policy_error_status(*errnop);
+    }
+
+    int index = -1;
+    int use_preferred = FALSE;
+    int group = 0;
+    if (gid == RS_GROUP_GID || gid == RS_SUDO_GROUP_GID) {
+        group = gid;
     } else {
-        int i;
-        int found=FALSE;
-        for (i = 0; i < rs_groups.num_users && !found; i++) {
-            if (strcmp(name, rs_groups.users[i]->gr_name) == 0) {
-                found = TRUE;
-                res = fill_group(grbuf, buf, buflen, rs_groups.users[i], errnop);
-            }
-        }
-        if (!found) {
-            res = NSS_STATUS_NOTFOUND;
-            *errnop = ENOENT;
+        index = find_policy_user_by_uid(policy, gid);
+        if (index >= 0) {
+            struct rs_user entry;
+            get_policy_user(policy, index, &entry);
+            use_preferred = strlen(entry.preferred_name) != 0;
         }
     }
-    free_groups(&rs_groups);
+
+    if (group != 0 || index >= 0) {
+        res = fill_snapshot_group(policy, grbuf, buf, buflen, group, index, use_preferred, errnop);
+    } else {
+        res = NSS_STATUS_NOTFOUND;
+        *errnop = ENOENT;
+    }
+    release_policy(policy);
 
     return res;
 }
@@ -236,39 +234,99 @@ enum nss_status _nss_rightscale_getgrnam_r(const char *name, struct group *grbuf
 /* Get group by GID. */
 enum nss_status _nss_rightscale_getgrgid_r(gid_t gid, struct group *grbuf,
                char *buf, size_t buflen, int *errnop) {
+    struct rs_call call;
+    start_call(&call);
+    enum nss_status res = lookup_grgid(gid, grbuf, buf, buflen, errnop);
+    end_call(&call, RS_STAT_GETGRGID, NULL, gid, res, *errnop);
+    return res;
+}
 
-    struct group_data rs_groups = { -1, NULL, 0, NULL, NULL };
-    enum nss_status res = populate_groups(&rs_groups);
-    if (res != NSS_STATUS_SUCCESS) {
-        return res;
+/* Append a gid to the supplementary group list handed to us by glibc, growing
+ * it as needed. The user's primary group and duplicates are skipped. Returns
+ * FALSE only if the list could not be grown because we ran out of memory. */
+static int add_initgroup(gid_t gid, gid_t primary, long int *start, long int *size,
+            gid_t **groupsp, long int limit) {
+    gid_t *groups = *groupsp;
+    long int i;
+
+    if (gid == primary) {
+        return TRUE;
+    }
+    for (i = 0; i < *start; i++) {
+        if (groups[i] == gid) {
+            return TRUE;
+        }
     }
 
-    NSS_DEBUG("rightscale getgrgid_r: Looking for group #%d\n", gid);
-    if (gid == rs_groups.rightscale->gr_gid) {
-        res = fill_group(grbuf, buf, buflen, rs_groups.rightscale, errnop);
-    } else if (gid == rs_groups.rightscale_sudo->gr_gid) {
-        res = fill_group(grbuf, buf, buflen, rs_groups.rightscale_sudo, errnop);
+    if (*start == *size) {
+        long int new_size;
+        if (limit > 0 && *size >= limit) {
+            /* Caller doesn't want any more groups */
+            return TRUE;
+        }
+        new_size = 2 * *size;
+        if (limit > 0 && new_size > limit) {
+            new_size = limit;
+        }
+        groups = realloc(groups, new_size * sizeof(gid_t));
+        if (groups == NULL) {
+            return FALSE;
+        }
+        *groupsp = groups;
+        *size = new_size;
+    }
+
+    groups[*start] = gid;
+    *start += 1;
+    return TRUE;
+}
+
+static enum nss_status lookup_initgroups(const char *user, gid_t group, long int *start,
+            long int *size, gid_t **groupsp, long int limit, int *errnop) {
+    struct rs_user entry;
+    enum nss_status res;
+    gid_t gids[RS_NSSD_MAX_GROUPS];
+    int num_gids = 0;
+    int i;
+    if (nssd_initgroups(user, gids, &num_gids, errnop, &res)) {
+        if (res != NSS_STATUS_SUCCESS) {
+            return res;
+        }
     } else {
-        int i;
-        int found=FALSE;
-        for (i = 0; i < rs_groups.num_users && !found; i++) {
-            if (gid == rs_groups.users[i]->gr_gid) {
-                found = TRUE;
-                res = fill_group(grbuf, buf, buflen, rs_groups.users[i], errnop);
-            }
+        struct rs_lookup lookup;
+        int use_preferred;
+        res = lookup_user_by_name(&lookup, user, &entry, &use_preferred, errnop);
+        if (res != NSS_STATUS_SUCCESS) {
+            end_lookup(&lookup);
+            return res;
         }
-        if (!found) {
-            res = NSS_STATUS_NOTFOUND;
-            *errnop = ENOENT;
+        gids[num_gids++] = entry.local_uid;
+        gids[num_gids++] = RS_GROUP_GID;
+        if (entry.superuser == TRUE) {
+            gids[num_gids++] = RS_SUDO_GROUP_GID;
         }
+        end_lookup(&lookup);
     }
-    free_groups(&rs_groups);
 
-    return res;
+    for (i = 0; i < num_gids; i++) {
+        if (!add_initgroup(gids[i], group, start, size, groupsp, limit)) {
+            *errnop = ENOMEM;
+            return NSS_STATUS_TRYAGAIN;
+        }
+    }
+
+    return NSS_STATUS_SUCCESS;
 }
 
-/* Debugging helper */
-void print_group(struct group *entry) {
-    NSS_DEBUG("group (%p) gr_name %s gr_mem (%p) gr_gid %d\n",
-        entry, entry->gr_name, entry->gr_mem, entry->gr_gid);
+/* Get the groups a user belongs to, without enumerating the whole group
+ * database: the user-private group, rightscale, and rightscale_sudo for
+ * superusers. Answered by rightscale-nssd or from the cached policy snapshot. */
+enum nss_status _nss_rightscale_initgroups_dyn(const char *user, gid_t group,
+            long int *start, long int *size, gid_t **groupsp, long int limit,
+            int *errnop) {
+    struct rs_call call;
+    start_call(&call);
+    enum nss_status res = lookup_initgroups(user, group, start, size, groupsp, limit, errnop);
+    end_call(&call, RS_STAT_INITGROUPS, user, 0, res, *errnop);
+    return res;
 }
@@ -15,16 +15,15 @@
 #include <pwd.h>
 #include <shadow.h>
 
-/* Print debug messages. Only to stdout for now */
-#ifdef DEBUG
-#define NSS_DEBUG(msg, ...) printf((msg), ## __VA_ARGS__)
-#else
-#define NSS_DEBUG(msg, ...)
-#endif
-
 #define FALSE 0
 #define TRUE !FALSE
 
+/* Groups every policy user belongs to */
+#define RS_GROUP_NAME "rightscale"
+#define RS_GROUP_GID 10000
+#define RS_SUDO_GROUP_NAME "rightscale_sudo"
+#define RS_SUDO_GROUP_GID 10001
+
 /* Struct defining an entry in the /var/lib/rightlink/login_policy file */
 struct rs_user {
     char *preferred_name; /* Preferred login name. May not be stable over time */
@@ -50,6 +49,8 @@ enum nss_status _nss_rightscale_setgrent();
 enum nss_status _nss_rightscale_endgrent();
 enum nss_status _nss_rightscale_getgrent_r(struct group *, char *, size_t, int *);
 enum nss_status _nss_rightscale_getgrnam_r(const char *, struct group *, char *, size_t, int *);
-enum nss_status _nss_rightscale_getgruid_r(uid_t, struct group *, char *, size_t, int *);
+enum nss_status _nss_rightscale_getgrgid_r(gid_t, struct group *, char *, size_t, int *);
+enum nss_status _nss_rightscale_initgroups_dyn(const char *, gid_t, long int *, long int *,
+            gid_t **, long int, int *);
 
 #endif
@@ -0,0 +1,378 @@
+/*
+ * nssd.c : Client side of rightscale-nssd. Lookups are tried against the
+ * daemon first; if it isn't running or doesn't answer, the caller reads the
+ * policy file itself.
+ */
+
+#include "nss-rightscale.h"
+#include "utils.h"
+#include "policy.h"
+#include "settings.h"
+#include "nssd.h"
+#include "trace.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+/* How long to wait on the daemon before giving up on it */
+#define NSSD_TIMEOUT_MS 1000
+
+/* How long to leave the daemon alone once it failed to answer */
+#define NSSD_RETRY_MS 5000
+
+/* Socket to use instead of the configured one, or NULL */
+static char *nssd_socket = NULL;
+
+/* Most idle connections to the daemon a process keeps */
+#define NSSD_IDLE_CONNS 4
+
+/* Idle connections to the daemon. A lookup checks one out, or opens a new
+ * one if there is none, and talks to the daemon without holding nssd_lock,
+ * so threads don't wait on each other's round trips. A forked child drops
+ * its parent's rather than read replies meant for it. */
+static struct {
+    int fd[NSSD_IDLE_CONNS];
+    int num_idle;
+    pid_t pid;            /* Whose connections they are */
+    uint32_t generation;  /* Bumped when the socket changes */
+    uint64_t retry_ms;    /* Don't connect again before this */
+} nssd_conns = { { 0 }, 0, 0, 0, 0 };
+static uint32_t nssd_next_id = 0;
+static pthread_mutex_t nssd_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* A reply and its data, which is in buf if it fits and malloc'ed otherwise */
+struct nssd_answer {
+    struct rs_nssd_reply reply;
+    char *data;
+    uint64_t buf[POLICY_BUF_SIZE / sizeof(uint64_t)];
+};
+
+static uint64_t nssd_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Close the idle connections. Must hold nssd_lock */
+static void nssd_close_idle(void) {
+    while (nssd_conns.num_idle > 0) {
+        close(nssd_conns.fd[--nssd_conns.num_idle]);
+    }
+}
+
+/* Talk to the daemon on the given socket rather than the configured one.
+ * NULL goes back to the configured one. */
+void set_nssd_socket(char *path) {
+    pthread_mutex_lock(&nssd_lock);
+    nssd_socket = path;
+    nssd_close_idle();
+    nssd_conns.generation++;
+    nssd_conns.retry_ms = 0;
+    pthread_mutex_unlock(&nssd_lock);
+}
+
+/* Socket of the daemon, or NULL if it isn't to be used */
+static const char * nssd_socket_path(void) {
+    if (nssd_socket != NULL) {
+        return nssd_socket;
+    }
+    /* The daemon serves the default policy file only */
+    if (!is_default_policy_file()) {
+        return NULL;
+    }
+    const char *path = get_settings()->nssd_socket;
+    return path[0] != '\0' ? path : NULL;
+}
+
+static int nssd_connect(const char *path) {
+    struct sockaddr_un addr;
+    struct timeval timeout = { NSSD_TIMEOUT_MS / 1000, (NSSD_TIMEOUT_MS % 1000) * 1000 };
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) != 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) != 0 ||
+        connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int nssd_send(int fd, const void *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return FALSE;
+        }
+        buf = (const char *)buf + n;
+        len -= n;
+    }
+    return TRUE;
+}
+
+static int nssd_recv(int fd, void *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = recv(fd, buf, len, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return FALSE;
+        }
+        buf = (char *)buf + n;
+        len -= n;
+    }
+    return TRUE;
+}
+
+static void nssd_done(struct nssd_answer *answer) {
+    if (answer->data != (char *)answer->buf) {
+        free(answer->data);
+    }
+}
+
+/* Send a request and read its reply on a checked out connection */
+static int nssd_exchange(int fd, struct rs_nssd_request *request, const char *name,
+    struct nssd_answer *answer) {
+    if (!nssd_send(fd, request, sizeof(*request)) ||
+        !nssd_send(fd, name, request->len) ||
+        !nssd_recv(fd, &answer->reply, sizeof(answer->reply)) ||
+        answer->reply.id != request->id || answer->reply.len > RS_NSSD_MAX_REPLY) {
+        return FALSE;
+    }
+    answer->data = (char *)answer->buf;
+    if (answer->reply.len > sizeof(answer->buf)) {
+        answer->data = malloc(answer->reply.len);
+        if (answer->data == NULL) {
+            return FALSE;
+        }
+    }
+    if (!nssd_recv(fd, answer->data, answer->reply.len)) {
+        nssd_done(answer);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* Give back a checked out connection, or -1 if none could be opened, and
+ * whether the daemon answered on it. Connections it didn't answer on are
+ * closed and the daemon is left alone for a while. */
+static void nssd_checkin(int fd, uint32_t generation, int answered) {
+    if (!answered) {
+        trace_event(RS_EVENT_NSSD_UNANSWERED, 0);
+    }
+    pthread_mutex_lock(&nssd_lock);
+    if (answered && generation == nssd_conns.generation && nssd_conns.pid == getpid() &&
+        nssd_conns.num_idle < NSSD_IDLE_CONNS) {
+        nssd_conns.fd[nssd_conns.num_idle++] = fd;
+        fd = -1;
+    }
+    if (!answered) {
+        nssd_conns.retry_ms = nssd_now_ms() + NSSD_RETRY_MS;
+    }
+    pthread_mutex_unlock(&nssd_lock);
+
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+/* Check out a connection to the daemon at path: an idle one, or a new one
+ * unless the daemon failed to answer lately. Sets generation for
+ * nssd_checkin. Returns -1 if there is none. */
+static int nssd_checkout(const char *path, uint32_t *generation) {
+    int fd = -1;
+
+    pthread_mutex_lock(&nssd_lock);
+    if (nssd_conns.pid != getpid()) {
+        nssd_close_idle();
+        nssd_conns.pid = getpid();
+    }
+    if (nssd_conns.num_idle > 0) {
+        fd = nssd_conns.fd[--nssd_conns.num_idle];
+    }
+    int connect = fd < 0 && nssd_now_ms() >= nssd_conns.retry_ms;
+    *generation = nssd_conns.generation;
+    pthread_mutex_unlock(&nssd_lock);
+
+    if (connect) {
+        fd = nssd_connect(path);
+        if (fd < 0) {
+            nssd_checkin(fd, *generation, FALSE);
+        }
+    }
+    return fd;
+}
+
+/* Ask the daemon. Returns FALSE if it isn't used, can't be reached or
+ * told us to look the entry up ourselves. */
+static int nssd_ask(uint16_t type, const char *name, uint32_t uid, struct nssd_answer *answer) {
+    struct rs_nssd_request request;
+    size_t len = name != NULL ? strlen(name) : 0;
+    uint32_t generation;
+
+    if (len > RS_NSSD_MAX_NAME) {
+        return FALSE;
+    }
+    const char *path = nssd_socket_path();
+    if (path == NULL) {
+        return FALSE;
+    }
+    int fd = nssd_checkout(path, &generation);
+    if (fd < 0) {
+        return FALSE;
+    }
+    request.len = len;
+    request.type = type;
+    request.reserved = 0;
+    request.id = __atomic_fetch_add(&nssd_next_id, 1, __ATOMIC_RELAXED);
+    request.uid = uid;
+    int answered = nssd_exchange(fd, &request, name, answer);
+    nssd_checkin(fd, generation, answered);
+
+    if (answered && answer->reply.status == NSS_STATUS_UNAVAIL) {
+        nssd_done(answer);
+        return FALSE;
+    }
+    if (answered) {
+        trace_flag(RS_TRACE_NSSD);
+    }
+    return answered;
+}
+
+/* Hand a failed lookup's status to the caller. Returns FALSE if it was a
+ * success, whose data is for the caller to use. */
+static int nssd_failed(struct nssd_answer *answer, int *errnop, enum nss_status *res) {
+    if (answer->reply.status == NSS_STATUS_SUCCESS) {
+        return FALSE;
+    }
+    *res = answer->reply.status;
+    *errnop = answer->reply.err;
+    return TRUE;
+}
+
+static int nssd_passwd(uint16_t type, const char *name, uid_t uid, struct passwd *pwbuf,
+    char *buf, size_t buflen, int *errnop, enum nss_status *res) {
+    struct nssd_answer answer;
+
+    if (!nssd_ask(type, name, uid, &answer)) {
+        return FALSE;
+    }
+    int answered = TRUE;
+    if (!nssd_failed(&answer, errnop, res)) {
+        answered = rendered_valid(answer.data, answer.reply.len, 0, 4);
+        if (answered) {
+            *res = fill_rendered_passwd(pwbuf, buf, buflen,
+                (struct rs_rendered *)answer.data, answer.reply.uid, errnop);
+        }
+    }
+    nssd_done(&answer);
+    return answered;
+}
+
+static int nssd_group(uint16_t type, const char *name, gid_t gid, struct group *grbuf,
+    char *buf, size_t buflen, int *errnop, enum nss_status *res) {
+    struct nssd_answer answer;
+
+    if (!nssd_ask(type, name, gid, &answer)) {
+        return FALSE;
+    }
+    int answered = TRUE;
+    if (!nssd_failed(&answer, errnop, res)) {
+        answered = rendered_group_valid(answer.data, answer.reply.len, 0);
+        if (answered) {
+            *res = fill_rendered_group(grbuf, buf, buflen,
+                (struct rs_rendered_group *)answer.data, answer.reply.uid, errnop);
+        }
+    }
+    nssd_done(&answer);
+    return answered;
+}
+
+/* The functions below return FALSE if the daemon didn't answer, in which
+ * case the caller looks the entry up itself. Otherwise res and errnop are
+ * what the lookup returns. */
+
+int nssd_getpwnam(const char *name, struct passwd *pwbuf, char *buf, size_t buflen,
+    int *errnop, enum nss_status *res) {
+    return nssd_passwd(RS_NSSD_GETPWNAM, name, 0, pwbuf, buf, buflen, errnop, res);
+}
+
+int nssd_getpwuid(uid_t uid, struct passwd *pwbuf, char *buf, size_t buflen,
+    int *errnop, enum nss_status *res) {
+    return nssd_passwd(RS_NSSD_GETPWUID, NULL, uid, pwbuf, buf, buflen, errnop, res);
+}
+
+int nssd_getspnam(const char *name, struct spwd *spbuf, char *buf, size_t buflen,
+    int *errnop, enum nss_status *res) {
+    struct nssd_answer answer;
+
+    if (!nssd_ask(RS_NSSD_GETSPNAM, name, 0, &answer)) {
+        return FALSE;
+    }
+    int answered = TRUE;
+    if (!nssd_failed(&answer, errnop, res)) {
+        answered = rendered_valid(answer.data, answer.reply.len, 0, 1);
+        if (answered) {
+            *res = fill_rendered_spwd(spbuf, buf, buflen,
+                (struct rs_rendered *)answer.data, errnop);
+        }
+    }
+    nssd_done(&answer);
+    return answered;
+}
+
+int nssd_getgrnam(const char *name, struct group *grbuf, char *buf, size_t buflen,
+    int *errnop, enum nss_status *res) {
+    return nssd_group(RS_NSSD_GETGRNAM, name, 0, grbuf, buf, buflen, errnop, res);
+}
+
+int nssd_getgrgid(gid_t gid, struct group *grbuf, char *buf, size_t buflen,
+    int *errnop, enum nss_status *res) {
+    return nssd_group(RS_NSSD_GETGRGID, NULL, gid, grbuf, buf, buflen, errnop, res);
+}
+
+/* Get the gids of the groups a user belongs to, at most RS_NSSD_MAX_GROUPS */
+int nssd_initgroups(const char *user, gid_t *gids, int *num_gids, int *errnop,
+    enum nss_status *res) {
+    struct nssd_answer answer;
+    int i;
+
+    if (!nssd_ask(RS_NSSD_INITGROUPS, user, 0, &answer)) {
+        return FALSE;
+    }
+    int answered = TRUE;
+    if (!nssd_failed(&answer, errnop, res)) {
+        answered = answer.reply.len % sizeof(uint32_t) == 0 &&
+            answer.reply.len <= RS_NSSD_MAX_GROUPS * sizeof(uint32_t);
+        if (answered) {
+            *num_gids = answer.reply.len / sizeof(uint32_t);
+            for (i = 0; i < *num_gids; i++) {
+                gids[i] = ((uint32_t *)answer.data)[i];
+            }
+            *res = NSS_STATUS_SUCCESS;
+        }
+    }
+    nssd_done(&answer);
+    return answered;
+}
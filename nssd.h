@@ -0,0 +1,73 @@
+#ifndef NSS_RIGHTSCALE_NSSD_H
+#define NSS_RIGHTSCALE_NSSD_H
+
+#include <grp.h>
+#include <pwd.h>
+#include <shadow.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Protocol spoken between the NSS module and rightscale-nssd over a Unix
+ * stream socket. Both ends are on the same host, so everything is in host
+ * byte order.
+ *
+ * A client writes requests and reads one reply per request, in order. It
+ * may write several requests before reading any reply. A reply carries the
+ * entry rendered exactly as the module renders it in a policy snapshot, so
+ * the client fills the caller's struct with the same single copy.
+ */
+#define RS_NSSD_SOCKET "/var/run/rightscale-nssd.socket"
+
+/* Request types */
+enum {
+    RS_NSSD_GETPWNAM = 1,
+    RS_NSSD_GETPWUID,
+    RS_NSSD_GETSPNAM,
+    RS_NSSD_GETGRNAM,
+    RS_NSSD_GETGRGID,
+    RS_NSSD_INITGROUPS
+};
+
+/* Longest name a request can carry */
+#define RS_NSSD_MAX_NAME 1024
+
+/* Largest reply a client accepts */
+#define RS_NSSD_MAX_REPLY (64 * 1024 * 1024)
+
+struct rs_nssd_request {
+    uint32_t len;      /* Of the name that follows, which is not NUL terminated */
+    uint16_t type;
+    uint16_t reserved;
+    uint32_t id;       /* Echoed in the reply */
+    uint32_t uid;      /* For lookups by uid or gid */
+};
+
+struct rs_nssd_reply {
+    uint32_t len;      /* Of the data that follows */
+    uint32_t id;
+    int32_t status;    /* enum nss_status */
+    int32_t err;       /* errno to return with it */
+    uint32_t uid;      /* Of the passwd entry, or gid of the group */
+    uint32_t reserved;
+};
+
+/* The data of a successful reply is, by request type:
+ *   passwd, shadow: struct rs_rendered and its strings
+ *   group: struct rs_rendered_group and its layout
+ *   initgroups: uint32_t gids of the user's groups
+ * Replies of NSS_STATUS_UNAVAIL have no data and mean the client should look
+ * the entry up itself, as it would without the daemon. */
+
+/* Most groups an initgroups reply lists */
+#define RS_NSSD_MAX_GROUPS 3
+
+void set_nssd_socket(char *);
+int nssd_getpwnam(const char *, struct passwd *, char *, size_t, int *, enum nss_status *);
+int nssd_getpwuid(uid_t, struct passwd *, char *, size_t, int *, enum nss_status *);
+int nssd_getspnam(const char *, struct spwd *, char *, size_t, int *, enum nss_status *);
+int nssd_getgrnam(const char *, struct group *, char *, size_t, int *, enum nss_status *);
+int nssd_getgrgid(gid_t, struct group *, char *, size_t, int *, enum nss_status *);
+int nssd_initgroups(const char *, gid_t *, int *, int *, enum nss_status *);
+
+#endif
@@ -4,168 +4,163 @@
 
 #include "nss-rightscale.h"
 #include "utils.h"
+#include "policy.h"
+#include "nssd.h"
+#include "stats.h"
+#include "trace.h"
 
 #include <errno.h>
 #include <grp.h>
 #include <malloc.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <string.h>
 #include <unistd.h>
 
 
-/* struct used to store data used by getpwent. */
+/* struct used to store data used by getpwent. Entries are never stored:
+ * each comes from a user's rendered entries in the snapshot. */
 static struct {
-    FILE* fp;
-    int line_no;
-    int entry_seen_count;
-} pwent_data = { NULL, 1, 0 };
+    struct rs_policy *policy; /* Snapshot being enumerated, NULL before setpwent */
+    uint32_t user;            /* User whose entries come next */
+    int preferred_seen;       /* The entry under their preferred name was returned */
+} pwent_data = { NULL, 0, FALSE };
+/* Guards pwent_data. glibc serializes set/get/endpwent itself, but the
+ * entry points can also be called directly by threaded programs. */
+static pthread_mutex_t pwent_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static enum nss_status setpwent_locked(void) {
+    trace_event(RS_EVENT_SETPWENT, 0);
+
+    int err;
+    struct rs_policy *policy = acquire_policy(&err);
+    if (policy == NULL) {
+        return policy_error_status(err);
+    }
+    if (pwent_data.policy != NULL) {
+        release_policy(pwent_data.policy);
+    }
+    pwent_data.policy = policy;
+    pwent_data.user = 0;
+    pwent_data.preferred_seen = FALSE;
+    return NSS_STATUS_SUCCESS;
+}
 
 /* Setup everything needed to retrieve passwd entries. */
 enum nss_status _nss_rightscale_setpwent() {
-    NSS_DEBUG("rightscale setpwent\n");
-    if (pwent_data.fp == NULL) {
-        pwent_data.fp = open_policy_file();
-        if (pwent_data.fp == NULL) {
-            return NSS_STATUS_UNAVAIL;
-        }
-    } else {
-      rewind(pwent_data.fp);
-    }
-    pwent_data.line_no = 1;
-    pwent_data.entry_seen_count = 0;
-    return NSS_STATUS_SUCCESS;
+    pthread_mutex_lock(&pwent_lock);
+    enum nss_status res = setpwent_locked();
+    pthread_mutex_unlock(&pwent_lock);
+    return res;
 }
 
 /* Free getpwent resources. */
 enum nss_status _nss_rightscale_endpwent() {
-    NSS_DEBUG("rightscale endpwent\n");
-    if (pwent_data.fp != NULL) {
-        close_policy_file(pwent_data.fp);
-        pwent_data.fp = NULL;
+    trace_event(RS_EVENT_ENDPWENT, 0);
+    pthread_mutex_lock(&pwent_lock);
+    if (pwent_data.policy != NULL) {
+        release_policy(pwent_data.policy);
+        pwent_data.policy = NULL;
     }
+    pthread_mutex_unlock(&pwent_lock);
     return NSS_STATUS_SUCCESS;
 }
 
-/* Reentrant return next passwd entry. */
-enum nss_status _nss_rightscale_getpwent_r(struct passwd *pwbuf, char *buf, size_t buflen, int *errnop) {
-
+static enum nss_status getpwent_locked(struct passwd *pwbuf, char *buf, size_t buflen, int *errnop) {
     enum nss_status res;
-    NSS_DEBUG("rightscale getpwent_r\n");
-    if (pwent_data.fp == NULL) {
-        res = _nss_rightscale_setpwent();
+    if (pwent_data.policy == NULL) {
+        res = setpwent_locked();
         if (res != NSS_STATUS_SUCCESS) {
             *errnop = ENOENT;
             return res;
         }
     }
 
-    int previous_line_no = pwent_data.line_no;
-    fpos_t previous_pos;
-    fgetpos(pwent_data.fp, &previous_pos);
-    struct rs_user *entry;
-
-    entry = read_next_policy_entry(pwent_data.fp, &pwent_data.line_no);
-
-    if (entry == NULL) {
+    struct rs_policy *policy = pwent_data.policy;
+    if (pwent_data.user >= policy->num_users) {
         *errnop = ENOENT;
         return NSS_STATUS_NOTFOUND;
     }
-
-    int use_preferred = TRUE;
-    if (strlen(entry->preferred_name) == 0 || strcmp(entry->preferred_name, entry->unique_name) == 0) {
-        pwent_data.entry_seen_count = 1;
-    }
-    if (pwent_data.entry_seen_count == 1) {
-        use_preferred = FALSE;
-    } 
-
-    res = fill_passwd(pwbuf, buf, buflen, entry, use_preferred, errnop);
-    free_rs_user(entry);
-    // Rewind and re-read the current entry
-    if(res == NSS_STATUS_TRYAGAIN && (*errnop) == ERANGE) {
-        pwent_data.line_no = previous_line_no;
-        fsetpos(pwent_data.fp, &previous_pos);
-    } else {
-        if (pwent_data.entry_seen_count == 0) {
-            pwent_data.line_no = previous_line_no;
-            fsetpos(pwent_data.fp, &previous_pos);
-            pwent_data.entry_seen_count = 1;
+    struct rs_user entry;
+    get_policy_user(policy, pwent_data.user, &entry);
+    int use_preferred = !pwent_data.preferred_seen && has_preferred_name(&entry);
+    res = fill_policy_passwd(policy, pwent_data.user, use_preferred, pwbuf, buf, buflen, errnop);
+    /* buffer was long enough this time */
+    if (!(res == NSS_STATUS_TRYAGAIN && (*errnop) == ERANGE)) {
+        if (use_preferred) {
+            pwent_data.preferred_seen = TRUE;
         } else {
-            pwent_data.entry_seen_count = 0;
+            pwent_data.user += 1;
+            pwent_data.preferred_seen = FALSE;
         }
     }
     return res;
+}
 
+/* Reentrant return next passwd entry. */
+enum nss_status _nss_rightscale_getpwent_r(struct passwd *pwbuf, char *buf, size_t buflen, int *errnop) {
+    struct rs_call call;
+    start_call(&call);
+    pthread_mutex_lock(&pwent_lock);
+    enum nss_status res = getpwent_locked(pwbuf, buf, buflen, errnop);
+    pthread_mutex_unlock(&pwent_lock);
+    end_call(&call, RS_STAT_GETPWENT, NULL, 0, res, *errnop);
+    return res;
 }
 
-/* Get user info by username. */
-enum nss_status _nss_rightscale_getpwnam_r(const char *name, struct passwd *pwbuf,
-            char *buf, size_t buflen, int *errnop) {
+static enum nss_status lookup_pwnam(const char *name, struct passwd *pwbuf, char *buf,
+            size_t buflen, int *errnop) {
     enum nss_status res;
-    struct rs_user *entry;
-
-    NSS_DEBUG("rightscale getpwnam_r: Looking for user %s\n", name);
+    struct rs_user entry;
 
-    FILE *fp = open_policy_file();
-    if (fp == NULL) {
-        *errnop = ENOENT;
-        return NSS_STATUS_UNAVAIL;
-    }
-    int found = FALSE;
-    int line_no = 1;
-    while ((entry = read_next_policy_entry(fp, &line_no)) && !found) {
-        if (strcmp(entry->preferred_name, name) == 0 && 
-            strlen(entry->preferred_name) != 0 && 
-            strcmp(entry->preferred_name, entry->unique_name) != 0) {
-            found = TRUE;
-            res = fill_passwd(pwbuf, buf, buflen, entry, TRUE, errnop);
-        } else if (strcmp(entry->unique_name, name) == 0) {
-            found = TRUE;
-            res = fill_passwd(pwbuf, buf, buflen, entry, FALSE, errnop);
-        }
-        free_rs_user(entry);
+    if (nssd_getpwnam(name, pwbuf, buf, buflen, errnop, &res)) {
+        return res;
     }
 
-    /* We've gotten to the end of file without finding anything */
-    if (!found) {
-        res = NSS_STATUS_NOTFOUND;
-        *errnop = ENOENT;
+    struct rs_lookup lookup;
+    int use_preferred;
+    res = lookup_user_by_name(&lookup, name, &entry, &use_preferred, errnop);
+    if (res == NSS_STATUS_SUCCESS) {
+        res = fill_lookup_passwd(&lookup, pwbuf, buf, buflen, &entry, use_preferred, errnop);
     }
+    end_lookup(&lookup);
+    return res;
+}
 
-    close_policy_file(fp);
+/* Get user info by username. */
+enum nss_status _nss_rightscale_getpwnam_r(const char *name, struct passwd *pwbuf,
+            char *buf, size_t buflen, int *errnop) {
+    struct rs_call call;
+    start_call(&call);
+    enum nss_status res = lookup_pwnam(name, pwbuf, buf, buflen, errnop);
+    end_call(&call, RS_STAT_GETPWNAM, name, 0, res, *errnop);
     return res;
 }
 
-/* Get user by UID. */
-enum nss_status _nss_rightscale_getpwuid_r(uid_t uid, struct passwd *pwbuf,
-               char *buf, size_t buflen, int *errnop) {
+static enum nss_status lookup_pwuid(uid_t uid, struct passwd *pwbuf, char *buf,
+            size_t buflen, int *errnop) {
     enum nss_status res;
-    struct rs_user *entry;
+    struct rs_user entry;
 
-    NSS_DEBUG("rightscale getpwuid_r: Looking for uid %d\n", uid);
-
-    FILE *fp = open_policy_file();
-    if (fp == NULL) {
-        *errnop = ENOENT;
-        return NSS_STATUS_UNAVAIL;
-    }
-    int found = FALSE;
-    int line_no = 1;
-    while ((entry = read_next_policy_entry(fp, &line_no)) && !found) {
-        if (entry->local_uid == uid) {
-            found = TRUE;
-            res = fill_passwd(pwbuf, buf, buflen, entry, TRUE, errnop);
-        }
-
-        free_rs_user(entry);
+    if (nssd_getpwuid(uid, pwbuf, buf, buflen, errnop, &res)) {
+        return res;
     }
 
-    /* We've gotten to the end of file without finding anything */
-    if (!found) {
-        res = NSS_STATUS_NOTFOUND;
-        *errnop = ENOENT;
+    struct rs_lookup lookup;
+    res = lookup_user_by_uid(&lookup, uid, &entry, errnop);
+    if (res == NSS_STATUS_SUCCESS) {
+        res = fill_lookup_passwd(&lookup, pwbuf, buf, buflen, &entry, TRUE, errnop);
     }
+    end_lookup(&lookup);
+    return res;
+}
 
-    close_policy_file(fp);
+/* Get user by UID. */
+enum nss_status _nss_rightscale_getpwuid_r(uid_t uid, struct passwd *pwbuf,
+               char *buf, size_t buflen, int *errnop) {
+    struct rs_call call;
+    start_call(&call);
+    enum nss_status res = lookup_pwuid(uid, pwbuf, buf, buflen, errnop);
+    end_call(&call, RS_STAT_GETPWUID, NULL, uid, res, *errnop);
     return res;
 }
@@ -0,0 +1,1416 @@
+/*
+ * policy.c : Process-wide cache of the parsed policy file.
+ */
+
+#include "nss-rightscale.h"
+#include "utils.h"
+#include "policy.h"
+#include "settings.h"
+#include "stats.h"
+#include "trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Snapshot of the policy file as of the last check. Lookups only take
+ * policy_lock for reading, to take a reference on it; it is only locked for
+ * writing to replace it. */
+static struct rs_policy *current_policy = NULL;
+static pthread_rwlock_t policy_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* When the policy file was last found unchanged, in coarse monotonic ms */
+static uint64_t last_check_ms = 0;
+
+/* Directory to share snapshots in instead of the configured one, or NULL */
+static char *shared_policy_dir = NULL;
+
+/* How long to wait for another process publishing a snapshot before parsing
+ * the policy file anyway */
+#define SHARED_POLICY_LOCK_MS 2000
+
+static void stamp_from_stat(struct rs_policy_stamp *stamp, struct stat *st) {
+    stamp->dev = st->st_dev;
+    stamp->ino = st->st_ino;
+    stamp->size = st->st_size;
+    stamp->mtime_sec = st->st_mtim.tv_sec;
+    stamp->mtime_nsec = st->st_mtim.tv_nsec;
+    stamp->ctime_sec = st->st_ctim.tv_sec;
+    stamp->ctime_nsec = st->st_ctim.tv_nsec;
+}
+
+static int stamp_equal(struct rs_policy_stamp *a, struct rs_policy_stamp *b) {
+    return a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+        a->mtime_sec == b->mtime_sec && a->mtime_nsec == b->mtime_nsec &&
+        a->ctime_sec == b->ctime_sec && a->ctime_nsec == b->ctime_nsec;
+}
+
+/* Hash table slots hold 0 when empty, otherwise the user index + 1. Name
+ * slots additionally carry whether the key is the user's preferred name. */
+#define SLOT_EMPTY 0
+#define NAME_SLOT(index, preferred) ((((uint32_t)(index)) << 1 | (preferred)) + 1)
+#define NAME_SLOT_INDEX(slot) (((slot) - 1) >> 1)
+#define NAME_SLOT_PREFERRED(slot) (((slot) - 1) & 1)
+#define UID_SLOT(index) ((uint32_t)(index) + 1)
+#define UID_SLOT_INDEX(slot) ((slot) - 1)
+#define KEY_SLOT(index) ((uint32_t)(index) + 1)
+#define KEY_SLOT_INDEX(slot) ((slot) - 1)
+
+/* Hashes are 64 bits wide: the low bits pick a hash table slot and the rest
+ * feed the Bloom filter, so a key is only hashed once per lookup */
+
+/* FNV-1a */
+static uint64_t hash_name(const char *name) {
+    uint64_t hash = 14695981039346656037ull;
+    while (*name) {
+        hash ^= (unsigned char)*name++;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+/* splitmix64 finalizer */
+static uint64_t hash_uid(uid_t uid) {
+    uint64_t hash = uid;
+    hash ^= hash >> 30;
+    hash *= 0xbf58476d1ce4e5b9ull;
+    hash ^= hash >> 27;
+    hash *= 0x94d049bb133111ebull;
+    hash ^= hash >> 31;
+    return hash;
+}
+
+/* The Bloom filter lets misses, such as every name an ssh brute forcer tries
+ * or every foreign uid ls resolves, return without probing the hash tables.
+ * It is split into cache line sized blocks: the top bits of a key's hash
+ * pick a block and BLOOM_PROBES groups of 9 low bits pick bits in it, so a
+ * lookup touches a single cache line. 16 bits per key keeps false positives
+ * well under 1%. */
+#define BLOOM_BLOCK_BITS 512
+#define BLOOM_BLOCK_WORDS (BLOOM_BLOCK_BITS / 64)
+#define BLOOM_BITS_PER_KEY 16
+#define BLOOM_PROBES 4
+
+static uint64_t * bloom_block(struct rs_policy *policy, uint64_t hash) {
+    return policy->bloom + ((hash >> 40) & (policy->bloom_blocks - 1)) * BLOOM_BLOCK_WORDS;
+}
+
+static void bloom_add(struct rs_policy *policy, uint64_t hash) {
+    uint64_t *block = bloom_block(policy, hash);
+    int i;
+    for (i = 0; i < BLOOM_PROBES; i++) {
+        uint32_t bit = (hash >> (9 * i)) & (BLOOM_BLOCK_BITS - 1);
+        block[bit / 64] |= (uint64_t)1 << (bit % 64);
+    }
+}
+
+/* FALSE if the key is definitely not in the policy */
+static int bloom_may_contain(struct rs_policy *policy, uint64_t hash) {
+    uint64_t *block = bloom_block(policy, hash);
+    int i;
+    for (i = 0; i < BLOOM_PROBES; i++) {
+        uint32_t bit = (hash >> (9 * i)) & (BLOOM_BLOCK_BITS - 1);
+        if (!(block[bit / 64] & ((uint64_t)1 << (bit % 64)))) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/* Number of blocks for a filter over the given number of keys */
+static uint32_t bloom_filter_blocks(uint32_t keys) {
+    uint32_t blocks = 1;
+    while ((uint64_t)blocks * BLOOM_BLOCK_BITS < (uint64_t)keys * BLOOM_BITS_PER_KEY) {
+        blocks *= 2;
+    }
+    return blocks;
+}
+
+/* Smallest power of two that keeps the table at most half full */
+static uint32_t hash_table_size(uint32_t entries) {
+    uint32_t size = 16;
+    while (size < entries * 2) {
+        size *= 2;
+    }
+    return size;
+}
+
+/* Name of the user a name slot points at */
+static char * name_slot_key(struct rs_policy *policy, uint32_t slot) {
+    struct rs_policy_record *record = &policy->users[NAME_SLOT_INDEX(slot)];
+    if (NAME_SLOT_PREFERRED(slot)) {
+        return policy->strings + record->preferred_name;
+    }
+    return policy->strings + record->unique_name;
+}
+
+/* Insert a name unless it is already there: like the file scan, the first
+ * user in the policy file that has a name wins. */
+static void insert_name(struct rs_policy *policy, uint32_t index, int preferred) {
+    uint32_t mask = policy->name_hash_size - 1;
+    uint32_t slot = NAME_SLOT(index, preferred);
+    char *name = name_slot_key(policy, slot);
+    uint64_t hash = hash_name(name);
+    uint32_t i = hash & mask;
+
+    bloom_add(policy, hash);
+
+    while (policy->name_hash[i] != SLOT_EMPTY) {
+        if (strcmp(name_slot_key(policy, policy->name_hash[i]), name) == 0) {
+            return;
+        }
+        i = (i + 1) & mask;
+    }
+    policy->name_hash[i] = slot;
+}
+
+static void insert_uid(struct rs_policy *policy, uint32_t index) {
+    uint32_t mask = policy->uid_hash_size - 1;
+    uid_t uid = policy->users[index].local_uid;
+    uint64_t hash = hash_uid(uid);
+    uint32_t i = hash & mask;
+
+    bloom_add(policy, hash);
+
+    while (policy->uid_hash[i] != SLOT_EMPTY) {
+        if (policy->users[UID_SLOT_INDEX(policy->uid_hash[i])].local_uid == uid) {
+            return;
+        }
+        i = (i + 1) & mask;
+    }
+    policy->uid_hash[i] = UID_SLOT(index);
+}
+
+/* Fingerprints are SHA-256 digests, so their first bytes are already a good
+ * hash. Keys shared by several users are all inserted. */
+static uint32_t hash_fingerprint(const uint8_t *fingerprint) {
+    uint32_t hash;
+    memcpy(&hash, fingerprint, sizeof(hash));
+    return hash;
+}
+
+static void insert_key(struct rs_policy *policy, uint32_t index) {
+    uint32_t mask = policy->key_hash_size - 1;
+    uint32_t i = hash_fingerprint(policy->keys[index].fingerprint) & mask;
+
+    while (policy->key_hash[i] != SLOT_EMPTY) {
+        i = (i + 1) & mask;
+    }
+    policy->key_hash[i] = KEY_SLOT(index);
+}
+
+/* A preferred name only counts when it is non-empty and differs from the
+ * unique name */
+static int record_has_preferred_name(char *strings, struct rs_policy_record *record) {
+    char *preferred_name = strings + record->preferred_name;
+    return strlen(preferred_name) != 0 &&
+        strcmp(preferred_name, strings + record->unique_name) != 0;
+}
+
+/* Build the name and uid indexes and the Bloom filter over the users in an
+ * image. They must already be zeroed. */
+static void index_policy(struct rs_policy *policy) {
+    uint32_t i;
+
+    for (i = 0; i < policy->num_users; i++) {
+        if (record_has_preferred_name(policy->strings, &policy->users[i])) {
+            insert_name(policy, i, TRUE);
+        }
+        insert_name(policy, i, FALSE);
+        insert_uid(policy, i);
+    }
+    for (i = 0; i < policy->num_keys; i++) {
+        insert_key(policy, i);
+    }
+}
+
+/* List the members of the rightscale and rightscale_sudo groups. All users
+ * are part of the rightscale group, only superusers are also part of the
+ * rightscale_sudo group. Users are listed by preferred name, if they have
+ * one, and by unique name. */
+static void list_group_members(char *strings, struct rs_policy_record *users,
+    uint32_t num_users, uint32_t *members, uint32_t *sudo_members) {
+    uint32_t i;
+    uint32_t num_members = 0;
+    uint32_t num_sudo_members = 0;
+
+    for (i = 0; i < num_users; i++) {
+        struct rs_policy_record *record = &users[i];
+        if (record_has_preferred_name(strings, record)) {
+            members[num_members++] = record->preferred_name;
+            if (record->superuser == TRUE) {
+                sudo_members[num_sudo_members++] = record->preferred_name;
+            }
+        }
+        members[num_members++] = record->unique_name;
+        if (record->superuser == TRUE) {
+            sudo_members[num_sudo_members++] = record->unique_name;
+        }
+    }
+}
+
+/* Point a snapshot's shortcuts at the sections of its image */
+static void attach_image(struct rs_policy *policy, struct rs_policy_header *header) {
+    char *base = (char *)header;
+    policy->header = header;
+    policy->num_users = header->num_users;
+    policy->users = (struct rs_policy_record *)(base + header->users_offset);
+    policy->name_hash = (uint32_t *)(base + header->name_hash_offset);
+    policy->name_hash_size = header->name_hash_size;
+    policy->uid_hash = (uint32_t *)(base + header->uid_hash_offset);
+    policy->uid_hash_size = header->uid_hash_size;
+    policy->bloom = (uint64_t *)(base + header->bloom_offset);
+    policy->bloom_blocks = header->bloom_blocks;
+    policy->keys = (struct rs_policy_key *)(base + header->keys_offset);
+    policy->num_keys = header->num_keys;
+    policy->key_hash = (uint32_t *)(base + header->key_hash_offset);
+    policy->key_hash_size = header->key_hash_size;
+    policy->members = (uint32_t *)(base + header->members_offset);
+    policy->num_members = header->num_members;
+    policy->sudo_members = policy->members + header->num_members;
+    policy->num_sudo_members = header->num_sudo_members;
+    policy->strings = base + header->strings_offset;
+    policy->strings_len = header->strings_len;
+    policy->rendered = base + header->rendered_offset;
+    policy->rendered_len = header->rendered_len;
+    policy->group = (struct rs_rendered_group *)(policy->rendered + header->group_rendered);
+    policy->sudo_group = (struct rs_rendered_group *)(policy->rendered + header->sudo_group_rendered);
+}
+
+/* Check that a section lies inside the image and is suitably aligned */
+static int section_valid(struct rs_policy_header *header, size_t size,
+    uint32_t offset, uint64_t length) {
+    return offset >= header->header_size && offset % sizeof(uint32_t) == 0 &&
+        (uint64_t)offset + length <= size;
+}
+
+static int is_power_of_two(uint32_t n) {
+    return n != 0 && (n & (n - 1)) == 0;
+}
+
+/* Every slot must point at a real user, and there must be an empty slot
+ * somewhere so probing always terminates */
+static int hash_valid(uint32_t *table, uint32_t size, uint64_t max_slot) {
+    uint32_t i;
+    int has_empty = FALSE;
+    for (i = 0; i < size; i++) {
+        if (table[i] == SLOT_EMPTY) {
+            has_empty = TRUE;
+        } else if (table[i] > max_slot) {
+            return FALSE;
+        }
+    }
+    return has_empty;
+}
+
+/* A rendered entry must lie inside the rendered section, and its fields
+ * inside its NUL terminated strings */
+int rendered_valid(const char *rendered, uint32_t rendered_len, uint32_t offset, int fields) {
+    int i;
+    if (offset % sizeof(uint32_t) != 0 ||
+        (uint64_t)offset + sizeof(struct rs_rendered) > rendered_len) {
+        return FALSE;
+    }
+    const struct rs_rendered *entry = (const struct rs_rendered *)(rendered + offset);
+    const char *strings = (const char *)(entry + 1);
+    if (entry->len == 0 ||
+        (uint64_t)offset + sizeof(struct rs_rendered) + entry->len > rendered_len ||
+        strings[entry->len - 1] != '\0') {
+        return FALSE;
+    }
+    for (i = 0; i < fields; i++) {
+        if (entry->field[i] >= entry->len) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/* A rendered group must lie inside the rendered section, and its member
+ * offsets inside its NUL terminated strings */
+int rendered_group_valid(const char *rendered, uint32_t rendered_len, uint32_t offset) {
+    uint32_t i;
+    if (offset % sizeof(uint64_t) != 0 ||
+        (uint64_t)offset + sizeof(struct rs_rendered_group) > rendered_len) {
+        return FALSE;
+    }
+    const struct rs_rendered_group *group = (const struct rs_rendered_group *)(rendered + offset);
+    const char *layout = (const char *)(group + 1);
+    uint64_t strings = sizeof(char *) * ((uint64_t)group->num_members + 1);
+    if ((uint64_t)offset + sizeof(struct rs_rendered_group) + group->len > rendered_len ||
+        strings >= group->len || layout[group->len - 1] != '\0' ||
+        group->name < strings || group->name >= group->len ||
+        group->passwd < strings || group->passwd >= group->len) {
+        return FALSE;
+    }
+    for (i = 0; i < group->num_members; i++) {
+        uintptr_t member = ((const uintptr_t *)layout)[i];
+        if (member < strings || member >= group->len) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/* Sanity check an image read from disk before trusting any offset in it */
+static int image_valid(struct rs_policy_header *header, size_t size) {
+    uint32_t i;
+
+    if (size < sizeof(struct rs_policy_header) ||
+        memcmp(header->magic, RS_POLICY_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != RS_POLICY_VERSION ||
+        header->header_size != sizeof(struct rs_policy_header) ||
+        header->total_size != size) {
+        return FALSE;
+    }
+    if (!section_valid(header, size, header->users_offset,
+            (uint64_t)header->num_users * sizeof(struct rs_policy_record)) ||
+        !is_power_of_two(header->name_hash_size) ||
+        !section_valid(header, size, header->name_hash_offset,
+            (uint64_t)header->name_hash_size * sizeof(uint32_t)) ||
+        !is_power_of_two(header->uid_hash_size) ||
+        !section_valid(header, size, header->uid_hash_offset,
+            (uint64_t)header->uid_hash_size * sizeof(uint32_t)) ||
+        !is_power_of_two(header->bloom_blocks) ||
+        !section_valid(header, size, header->bloom_offset,
+            (uint64_t)header->bloom_blocks * BLOOM_BLOCK_BITS / 8) ||
+        !section_valid(header, size, header->keys_offset,
+            (uint64_t)header->num_keys * sizeof(struct rs_policy_key)) ||
+        !is_power_of_two(header->key_hash_size) ||
+        !section_valid(header, size, header->key_hash_offset,
+            (uint64_t)header->key_hash_size * sizeof(uint32_t)) ||
+        !section_valid(header, size, header->members_offset,
+            ((uint64_t)header->num_members + header->num_sudo_members) * sizeof(uint32_t)) ||
+        !section_valid(header, size, header->strings_offset, header->strings_len) ||
+        header->strings_len == 0 ||
+        !section_valid(header, size, header->rendered_offset, header->rendered_len)) {
+        return FALSE;
+    }
+
+    char *strings = (char *)header + header->strings_offset;
+    struct rs_policy_record *users =
+        (struct rs_policy_record *)((char *)header + header->users_offset);
+    if (strings[header->strings_len - 1] != '\0') {
+        return FALSE;
+    }
+    uint32_t *members = (uint32_t *)((char *)header + header->members_offset);
+    for (i = 0; i < header->num_members + header->num_sudo_members; i++) {
+        if (members[i] >= header->strings_len) {
+            return FALSE;
+        }
+    }
+    char *rendered = (char *)header + header->rendered_offset;
+    for (i = 0; i < header->num_users; i++) {
+        if (users[i].preferred_name >= header->strings_len ||
+            users[i].unique_name >= header->strings_len ||
+            users[i].gecos >= header->strings_len ||
+            !rendered_valid(rendered, header->rendered_len, users[i].passwd[0], 4) ||
+            !rendered_valid(rendered, header->rendered_len, users[i].passwd[1], 4) ||
+            !rendered_valid(rendered, header->rendered_len, users[i].shadow[0], 1) ||
+            !rendered_valid(rendered, header->rendered_len, users[i].shadow[1], 1)) {
+            return FALSE;
+        }
+    }
+    if (!rendered_group_valid(rendered, header->rendered_len, header->group_rendered) ||
+        !rendered_group_valid(rendered, header->rendered_len, header->sudo_group_rendered)) {
+        return FALSE;
+    }
+    struct rs_policy_key *keys =
+        (struct rs_policy_key *)((char *)header + header->keys_offset);
+    for (i = 0; i < header->num_keys; i++) {
+        if (keys[i].user >= header->num_users) {
+            return FALSE;
+        }
+    }
+    return hash_valid((uint32_t *)((char *)header + header->name_hash_offset),
+            header->name_hash_size, (uint64_t)header->num_users * 2) &&
+        hash_valid((uint32_t *)((char *)header + header->uid_hash_offset),
+            header->uid_hash_size, header->num_users) &&
+        hash_valid((uint32_t *)((char *)header + header->key_hash_offset),
+            header->key_hash_size, header->num_keys);
+}
+
+static void free_policy(struct rs_policy *policy) {
+    if (policy->mapped) {
+        munmap(policy->header, policy->header->total_size);
+    } else {
+        free(policy->header);
+    }
+    free(policy);
+}
+
+
+/* Growable list of users, their strings and their keys, used while parsing */
+struct policy_builder {
+    struct rs_policy_record *users;
+    uint32_t num_users;
+    uint32_t users_size;
+    char *strings;
+    uint64_t strings_len;
+    uint64_t strings_size;
+    struct rs_policy_key *keys;
+    uint32_t num_keys;
+    uint32_t keys_size;
+};
+
+/* Append a NUL terminated string to the string pool, growing it as needed.
+ * Returns the offset of the copy, or -1 if out of memory. */
+static long add_policy_string(struct policy_builder *builder, const char *str) {
+    uint64_t len = strlen(str) + 1;
+    uint64_t offset = builder->strings_len;
+
+    if (offset + len > UINT32_MAX) {
+        return -1;
+    }
+    while (builder->strings_len + len > builder->strings_size) {
+        char *strings = realloc(builder->strings, builder->strings_size * 2);
+        if (strings == NULL) {
+            return -1;
+        }
+        builder->strings = strings;
+        builder->strings_size *= 2;
+    }
+    memcpy(builder->strings + offset, str, len);
+    builder->strings_len += len;
+    return offset;
+}
+
+static int add_policy_user(struct policy_builder *builder, struct rs_user *entry, long line_offset) {
+    if (builder->num_users == builder->users_size) {
+        struct rs_policy_record *users = realloc(builder->users,
+            sizeof(struct rs_policy_record) * builder->users_size * 2);
+        if (users == NULL) {
+            return FALSE;
+        }
+        builder->users = users;
+        builder->users_size *= 2;
+    }
+    struct rs_policy_record *record = &builder->users[builder->num_users];
+    long preferred_name = add_policy_string(builder, entry->preferred_name);
+    long unique_name = add_policy_string(builder, entry->unique_name);
+    long gecos = add_policy_string(builder, entry->gecos);
+    if (preferred_name < 0 || unique_name < 0 || gecos < 0) {
+        return FALSE;
+    }
+    record->preferred_name = preferred_name;
+    record->unique_name = unique_name;
+    record->gecos = gecos;
+    record->rs_uid = entry->rs_uid;
+    record->local_uid = entry->local_uid;
+    record->superuser = entry->superuser;
+    record->line_offset = line_offset;
+    builder->num_users += 1;
+    return TRUE;
+}
+
+/* Index a public key of the last user added. Keys that can't be decoded are
+ * skipped, as sshd would ignore them too. */
+static int add_policy_key(struct policy_builder *builder, const char *key, size_t len, long key_offset) {
+    if (builder->num_keys == builder->keys_size) {
+        struct rs_policy_key *keys = realloc(builder->keys,
+            sizeof(struct rs_policy_key) * builder->keys_size * 2);
+        if (keys == NULL) {
+            return FALSE;
+        }
+        builder->keys = keys;
+        builder->keys_size *= 2;
+    }
+    struct rs_policy_key *record = &builder->keys[builder->num_keys];
+    if (!policy_key_fingerprint(key, len, record->fingerprint)) {
+        return TRUE;
+    }
+    record->user = builder->num_users - 1;
+    record->len = len;
+    record->offset = key_offset;
+    builder->num_keys += 1;
+    return TRUE;
+}
+
+/* Point an rs_user at the strings of a record */
+static void record_entry(char *strings, struct rs_policy_record *record, struct rs_user *entry) {
+    entry->preferred_name = strings + record->preferred_name;
+    entry->unique_name = strings + record->unique_name;
+    entry->gecos = strings + record->gecos;
+    entry->rs_uid = record->rs_uid;
+    entry->local_uid = record->local_uid;
+    entry->superuser = record->superuser;
+}
+
+/* Space a rendered entry with strings of the given length takes up */
+static uint64_t rendered_size(size_t len) {
+    return (sizeof(struct rs_rendered) + len + 3) & ~(uint64_t)3;
+}
+
+/* Render the passwd and shadow entries of every user, under their unique
+ * name and their preferred name if they have one, and point their records
+ * at them. With rendered NULL, only the offsets are set. Returns the length
+ * of the rendered section. */
+static uint64_t render_entries(char *strings, struct rs_policy_record *users,
+    uint32_t num_users, char *rendered) {
+    uint64_t len = 0;
+    uint32_t i;
+    int preferred;
+
+    for (i = 0; i < num_users; i++) {
+        struct rs_policy_record *record = &users[i];
+        struct rs_user entry;
+        int variants = record_has_preferred_name(strings, record) ? 2 : 1;
+        record_entry(strings, record, &entry);
+        for (preferred = 0; preferred < variants; preferred++) {
+            record->passwd[preferred] = len;
+            len += rendered_size(render_passwd(
+                rendered ? (struct rs_rendered *)(rendered + len) : NULL, &entry, preferred));
+            record->shadow[preferred] = len;
+            len += rendered_size(render_spwd(
+                rendered ? (struct rs_rendered *)(rendered + len) : NULL, &entry, preferred));
+        }
+        if (variants == 1) {
+            record->passwd[1] = record->passwd[0];
+            record->shadow[1] = record->shadow[0];
+        }
+    }
+    return len;
+}
+
+/* Round a section offset up so every section stays 8 byte aligned */
+static uint64_t align_section(uint64_t offset) {
+    return (offset + 7) & ~(uint64_t)7;
+}
+
+/* Count the members list_group_members will list */
+static void count_group_members(struct policy_builder *builder,
+    uint32_t *num_members, uint32_t *num_sudo_members) {
+    uint32_t i;
+
+    *num_members = 0;
+    *num_sudo_members = 0;
+    for (i = 0; i < builder->num_users; i++) {
+        struct rs_policy_record *record = &builder->users[i];
+        uint32_t names = record_has_preferred_name(builder->strings, record) ? 2 : 1;
+        *num_members += names;
+        if (record->superuser == TRUE) {
+            *num_sudo_members += names;
+        }
+    }
+}
+
+/* Lay the parsed users out as a flat image, index it and render its entries */
+static struct rs_policy_header * layout_policy_image(struct policy_builder *builder,
+    struct rs_policy_stamp *source, int flags) {
+    uint32_t name_hash_size = hash_table_size(builder->num_users * 2);
+    uint32_t uid_hash_size = hash_table_size(builder->num_users);
+    uint32_t bloom_blocks = bloom_filter_blocks(builder->num_users * 3);
+    uint32_t key_hash_size = hash_table_size(builder->num_keys);
+    uint32_t num_members, num_sudo_members;
+    count_group_members(builder, &num_members, &num_sudo_members);
+    uint32_t *members = malloc(sizeof(uint32_t) * ((uint64_t)num_members + num_sudo_members + 1));
+    if (members == NULL) {
+        return NULL;
+    }
+    list_group_members(builder->strings, builder->users, builder->num_users,
+        members, members + num_members);
+    uint64_t users_offset = align_section(sizeof(struct rs_policy_header));
+    uint64_t name_hash_offset = align_section(users_offset +
+        (uint64_t)builder->num_users * sizeof(struct rs_policy_record));
+    uint64_t uid_hash_offset = align_section(name_hash_offset +
+        (uint64_t)name_hash_size * sizeof(uint32_t));
+    uint64_t bloom_offset = align_section(uid_hash_offset +
+        (uint64_t)uid_hash_size * sizeof(uint32_t));
+    uint64_t keys_offset = align_section(bloom_offset +
+        (uint64_t)bloom_blocks * BLOOM_BLOCK_BITS / 8);
+    uint64_t key_hash_offset = align_section(keys_offset +
+        (uint64_t)builder->num_keys * sizeof(struct rs_policy_key));
+    uint64_t members_offset = align_section(key_hash_offset +
+        (uint64_t)key_hash_size * sizeof(uint32_t));
+    uint64_t strings_offset = align_section(members_offset +
+        ((uint64_t)num_members + num_sudo_members) * sizeof(uint32_t));
+    uint64_t rendered_offset = align_section(strings_offset + builder->strings_len);
+    /* Groups are 8 byte aligned in the rendered section, so gr_mem is */
+    uint64_t group_rendered = align_section(render_entries(builder->strings, builder->users,
+        builder->num_users, NULL));
+    uint64_t sudo_group_rendered = align_section(group_rendered + sizeof(struct rs_rendered_group) +
+        render_group(NULL, RS_GROUP_NAME, builder->strings, members, num_members));
+    uint64_t rendered_len = sudo_group_rendered + sizeof(struct rs_rendered_group) +
+        render_group(NULL, RS_SUDO_GROUP_NAME, builder->strings, members + num_members,
+            num_sudo_members);
+    uint64_t total_size = align_section(rendered_offset + rendered_len);
+
+    struct rs_policy_header *header = NULL;
+    if (total_size <= UINT32_MAX) {
+        header = calloc(1, total_size);
+    }
+    if (header == NULL) {
+        free(members);
+        return NULL;
+    }
+    memcpy(header->magic, RS_POLICY_MAGIC, sizeof(header->magic));
+    header->version = RS_POLICY_VERSION;
+    header->header_size = sizeof(struct rs_policy_header);
+    header->total_size = total_size;
+    header->flags = flags;
+    header->source = *source;
+    header->num_users = builder->num_users;
+    header->users_offset = users_offset;
+    header->name_hash_offset = name_hash_offset;
+    header->name_hash_size = name_hash_size;
+    header->uid_hash_offset = uid_hash_offset;
+    header->uid_hash_size = uid_hash_size;
+    header->bloom_offset = bloom_offset;
+    header->bloom_blocks = bloom_blocks;
+    header->num_keys = builder->num_keys;
+    header->keys_offset = keys_offset;
+    header->key_hash_offset = key_hash_offset;
+    header->key_hash_size = key_hash_size;
+    header->members_offset = members_offset;
+    header->num_members = num_members;
+    header->num_sudo_members = num_sudo_members;
+    header->strings_offset = strings_offset;
+    header->strings_len = builder->strings_len;
+    header->rendered_offset = rendered_offset;
+    header->rendered_len = rendered_len;
+    header->group_rendered = group_rendered;
+    header->sudo_group_rendered = sudo_group_rendered;
+
+    char *base = (char *)header;
+    memcpy(base + users_offset, builder->users,
+        sizeof(struct rs_policy_record) * builder->num_users);
+    memcpy(base + keys_offset, builder->keys,
+        sizeof(struct rs_policy_key) * builder->num_keys);
+    memcpy(base + members_offset, members,
+        sizeof(uint32_t) * ((uint64_t)num_members + num_sudo_members));
+    memcpy(base + strings_offset, builder->strings, builder->strings_len);
+    free(members);
+
+    struct rs_policy policy;
+    attach_image(&policy, header);
+    index_policy(&policy);
+    render_entries(policy.strings, policy.users, policy.num_users, policy.rendered);
+    render_group(policy.group, RS_GROUP_NAME, policy.strings,
+        policy.members, policy.num_members);
+    render_group(policy.sudo_group, RS_SUDO_GROUP_NAME, policy.strings,
+        policy.sudo_members, policy.num_sudo_members);
+    return header;
+}
+
+/* Parse a text policy file into a freshly malloc'ed image. Used both to
+ * build the in-process snapshot and by rs-policy-compile. With
+ * RS_POLICY_KEYS_INDEXED in flags, public keys are fingerprinted and indexed
+ * too, which costs a SHA-256 per key and so is left out of NSS lookups.
+ * Returns NULL and sets errnop on failure. */
+struct rs_policy_header * build_policy_image(struct rs_policy_file *pf, int flags, int *errnop) {
+    struct rs_policy_header *header = NULL;
+    struct policy_builder builder = { NULL, 0, 16, NULL, 1, 1024, NULL, 0, 16 };
+    char *key = NULL;
+    size_t key_size = 0;
+    struct rs_policy_stamp source;
+    struct stat st;
+
+    if (fstat(pf->fd, &st) != 0) {
+        *errnop = errno;
+        return NULL;
+    }
+    stamp_from_stat(&source, &st);
+
+    builder.users = malloc(sizeof(struct rs_policy_record) * builder.users_size);
+    builder.strings = malloc(builder.strings_size);
+    builder.keys = malloc(sizeof(struct rs_policy_key) * builder.keys_size);
+    if (builder.users == NULL || builder.strings == NULL || builder.keys == NULL) {
+        goto out;
+    }
+    builder.strings[0] = '\0'; /* Offset 0 is always the empty string */
+
+    char buf[POLICY_BUF_SIZE];
+    int line_no = 1;
+    struct rs_policy_line line;
+    struct rs_user entry;
+    size_t key_len;
+    long key_offset;
+    while (read_policy_line(pf, buf, sizeof(buf), &line, &line_no)) {
+        if (!policy_line_entry(&line, &entry)) {
+            trace_event(RS_EVENT_BAD_POLICY_LINE, line_no - 1);
+            continue;
+        }
+        if (!add_policy_user(&builder, &entry, line.offset)) {
+            goto out;
+        }
+        while ((flags & RS_POLICY_KEYS_INDEXED) &&
+            read_policy_key(pf, &key, &key_size, &key_len, &key_offset)) {
+            if (!add_policy_key(&builder, key, key_len, key_offset)) {
+                goto out;
+            }
+        }
+    }
+
+    header = layout_policy_image(&builder, &source, flags);
+    if (header != NULL) {
+        trace_event(RS_EVENT_POLICY_PARSED, header->num_users);
+    }
+
+out:
+    free(builder.users);
+    free(builder.strings);
+    free(builder.keys);
+    free(key);
+    if (header == NULL) {
+        *errnop = ENOMEM;
+    }
+    return header;
+}
+
+/* Whether a file can only have been written by root or the owner of the
+ * policy file, who could as well have written the policy file itself */
+static int trusted_file(struct stat *st, struct stat *source_st) {
+    return S_ISREG(st->st_mode) && (st->st_uid == 0 || st->st_uid == source_st->st_uid) &&
+        (st->st_mode & (S_IWGRP | S_IWOTH)) == 0;
+}
+
+/* Map an image file, and close it, if it is safe to trust and was built from
+ * the current text policy. Returns NULL otherwise, tracing event unless it is
+ * 0 if the image is invalid or stale. */
+static struct rs_policy_header * map_policy_image(int fd, struct stat *source_st, int event) {
+    struct rs_policy_stamp source;
+    struct stat st;
+
+    if (fstat(fd, &st) != 0 || !trusted_file(&st, source_st) ||
+        st.st_size < (off_t)sizeof(struct rs_policy_header) || st.st_size > UINT32_MAX) {
+        close(fd);
+        return NULL;
+    }
+
+    struct rs_policy_header *header = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (header == MAP_FAILED) {
+        return NULL;
+    }
+
+    stamp_from_stat(&source, source_st);
+    if (!image_valid(header, st.st_size) || !stamp_equal(&header->source, &source)) {
+        if (event != 0) {
+            trace_event(event, 0);
+        }
+        munmap(header, st.st_size);
+        return NULL;
+    }
+    return header;
+}
+
+/* Map the compiled policy if there is one, it is safe to trust and it was
+ * compiled from the current text policy. Returns NULL otherwise. */
+static struct rs_policy_header * map_policy_db(struct stat *source_st) {
+    int fd = open_policy_db_file();
+    if (fd < 0) {
+        return NULL;
+    }
+    return map_policy_image(fd, source_st, RS_EVENT_COMPILED_POLICY_IGNORED);
+}
+
+/* Share snapshots in the given directory rather than the configured one. ""
+ * shares nothing and NULL goes back to the configured one. Not to be called
+ * while other threads make lookups. */
+void set_shared_policy_dir(char *dir) {
+    shared_policy_dir = dir;
+}
+
+/* Path of the shared snapshot of the policy file, named after the policy
+ * file so that each has its own. Its lock file is the same with ".lock"
+ * appended. Returns FALSE if snapshots aren't shared. */
+static int shared_policy_path(char *path, size_t size) {
+    const char *dir = shared_policy_dir;
+    if (dir == NULL) {
+        /* Like rightscale-nssd, only the default policy file is shared */
+        if (!is_default_policy_file()) {
+            return FALSE;
+        }
+        dir = get_settings()->shared_policy_dir;
+    }
+    if (dir[0] == '\0') {
+        return FALSE;
+    }
+    int len = snprintf(path, size, "%s/" RS_SHARED_POLICY_PREFIX "%016llx", dir,
+        (unsigned long long)hash_name(get_policy_file()));
+    return len > 0 && (size_t)len < size;
+}
+
+/* Map the snapshot another process published, if it is safe to trust,
+ * current and built with the given flags. Returns NULL otherwise. */
+static struct rs_policy_header * map_shared_policy(const char *path, struct stat *source_st,
+    int flags) {
+    int fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    count_file_open();
+    struct rs_policy_header *header = map_policy_image(fd, source_st, 0);
+    if (header != NULL && (header->flags & flags) != (uint32_t)flags) {
+        munmap(header, header->total_size);
+        return NULL;
+    }
+    return header;
+}
+
+static int create_shared_policy_lock(const char *path) {
+    return open(path, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+}
+
+/* Open the lock file of a shared snapshot. Only processes whose snapshots
+ * are trusted open it, so it must be theirs and unreadable to anyone else:
+ * a lock file others could open, they could hold locked forever. Someone
+ * else's is replaced if we are allowed to. Returns -1 if there is none to
+ * use. */
+static int open_shared_policy_lock(const char *path, struct stat *source_st) {
+    struct stat st;
+
+    int fd = open(path, O_RDWR | O_NOFOLLOW | O_CLOEXEC);
+    if (fd >= 0 && (fstat(fd, &st) != 0 || !trusted_file(&st, source_st) ||
+            (st.st_mode & (S_IRWXG | S_IRWXO)) != 0)) {
+        close(fd);
+        fd = unlink(path) == 0 ? create_shared_policy_lock(path) : -1;
+    } else if (fd < 0 && errno == ENOENT) {
+        fd = create_shared_policy_lock(path);
+    }
+    return fd;
+}
+
+/* Lock the lock file of a shared snapshot, waiting up to
+ * SHARED_POLICY_LOCK_MS for whoever holds it. Returns the locked file, to
+ * close to unlock it, or -1. */
+static int lock_shared_policy(const char *path, struct stat *source_st) {
+    char lock_path[PATH_MAX + sizeof(".lock")];
+    long waited_ms = 0;
+    long sleep_ms = 1;
+
+    snprintf(lock_path, sizeof(lock_path), "%s.lock", path);
+    int fd = open_shared_policy_lock(lock_path, source_st);
+    while (fd >= 0 && flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        if ((errno != EWOULDBLOCK && errno != EINTR) || waited_ms >= SHARED_POLICY_LOCK_MS) {
+            close(fd);
+            return -1;
+        }
+        struct timespec ts = { 0, sleep_ms * 1000000 };
+        nanosleep(&ts, NULL);
+        waited_ms += sleep_ms;
+        if (sleep_ms < 16) {
+            sleep_ms *= 2;
+        }
+    }
+    return fd;
+}
+
+/* Write an image where other processes can map it, replacing whatever was
+ * there in one go, and map it to use instead of the malloc'ed one. It is
+ * readable by whoever can read the policy file. Returns NULL if it couldn't
+ * be published. */
+static struct rs_policy_header * publish_policy_image(const char *path,
+    struct rs_policy_header *image, struct stat *source_st) {
+    char tmp_path[PATH_MAX + sizeof(".XXXXXX")];
+    const char *p = (const char *)image;
+    uint64_t left = image->total_size;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path);
+    int fd = mkostemp(tmp_path, O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    mode_t mode = S_IRUSR | (source_st->st_mode & S_IROTH);
+    if (fchown(fd, -1, source_st->st_gid) == 0) {
+        mode |= source_st->st_mode & S_IRGRP;
+    }
+    while (left > 0) {
+        ssize_t n = write(fd, p, left);
+        if (n < 0 && errno != EINTR) {
+            goto fail;
+        }
+        if (n > 0) {
+            p += n;
+            left -= n;
+        }
+    }
+    if (fchmod(fd, mode) != 0 || rename(tmp_path, path) != 0) {
+        goto fail;
+    }
+
+    struct rs_policy_header *header = mmap(NULL, image->total_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (header == MAP_FAILED) {
+        return NULL;
+    }
+    trace_event(RS_EVENT_POLICY_PUBLISHED, header->num_users);
+    return header;
+
+fail:
+    unlink(tmp_path);
+    close(fd);
+    return NULL;
+}
+
+/* Lock the snapshot shared under path, if there is one and ours would be
+ * trusted, so that processes publish one at a time: the others wait, then
+ * map what was published rather than parse it again. Returns the lock to
+ * pass to load_policy and close afterwards, or -1. As it can wait, not to be
+ * called while holding policy_lock. */
+static int lock_policy_publishing(const char *path, struct stat *st) {
+    if (path == NULL || (geteuid() != 0 && geteuid() != st->st_uid)) {
+        return -1;
+    }
+    return lock_shared_policy(path, st);
+}
+
+/* Parse the text policy file into an image built with the given flags.
+ * Holding the lock of the snapshot shared under path (lock_fd isn't -1), map
+ * it if another process published it while we waited for the lock,
+ * otherwise publish ours. Sets mapped if the image returned is mmap'ed.
+ * Returns NULL and sets errnop on failure. */
+static struct rs_policy_header * parse_policy(const char *path, int lock_fd, struct stat *st,
+    int flags, int *mapped, int *errnop) {
+    struct rs_policy_header *header = NULL;
+
+    if (lock_fd >= 0) {
+        header = map_shared_policy(path, st, flags);
+        if (header != NULL) {
+            *mapped = TRUE;
+            return header;
+        }
+    }
+
+    struct rs_policy_file *pf = open_policy_file();
+    if (pf == NULL) {
+        *errnop = errno;
+    } else {
+        header = build_policy_image(pf, flags, errnop);
+        close_policy_file(pf);
+    }
+    if (header != NULL && lock_fd >= 0) {
+        struct rs_policy_header *shared = publish_policy_image(path, header, st);
+        if (shared != NULL) {
+            free(header);
+            header = shared;
+            *mapped = TRUE;
+        }
+    }
+    return header;
+}
+
+/* Load a new snapshot: the compiled policy when it is current, otherwise
+ * the snapshot another process shared under path when it is, otherwise
+ * parse the text policy file. path is NULL if snapshots aren't shared, and
+ * lock_fd is what lock_policy_publishing returned. */
+static struct rs_policy * load_policy(struct stat *st, const char *path, int lock_fd,
+    int *errnop) {
+    struct rs_policy *policy = calloc(1, sizeof(struct rs_policy));
+    if (policy == NULL) {
+        *errnop = ENOMEM;
+        return NULL;
+    }
+
+    struct rs_policy_header *header = map_policy_db(st);
+    if (header == NULL && path != NULL && lock_fd < 0) {
+        header = map_shared_policy(path, st, 0);
+    }
+    if (header != NULL) {
+        policy->mapped = TRUE;
+    } else {
+        header = parse_policy(path, lock_fd, st, 0, &policy->mapped, errnop);
+        if (header == NULL) {
+            free(policy);
+            return NULL;
+        }
+    }
+
+    policy->refcount = 1;
+    policy->stamp = header->source;
+    attach_image(policy, header);
+    count_load();
+    trace_flag(RS_TRACE_LOADED);
+    return policy;
+}
+
+/* Take a reference on the current snapshot if there is one and, unless stamp
+ * is NULL, it matches stamp. Caller holds policy_lock. */
+static struct rs_policy * reference_current_policy(struct rs_policy_stamp *stamp) {
+    struct rs_policy *policy = current_policy;
+    if (policy == NULL || (stamp != NULL && !stamp_equal(stamp, &policy->stamp))) {
+        return NULL;
+    }
+    __atomic_add_fetch(&policy->refcount, 1, __ATOMIC_RELAXED);
+    return policy;
+}
+
+/* Replace the current snapshot. Caller holds policy_lock for writing */
+static void set_current_policy(struct rs_policy *policy) {
+    if (current_policy != NULL) {
+        release_policy(current_policy);
+    }
+    current_policy = policy;
+}
+
+/* Reads the coarse clock, which is cheap but only ticks every few ms */
+static uint64_t coarse_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Take a reference on the current snapshot under the read lock */
+static struct rs_policy * share_current_policy(struct rs_policy_stamp *stamp) {
+    pthread_rwlock_rdlock(&policy_lock);
+    struct rs_policy *policy = reference_current_policy(stamp);
+    pthread_rwlock_unlock(&policy_lock);
+    return policy;
+}
+
+/* Get a reference to an up to date snapshot of the policy file. The policy
+ * file is only re-read if its identity (inode, size, mtime) has changed since
+ * the snapshot was taken. Every successful call must be paired with
+ * release_policy. Returns NULL and sets errnop on failure.
+ *
+ * With revalidate_interval_ms set, the snapshot is trusted without a stat()
+ * for that long after the policy file was last checked, so changes can take
+ * that long to be seen.
+ *
+ * The policy file is stat'ed without holding the lock, and an unchanged
+ * snapshot is shared under the read lock, so concurrent lookups don't
+ * serialize. Reloads take the write lock and stat again, so only one thread
+ * parses a changed file. Waiting for another process to publish the change
+ * is done before taking the write lock. */
+struct rs_policy * acquire_policy(int *errnop) {
+    struct rs_policy *policy;
+    struct rs_policy_stamp stamp;
+    struct stat st;
+    char shared_path[PATH_MAX];
+    const char *path = NULL;
+    int lock_fd = -1;
+    long interval = get_settings()->revalidate_interval_ms;
+    uint64_t now = 0;
+
+    if (interval > 0) {
+        now = coarse_now_ms();
+        if (now - __atomic_load_n(&last_check_ms, __ATOMIC_RELAXED) < (uint64_t)interval) {
+            policy = share_current_policy(NULL);
+            if (policy != NULL) {
+                return policy;
+            }
+        }
+    }
+
+    if (stat_policy_file(&st) == 0) {
+        stamp_from_stat(&stamp, &st);
+        policy = share_current_policy(&stamp);
+        if (policy != NULL) {
+            if (interval > 0) {
+                __atomic_store_n(&last_check_ms, now, __ATOMIC_RELAXED);
+            }
+            return policy;
+        }
+        if (shared_policy_path(shared_path, sizeof(shared_path))) {
+            path = shared_path;
+            lock_fd = lock_policy_publishing(path, &st);
+        }
+    }
+
+    pthread_rwlock_wrlock(&policy_lock);
+
+    if (stat_policy_file(&st) != 0) {
+        *errnop = ENOENT;
+        /* Policy went away. Don't keep serving the old one */
+        set_current_policy(NULL);
+        pthread_rwlock_unlock(&policy_lock);
+        if (lock_fd >= 0) {
+            close(lock_fd);
+        }
+        return NULL;
+    }
+    stamp_from_stat(&stamp, &st);
+
+    /* Another thread may have reloaded it while we waited for the lock */
+    policy = reference_current_policy(&stamp);
+    if (policy == NULL) {
+        policy = load_policy(&st, path, lock_fd, errnop);
+        if (policy != NULL) {
+            set_current_policy(policy);
+            policy->refcount += 1;
+        }
+    }
+    if (policy != NULL && interval > 0) {
+        __atomic_store_n(&last_check_ms, now, __ATOMIC_RELAXED);
+    }
+
+    pthread_rwlock_unlock(&policy_lock);
+    if (lock_fd >= 0) {
+        close(lock_fd);
+    }
+    return policy;
+}
+
+/* Like acquire_policy, but the snapshot also indexes public keys: the
+ * current snapshot when it was compiled with keys, otherwise one shared
+ * next to the plain shared snapshot, with RS_SHARED_POLICY_KEYS_SUFFIX
+ * appended. Fingerprinting every key is too slow to do on every call, so
+ * only processes whose snapshots are trusted build one, and publish it for
+ * the others; anyone else gets ENODATA until there is one. Pair with
+ * release_policy. */
+struct rs_policy * acquire_policy_keys(int *errnop) {
+    char path[PATH_MAX];
+    struct rs_policy_header *header = NULL;
+    struct stat st;
+    int mapped = FALSE;
+
+    struct rs_policy *policy = acquire_policy(errnop);
+    if (policy == NULL || (policy->header->flags & RS_POLICY_KEYS_INDEXED)) {
+        return policy;
+    }
+    release_policy(policy);
+
+    if (stat_policy_file(&st) != 0) {
+        *errnop = errno;
+        return NULL;
+    }
+    if (!shared_policy_path(path, sizeof(path)) ||
+        strlen(path) + sizeof(RS_SHARED_POLICY_KEYS_SUFFIX) > sizeof(path)) {
+        *errnop = ENODATA;
+        return NULL;
+    }
+    strcat(path, RS_SHARED_POLICY_KEYS_SUFFIX);
+    int lock_fd = lock_policy_publishing(path, &st);
+    if (lock_fd >= 0) {
+        header = parse_policy(path, lock_fd, &st, RS_POLICY_KEYS_INDEXED, &mapped, errnop);
+        close(lock_fd);
+    } else {
+        header = map_shared_policy(path, &st, RS_POLICY_KEYS_INDEXED);
+        mapped = TRUE;
+        *errnop = ENODATA;
+    }
+    if (header == NULL) {
+        return NULL;
+    }
+
+    policy = calloc(1, sizeof(struct rs_policy));
+    if (policy == NULL) {
+        if (mapped) {
+            munmap(header, header->total_size);
+        } else {
+            free(header);
+        }
+        *errnop = ENOMEM;
+        return NULL;
+    }
+    policy->refcount = 1;
+    policy->stamp = header->source;
+    policy->mapped = mapped;
+    attach_image(policy, header);
+    return policy;
+}
+
+/* Drop a reference obtained with acquire_policy. The last reference frees the
+ * snapshot, which by then can no longer be the current one. */
+void release_policy(struct rs_policy *policy) {
+    if (__atomic_sub_fetch(&policy->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        free_policy(policy);
+    }
+}
+
+/* NSS status to return when acquire_policy fails with the given errno */
+enum nss_status policy_error_status(int err) {
+    if (err == ENOMEM) {
+        return NSS_STATUS_TRYAGAIN;
+    }
+    return NSS_STATUS_UNAVAIL;
+}
+
+/* Find a user by login name using the same rules as the policy file scan:
+ * the first entry whose unique name matches, or whose preferred name matches
+ * when it is non-empty and differs from its unique name, wins.
+ * Returns the user index or -1, and whether the preferred name matched. */
+int find_policy_user_by_name(struct rs_policy *policy, const char *name, int *use_preferred) {
+    uint32_t mask = policy->name_hash_size - 1;
+    uint64_t hash = hash_name(name);
+    uint32_t i = hash & mask;
+
+    if (!bloom_may_contain(policy, hash)) {
+        return -1;
+    }
+
+    while (policy->name_hash[i] != SLOT_EMPTY) {
+        uint32_t slot = policy->name_hash[i];
+        if (strcmp(name_slot_key(policy, slot), name) == 0) {
+            *use_preferred = NAME_SLOT_PREFERRED(slot) ? TRUE : FALSE;
+            return NAME_SLOT_INDEX(slot);
+        }
+        i = (i + 1) & mask;
+    }
+    return -1;
+}
+
+/* Find the first user with the given local uid. Returns the user index or -1 */
+int find_policy_user_by_uid(struct rs_policy *policy, uid_t uid) {
+    uint32_t mask = policy->uid_hash_size - 1;
+    uint64_t hash = hash_uid(uid);
+    uint32_t i = hash & mask;
+
+    if (!bloom_may_contain(policy, hash)) {
+        return -1;
+    }
+
+    while (policy->uid_hash[i] != SLOT_EMPTY) {
+        uint32_t index = UID_SLOT_INDEX(policy->uid_hash[i]);
+        if (policy->users[index].local_uid == uid) {
+            return index;
+        }
+        i = (i + 1) & mask;
+    }
+    return -1;
+}
+
+/* Find the keys with the given fingerprint, in no particular order. Stores up
+ * to max key indexes in matches and returns how many keys match in all. The
+ * snapshot must have been built with RS_POLICY_KEYS_INDEXED. */
+int find_policy_keys(struct rs_policy *policy, const uint8_t *fingerprint,
+    uint32_t *matches, int max) {
+    uint32_t mask = policy->key_hash_size - 1;
+    uint32_t i = hash_fingerprint(fingerprint) & mask;
+    int found = 0;
+
+    while (policy->key_hash[i] != SLOT_EMPTY) {
+        uint32_t index = KEY_SLOT_INDEX(policy->key_hash[i]);
+        if (memcmp(policy->keys[index].fingerprint, fingerprint, SHA256_DIGEST_LEN) == 0) {
+            if (found < max) {
+                matches[found] = index;
+            }
+            found++;
+        }
+        i = (i + 1) & mask;
+    }
+    return found;
+}
+
+/* Point an rs_user at a user in the snapshot. Nothing is copied; the entry is
+ * only valid while the caller holds its reference to the snapshot. */
+void get_policy_user(struct rs_policy *policy, int index, struct rs_user *entry) {
+    record_entry(policy->strings, &policy->users[index], entry);
+}
+
+/* Find a user by name for a single lookup. The user comes from the snapshot
+ * when one is available. If there isn't enough memory for one, the policy
+ * file is scanned in place into the lookup's line buffer instead. Either way
+ * entry stays valid until end_lookup. */
+enum nss_status lookup_user_by_name(struct rs_lookup *lookup, const char *name,
+    struct rs_user *entry, int *use_preferred, int *errnop) {
+    int found;
+
+    lookup->index = -1;
+    lookup->policy = acquire_policy(errnop);
+    if (lookup->policy != NULL) {
+        lookup->index = find_policy_user_by_name(lookup->policy, name, use_preferred);
+        found = lookup->index >= 0;
+        if (found) {
+            get_policy_user(lookup->policy, lookup->index, entry);
+        }
+    } else if (*errnop == ENOMEM) {
+        struct rs_policy_file *pf = open_policy_file();
+        if (pf == NULL) {
+            *errnop = ENOENT;
+            return NSS_STATUS_UNAVAIL;
+        }
+        found = find_policy_entry_by_name(pf, lookup->line, sizeof(lookup->line),
+            name, entry, use_preferred);
+        close_policy_file(pf);
+    } else {
+        return policy_error_status(*errnop);
+    }
+
+    if (!found) {
+        *errnop = ENOENT;
+        return NSS_STATUS_NOTFOUND;
+    }
+    return NSS_STATUS_SUCCESS;
+}
+
+/* Find a user by local uid for a single lookup. See lookup_user_by_name */
+enum nss_status lookup_user_by_uid(struct rs_lookup *lookup, uid_t uid,
+    struct rs_user *entry, int *errnop) {
+    int found;
+
+    lookup->index = -1;
+    lookup->policy = acquire_policy(errnop);
+    if (lookup->policy != NULL) {
+        lookup->index = find_policy_user_by_uid(lookup->policy, uid);
+        found = lookup->index >= 0;
+        if (found) {
+            get_policy_user(lookup->policy, lookup->index, entry);
+        }
+    } else if (*errnop == ENOMEM) {
+        struct rs_policy_file *pf = open_policy_file();
+        if (pf == NULL) {
+            *errnop = ENOENT;
+            return NSS_STATUS_UNAVAIL;
+        }
+        found = find_policy_entry_by_uid(pf, lookup->line, sizeof(lookup->line), uid, entry);
+        close_policy_file(pf);
+    } else {
+        return policy_error_status(*errnop);
+    }
+
+    if (!found) {
+        *errnop = ENOENT;
+        return NSS_STATUS_NOTFOUND;
+    }
+    return NSS_STATUS_SUCCESS;
+}
+
+/* Release whatever a lookup_user_* call held on to */
+void end_lookup(struct rs_lookup *lookup) {
+    if (lookup->policy != NULL) {
+        release_policy(lookup->policy);
+        lookup->policy = NULL;
+    }
+}
+
+/* Fill a passwd entry from the rendered entry of a snapshot user, under
+ * their preferred name or their unique name */
+enum nss_status fill_policy_passwd(struct rs_policy *policy, int index, int use_preferred,
+    struct passwd *pwbuf, char *buf, size_t buflen, int *errnop) {
+    struct rs_policy_record *record = &policy->users[index];
+    struct rs_rendered *rendered = (struct rs_rendered *)
+        (policy->rendered + record->passwd[use_preferred == TRUE]);
+    return fill_rendered_passwd(pwbuf, buf, buflen, rendered, record->local_uid, errnop);
+}
+
+/* Fill a shadow entry from the rendered entry of a snapshot user */
+enum nss_status fill_policy_spwd(struct rs_policy *policy, int index, int use_preferred,
+    struct spwd *spbuf, char *buf, size_t buflen, int *errnop) {
+    struct rs_rendered *rendered = (struct rs_rendered *)
+        (policy->rendered + policy->users[index].shadow[use_preferred == TRUE]);
+    return fill_rendered_spwd(spbuf, buf, buflen, rendered, errnop);
+}
+
+/* Fill a passwd entry for the user a lookup found. Users from the snapshot
+ * are copied from their rendered entry; entry is only used for users found
+ * by scanning the policy file. */
+enum nss_status fill_lookup_passwd(struct rs_lookup *lookup, struct passwd *pwbuf,
+    char *buf, size_t buflen, struct rs_user *entry, int use_preferred, int *errnop) {
+    if (lookup->index < 0) {
+        return fill_passwd(pwbuf, buf, buflen, entry, use_preferred, errnop);
+    }
+    return fill_policy_passwd(lookup->policy, lookup->index, use_preferred,
+        pwbuf, buf, buflen, errnop);
+}
+
+/* Fill a shadow entry for the user a lookup found. See fill_lookup_passwd */
+enum nss_status fill_lookup_spwd(struct rs_lookup *lookup, struct spwd *spbuf,
+    char *buf, size_t buflen, struct rs_user *entry, int use_preferred, int *errnop) {
+    if (lookup->index < 0) {
+        return fill_spwd(spbuf, buf, buflen, entry, use_preferred, errnop);
+    }
+    return fill_policy_spwd(lookup->policy, lookup->index, use_preferred,
+        spbuf, buf, buflen, errnop);
+}
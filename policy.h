@@ -0,0 +1,176 @@
+#ifndef NSS_RIGHTSCALE_POLICY_H
+#define NSS_RIGHTSCALE_POLICY_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "sha256.h"
+
+/*
+ * A parsed policy is kept as a single flat, position independent image:
+ *
+ *   header | records | name hash | uid hash | bloom filter | keys | key hash |
+ *   group members | string pool | rendered entries
+ *
+ * All references inside the image are offsets, so the same bytes can live in
+ * malloc'ed memory (built from the text policy file) or be mmap'ed read-only
+ * from a file compiled by rs-policy-compile. The compiled file uses host byte
+ * order and is only meant to be read on the host that compiled it.
+ */
+#define RS_POLICY_MAGIC "RSPOLICY"
+#define RS_POLICY_VERSION 7
+
+/*
+ * Processes that have to parse the text policy file publish the image they
+ * built into a directory, /dev/shm by default, as RS_SHARED_POLICY_PREFIX
+ * followed by a hash of the policy file's path. Other processes map it
+ * instead of parsing the policy file again, after checking it was built from
+ * the policy file as it is now and that only root or the owner of the policy
+ * file can have written it; only their processes publish. A lock file next
+ * to it keeps them from all parsing the same change at once.
+ */
+#define RS_SHARED_POLICY_DIR "/dev/shm"
+#define RS_SHARED_POLICY_PREFIX "rightscale-policy."
+/* Appended to the name of a shared snapshot that also indexes keys */
+#define RS_SHARED_POLICY_KEYS_SUFFIX ".keys"
+
+/* Header flags */
+#define RS_POLICY_KEYS_INDEXED 1 /* Public keys are indexed by fingerprint */
+
+/* Identity of the text policy file an image was built from */
+struct rs_policy_stamp {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t ctime_sec;
+    int64_t ctime_nsec;
+};
+
+struct rs_policy_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t total_size;
+    uint32_t flags;
+    uint32_t reserved;
+    struct rs_policy_stamp source;
+    uint32_t num_users;
+    uint32_t users_offset;     /* struct rs_policy_record[num_users] */
+    uint32_t name_hash_offset; /* uint32_t[name_hash_size] */
+    uint32_t name_hash_size;   /* Power of two */
+    uint32_t uid_hash_offset;  /* uint32_t[uid_hash_size] */
+    uint32_t uid_hash_size;    /* Power of two */
+    uint32_t bloom_offset;     /* uint64_t[bloom_blocks * 8] */
+    uint32_t bloom_blocks;     /* Power of two */
+    uint32_t num_keys;         /* Zero unless RS_POLICY_KEYS_INDEXED */
+    uint32_t keys_offset;      /* struct rs_policy_key[num_keys] */
+    uint32_t key_hash_offset;  /* uint32_t[key_hash_size] */
+    uint32_t key_hash_size;    /* Power of two */
+    uint32_t members_offset;   /* uint32_t[num_members + num_sudo_members] string offsets */
+    uint32_t num_members;      /* Members of the rightscale group */
+    uint32_t num_sudo_members; /* Members of the rightscale_sudo group, following them */
+    uint32_t strings_offset;   /* NUL terminated strings */
+    uint32_t strings_len;
+    uint32_t rendered_offset;  /* struct rs_rendered entries, 4 byte aligned */
+    uint32_t rendered_len;
+    uint32_t group_rendered;   /* rightscale group in the rendered section */
+    uint32_t sudo_group_rendered; /* rightscale_sudo group, likewise */
+};
+
+/* A user from the policy file. Names are offsets into the string pool */
+struct rs_policy_record {
+    uint32_t preferred_name; /* Empty string if the policy has none */
+    uint32_t unique_name;
+    uint32_t gecos;
+    uint32_t rs_uid;
+    uint32_t local_uid;
+    uint32_t superuser;
+    uint64_t line_offset;    /* Of the user's line in the text policy file */
+    uint32_t passwd[2];      /* Rendered passwd entries under the unique and the
+                              * preferred name, as offsets into the rendered
+                              * section. The same without a preferred name. */
+    uint32_t shadow[2];      /* Rendered shadow entries, likewise */
+};
+
+/* A public key from the policy file. The key itself stays in the text file */
+struct rs_policy_key {
+    uint8_t fingerprint[SHA256_DIGEST_LEN]; /* SHA-256 of the key blob */
+    uint32_t user;           /* Index of the user it belongs to */
+    uint32_t len;
+    uint64_t offset;         /* Of the key in the text policy file */
+};
+
+/* Parsed, read-only copy of the policy file shared by all lookups in the
+ * process. Snapshots are reference counted: a lookup holds a reference for
+ * as long as it uses the snapshot, so a reload never frees one in use. A
+ * snapshot is never modified once published, so any number of threads can
+ * read it without locking. */
+struct rs_policy {
+    int refcount;            /* Updated atomically */
+    struct rs_policy_stamp stamp;
+    int mapped;              /* Image is mmap'ed rather than malloc'ed */
+    struct rs_policy_header *header;
+    uint32_t num_users;
+    struct rs_policy_record *users;
+    uint32_t *name_hash;     /* Open addressing table over unique and preferred names */
+    uint32_t name_hash_size;
+    uint32_t *uid_hash;      /* Open addressing table over local uids */
+    uint32_t uid_hash_size;
+    uint64_t *bloom;         /* Blocked Bloom filter over all names and uids */
+    uint32_t bloom_blocks;
+    struct rs_policy_key *keys;
+    uint32_t num_keys;
+    uint32_t *key_hash;      /* Open addressing table over key fingerprints */
+    uint32_t key_hash_size;
+    uint32_t *members;       /* Names of rightscale group members */
+    uint32_t num_members;
+    uint32_t *sudo_members;  /* Names of rightscale_sudo group members */
+    uint32_t num_sudo_members;
+    char *strings;
+    uint32_t strings_len;
+    char *rendered;
+    uint32_t rendered_len;
+    struct rs_rendered_group *group;      /* Rendered rightscale group */
+    struct rs_rendered_group *sudo_group; /* Rendered rightscale_sudo group */
+};
+
+/* State for a single user lookup; see lookup_user_by_name */
+struct rs_lookup {
+    struct rs_policy *policy;
+    int index;               /* Of the user in the snapshot, or -1 */
+    char line[POLICY_BUF_SIZE];
+};
+
+struct rs_policy * acquire_policy(int *);
+struct rs_policy * acquire_policy_keys(int *);
+void release_policy(struct rs_policy *);
+enum nss_status policy_error_status(int);
+
+int find_policy_user_by_name(struct rs_policy *, const char *, int *);
+int find_policy_user_by_uid(struct rs_policy *, uid_t);
+void get_policy_user(struct rs_policy *, int, struct rs_user *);
+int find_policy_keys(struct rs_policy *, const uint8_t *, uint32_t *, int);
+
+enum nss_status fill_policy_passwd(struct rs_policy *, int, int, struct passwd *, char *,
+    size_t, int *);
+enum nss_status fill_policy_spwd(struct rs_policy *, int, int, struct spwd *, char *,
+    size_t, int *);
+
+enum nss_status lookup_user_by_name(struct rs_lookup *, const char *, struct rs_user *, int *, int *);
+enum nss_status lookup_user_by_uid(struct rs_lookup *, uid_t, struct rs_user *, int *);
+void end_lookup(struct rs_lookup *);
+enum nss_status fill_lookup_passwd(struct rs_lookup *, struct passwd *, char *, size_t,
+    struct rs_user *, int, int *);
+enum nss_status fill_lookup_spwd(struct rs_lookup *, struct spwd *, char *, size_t,
+    struct rs_user *, int, int *);
+
+int rendered_valid(const char *, uint32_t, uint32_t, int);
+int rendered_group_valid(const char *, uint32_t, uint32_t);
+
+struct rs_policy_header * build_policy_image(struct rs_policy_file *, int, int *);
+void set_shared_policy_dir(char *);
+
+#endif
@@ -0,0 +1,318 @@
+/*
+ * rightscale-nssd.c : Answer NSS lookups from a policy snapshot held in
+ * memory, so processes using the module don't each parse the policy file.
+ *
+ * Usage: rightscale-nssd [-f policy_file] [-s socket]
+ *
+ * It stays in the foreground, for a supervisor to run. The directory of the
+ * policy file is watched, so a new policy is loaded as soon as it is written
+ * rather than by the first lookup after. The protocol is described in
+ * nssd.h, and the socket is served as described in server.h.
+ *
+ * Shadow entries are only given to root, going by SO_PEERCRED. Anyone else
+ * is told to read the policy file itself, which it may not be allowed to.
+ */
+
+#include "nss-rightscale.h"
+#include "utils.h"
+#include "policy.h"
+#include "nssd.h"
+#include "server.h"
+
+#include <errno.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* A request and the longest name it can carry */
+#define REQUEST_MAX (sizeof(struct rs_nssd_request) + RS_NSSD_MAX_NAME)
+
+/* File name of the policy file, in its watched directory */
+static char policy_name[NAME_MAX + 1];
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-f policy_file] [-s socket]\n", prog);
+    exit(2);
+}
+
+/* Watch the directory of the policy file, as the file is usually replaced
+ * rather than written in place */
+static int watch_policy_file(const char *policy_file, char *name, size_t size) {
+    char dir[PATH_MAX];
+
+    snprintf(dir, sizeof(dir), "%s", policy_file);
+    snprintf(name, size, "%s", basename(dir));
+    snprintf(dir, sizeof(dir), "%s", policy_file);
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0 || inotify_add_watch(fd, dirname(dir),
+            IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE | IN_ATTRIB) < 0) {
+        fprintf(stderr, "Cannot watch %s, policy changes will be picked up by lookups: %s\n",
+            dir, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+/* Load the policy now rather than on the next lookup */
+static void preload_policy(void) {
+    int err;
+    struct rs_policy *policy = acquire_policy(&err);
+    if (policy != NULL) {
+        release_policy(policy);
+    }
+}
+
+/* Returns TRUE if the policy file was among the changed files */
+static int policy_file_changed(int fd) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int changed = FALSE;
+    ssize_t n;
+
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        char *p = buf;
+        while (p < buf + n) {
+            struct inotify_event *event = (struct inotify_event *)p;
+            if (event->len > 0 && strcmp(event->name, policy_name) == 0) {
+                changed = TRUE;
+            }
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    return changed;
+}
+
+/* Load the new policy as soon as it is written */
+static void policy_dir_changed(int fd) {
+    if (policy_file_changed(fd)) {
+        preload_policy();
+    }
+}
+
+/* Remember who the client is, for shadow lookups */
+static int peer_credentials(struct rs_client *client) {
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    if (getsockopt(client->fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0) {
+        return FALSE;
+    }
+    client->uid = cred.uid;
+    return TRUE;
+}
+
+/* Make room for a reply with len bytes of data. Returns where the data goes,
+ * or NULL if there's no memory for it. */
+static char * add_reply(struct rs_client *client, struct rs_nssd_request *request,
+    enum nss_status status, int err, uint32_t uid, size_t len) {
+    char *out = add_client_output(client, sizeof(struct rs_nssd_reply) + len);
+    if (out == NULL) {
+        return NULL;
+    }
+    struct rs_nssd_reply reply = { len, request->id, status, err, uid, 0 };
+    memcpy(out, &reply, sizeof(reply));
+    return out + sizeof(reply);
+}
+
+static int reply_status(struct rs_client *client, struct rs_nssd_request *request,
+    enum nss_status status, int err) {
+    return add_reply(client, request, status, err, 0, 0) != NULL;
+}
+
+static int reply_rendered(struct rs_client *client, struct rs_nssd_request *request,
+    struct rs_policy *policy, uint32_t offset, uint32_t uid) {
+    struct rs_rendered *rendered = (struct rs_rendered *)(policy->rendered + offset);
+    size_t len = sizeof(struct rs_rendered) + rendered->len;
+    char *data = add_reply(client, request, NSS_STATUS_SUCCESS, 0, uid, len);
+    if (data == NULL) {
+        return FALSE;
+    }
+    memcpy(data, rendered, len);
+    return TRUE;
+}
+
+static int reply_group(struct rs_client *client, struct rs_nssd_request *request,
+    struct rs_rendered_group *rendered, gid_t gid) {
+    size_t len = sizeof(struct rs_rendered_group) + rendered->len;
+    char *data = add_reply(client, request, NSS_STATUS_SUCCESS, 0, gid, len);
+    if (data == NULL) {
+        return FALSE;
+    }
+    memcpy(data, rendered, len);
+    return TRUE;
+}
+
+/* A user's private group isn't rendered ahead of time; it has no members */
+static int reply_private_group(struct rs_client *client, struct rs_nssd_request *request,
+    struct rs_policy *policy, int index, int use_preferred) {
+    uint64_t buf[(sizeof(struct rs_rendered_group) + POLICY_BUF_SIZE) / sizeof(uint64_t)];
+    struct rs_rendered_group *rendered = (struct rs_rendered_group *)buf;
+    struct rs_user entry;
+
+    get_policy_user(policy, index, &entry);
+    const char *name = use_preferred ? entry.preferred_name : entry.unique_name;
+    if (render_group(NULL, name, policy->strings, NULL, 0) > POLICY_BUF_SIZE) {
+        return reply_status(client, request, NSS_STATUS_UNAVAIL, ENOENT);
+    }
+    render_group(rendered, name, policy->strings, NULL, 0);
+    return reply_group(client, request, rendered, entry.local_uid);
+}
+
+static int reply_initgroups(struct rs_client *client, struct rs_nssd_request *request,
+    struct rs_policy *policy, int index) {
+    struct rs_policy_record *record = &policy->users[index];
+    uint32_t gids[RS_NSSD_MAX_GROUPS];
+    size_t num_gids = 0;
+
+    gids[num_gids++] = record->local_uid;
+    gids[num_gids++] = RS_GROUP_GID;
+    if (record->superuser == TRUE) {
+        gids[num_gids++] = RS_SUDO_GROUP_GID;
+    }
+    char *data = add_reply(client, request, NSS_STATUS_SUCCESS, 0, 0, sizeof(gids[0]) * num_gids);
+    if (data == NULL) {
+        return FALSE;
+    }
+    memcpy(data, gids, sizeof(gids[0]) * num_gids);
+    return TRUE;
+}
+
+/* Answer a request the same way the module would. Returns FALSE if the
+ * request is malformed or the reply can't be queued, which drops the
+ * client. */
+static int answer(struct rs_client *client, struct rs_policy *policy, int err,
+    struct rs_nssd_request *request, const char *name) {
+    int index;
+    int use_preferred = FALSE;
+
+    if (policy == NULL) {
+        return reply_status(client, request, NSS_STATUS_UNAVAIL, err);
+    }
+    switch (request->type) {
+    case RS_NSSD_GETPWNAM:
+    case RS_NSSD_GETSPNAM:
+    case RS_NSSD_INITGROUPS:
+        if (request->type == RS_NSSD_GETSPNAM && client->uid != 0) {
+            return reply_status(client, request, NSS_STATUS_UNAVAIL, EACCES);
+        }
+        index = find_policy_user_by_name(policy, name, &use_preferred);
+        if (index < 0) {
+            return reply_status(client, request, NSS_STATUS_NOTFOUND, ENOENT);
+        }
+        if (request->type == RS_NSSD_INITGROUPS) {
+            return reply_initgroups(client, request, policy, index);
+        }
+        return reply_rendered(client, request, policy, request->type == RS_NSSD_GETPWNAM ?
+            policy->users[index].passwd[use_preferred == TRUE] :
+            policy->users[index].shadow[use_preferred == TRUE], policy->users[index].local_uid);
+    case RS_NSSD_GETPWUID:
+        index = find_policy_user_by_uid(policy, request->uid);
+        if (index < 0) {
+            return reply_status(client, request, NSS_STATUS_NOTFOUND, ENOENT);
+        }
+        return reply_rendered(client, request, policy, policy->users[index].passwd[1],
+            policy->users[index].local_uid);
+    case RS_NSSD_GETGRNAM:
+        if (strcmp(name, RS_GROUP_NAME) == 0) {
+            return reply_group(client, request, policy->group, RS_GROUP_GID);
+        }
+        if (strcmp(name, RS_SUDO_GROUP_NAME) == 0) {
+            return reply_group(client, request, policy->sudo_group, RS_SUDO_GROUP_GID);
+        }
+        index = find_policy_user_by_name(policy, name, &use_preferred);
+        if (index < 0) {
+            return reply_status(client, request, NSS_STATUS_NOTFOUND, ENOENT);
+        }
+        return reply_private_group(client, request, policy, index, use_preferred);
+    case RS_NSSD_GETGRGID:
+        if (request->uid == RS_GROUP_GID) {
+            return reply_group(client, request, policy->group, RS_GROUP_GID);
+        }
+        if (request->uid == RS_SUDO_GROUP_GID) {
+            return reply_group(client, request, policy->sudo_group, RS_SUDO_GROUP_GID);
+        }
+        index = find_policy_user_by_uid(policy, request->uid);
+        if (index < 0) {
+            return reply_status(client, request, NSS_STATUS_NOTFOUND, ENOENT);
+        }
+        /* Like getgrgid, which names the group after any preferred name */
+        use_preferred = policy->strings[policy->users[index].preferred_name] != '\0';
+        return reply_private_group(client, request, policy, index, use_preferred);
+    }
+    return FALSE;
+}
+
+/* Answer every complete request that has been read. Returns how many bytes
+ * were answered, or -1 if the client should be dropped. */
+static ssize_t answer_requests(struct rs_client *client, const char *in, size_t len) {
+    struct rs_nssd_request request;
+    char name[RS_NSSD_MAX_NAME + 1];
+    size_t pos = 0;
+    int ok = TRUE;
+    int err = 0;
+
+    struct rs_policy *policy = acquire_policy(&err);
+    while (ok && len - pos >= sizeof(request)) {
+        memcpy(&request, in + pos, sizeof(request));
+        if (request.len > RS_NSSD_MAX_NAME) {
+            ok = FALSE;
+            break;
+        }
+        if (len - pos < sizeof(request) + request.len) {
+            break;
+        }
+        memcpy(name, in + pos + sizeof(request), request.len);
+        name[request.len] = '\0';
+        pos += sizeof(request) + request.len;
+        ok = answer(client, policy, err, &request, name);
+    }
+    if (policy != NULL) {
+        release_policy(policy);
+    }
+    return ok ? (ssize_t)pos : -1;
+}
+
+int main(int argc, char *argv[]) {
+    char *policy_file = NULL;
+    char *socket_path = RS_NSSD_SOCKET;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:s:")) != -1) {
+        switch (opt) {
+        case 'f':
+            policy_file = optarg;
+            break;
+        case 's':
+            socket_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc) {
+        usage(argv[0]);
+    }
+    if (policy_file != NULL) {
+        set_policy_file(policy_file);
+    }
+
+    int listen_fd = listen_server_socket(socket_path);
+    if (listen_fd < 0) {
+        return 1;
+    }
+    struct rs_server server = { REQUEST_MAX, peer_credentials, answer_requests, -1,
+        policy_dir_changed };
+    server.watch_fd = watch_policy_file(get_policy_file(), policy_name, sizeof(policy_name));
+    preload_policy();
+    serve_clients(listen_fd, &server);
+
+    unlink(socket_path);
+    return 0;
+}
@@ -0,0 +1,684 @@
+/*
+ * rightscale-userdb.c : Serve the login policy to systemd's userdb over
+ * Varlink, so lookups through systemd-userdbd or userdbctl don't need to
+ * load the NSS module.
+ *
+ * Usage: rightscale-userdb [-f policy_file] [-s socket]
+ *
+ * The socket defaults to /run/systemd/userdb/io.rightscale.Login, where
+ * systemd-userdbd finds it; the service name is the socket's file name.
+ * GetUserRecord, GetGroupRecord and GetMemberships of io.systemd.UserDatabase
+ * are answered the way the module answers the equivalent NSS lookups:
+ *
+ *   - users are found by unique or preferred name, and are named after
+ *     their preferred name when found by uid. Enumerating lists each user
+ *     under their preferred name and then their unique name, like getpwent.
+ *   - each user has a private group named like them with their uid as gid.
+ *     Everyone is in rightscale (10000), superusers in rightscale_sudo
+ *     (10001).
+ *
+ * Varlink messages are JSON objects ending with a NUL byte. Only as much
+ * JSON is parsed as these methods need. Like rightscale-nssd, it stays in
+ * the foreground.
+ */
+
+#include "nss-rightscale.h"
+#include "utils.h"
+#include "policy.h"
+#include "server.h"
+
+#include <libgen.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define USERDB_SOCKET "/run/systemd/userdb/io.rightscale.Login"
+
+/* Longest message we accept, and longest string in one */
+#define MAX_MESSAGE 65536
+#define MAX_STRING 256
+
+#define ERROR_NO_RECORD "io.systemd.UserDatabase.NoRecordFound"
+#define ERROR_CONFLICT "io.systemd.UserDatabase.ConflictingRecordFound"
+#define ERROR_BAD_SERVICE "io.systemd.UserDatabase.BadService"
+#define ERROR_EXPECTED_MORE "org.varlink.service.ExpectedMore"
+#define ERROR_NO_METHOD "org.varlink.service.MethodNotFound"
+#define ERROR_BAD_PARAMETER "org.varlink.service.InvalidParameter"
+
+/* A method call, with the parameters any of our methods take */
+struct call {
+    char method[MAX_STRING];
+    int more;
+    int oneway;
+    int has_id;
+    uint32_t id;               /* uid or gid */
+    char user_name[MAX_STRING];
+    char group_name[MAX_STRING];
+    char service[MAX_STRING];
+    const char *bad_parameter;
+};
+
+/* Replies to a call. With "more", every reply but the last says it
+ * continues; without, there can only be one. */
+struct replies {
+    struct rs_client *client;
+    struct call *call;
+    size_t start;              /* Of the first reply in client->out */
+    int count;
+};
+
+static const char *service_name;
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-f policy_file] [-s socket]\n", prog);
+    exit(2);
+}
+
+/* JSON parsing */
+
+struct json {
+    const char *p;
+    const char *end;
+};
+
+static void skip_space(struct json *j) {
+    while (j->p < j->end && strchr(" \t\r\n", *j->p) != NULL) {
+        j->p++;
+    }
+}
+
+static int take(struct json *j, char c) {
+    skip_space(j);
+    if (j->p < j->end && *j->p == c) {
+        j->p++;
+        return TRUE;
+    }
+    return FALSE;
+}
+
+/* Parse a string into out, or skip it if out is NULL. Strings that don't fit
+ * are an error. */
+static int parse_string(struct json *j, char *out, size_t size) {
+    size_t len = 0;
+
+    if (!take(j, '"')) {
+        return FALSE;
+    }
+    while (j->p < j->end && *j->p != '"') {
+        unsigned int c = (unsigned char)*j->p++;
+        if (c == '\\') {
+            if (j->p == j->end) {
+                return FALSE;
+            }
+            c = (unsigned char)*j->p++;
+            switch (c) {
+            case 'b': c = '\b'; break;
+            case 'f': c = '\f'; break;
+            case 'n': c = '\n'; break;
+            case 'r': c = '\r'; break;
+            case 't': c = '\t'; break;
+            case '"': case '\\': case '/': break;
+            case 'u':
+                /* Names are ASCII; anything else can't match one */
+                if (j->end - j->p < 4 || sscanf(j->p, "%4x", &c) != 1) {
+                    return FALSE;
+                }
+                j->p += 4;
+                if (c == 0 || c > 0x7f) {
+                    c = 0x7f;
+                }
+                break;
+            default:
+                return FALSE;
+            }
+        }
+        if (out != NULL) {
+            if (len + 1 >= size) {
+                return FALSE;
+            }
+            out[len++] = c;
+        }
+    }
+    if (out != NULL) {
+        out[len] = '\0';
+    }
+    return take(j, '"');
+}
+
+static int parse_literal(struct json *j, const char *literal) {
+    size_t len = strlen(literal);
+    skip_space(j);
+    if ((size_t)(j->end - j->p) < len || memcmp(j->p, literal, len) != 0) {
+        return FALSE;
+    }
+    j->p += len;
+    return TRUE;
+}
+
+static int parse_bool(struct json *j, int *value) {
+    if (parse_literal(j, "true")) {
+        *value = TRUE;
+        return TRUE;
+    }
+    *value = FALSE;
+    return parse_literal(j, "false") || parse_literal(j, "null");
+}
+
+static int parse_id(struct json *j, uint32_t *id) {
+    uint64_t n = 0;
+    skip_space(j);
+    if (j->p == j->end || *j->p < '0' || *j->p > '9') {
+        return FALSE;
+    }
+    while (j->p < j->end && *j->p >= '0' && *j->p <= '9') {
+        n = n * 10 + (*j->p++ - '0');
+        if (n > UINT32_MAX) {
+            return FALSE;
+        }
+    }
+    *id = n;
+    return TRUE;
+}
+
+static int skip_value(struct json *j, int depth) {
+    if (depth > 32) {
+        return FALSE;
+    }
+    skip_space(j);
+    if (j->p == j->end) {
+        return FALSE;
+    }
+    if (*j->p == '"') {
+        return parse_string(j, NULL, 0);
+    }
+    if (*j->p == '{' || *j->p == '[') {
+        char close = *j->p == '{' ? '}' : ']';
+        j->p++;
+        if (take(j, close)) {
+            return TRUE;
+        }
+        do {
+            if (close == '}' && (!parse_string(j, NULL, 0) || !take(j, ':'))) {
+                return FALSE;
+            }
+            if (!skip_value(j, depth + 1)) {
+                return FALSE;
+            }
+        } while (take(j, ','));
+        return take(j, close);
+    }
+    /* Number or literal */
+    while (j->p < j->end && strchr(",]} \t\r\n", *j->p) == NULL) {
+        j->p++;
+    }
+    return TRUE;
+}
+
+/* Parse the members of an object, calling member for each key. Returns
+ * FALSE on a syntax error or if member does. */
+static int parse_object(struct json *j, struct call *call,
+    int (*member)(struct json *, struct call *, const char *)) {
+    char key[MAX_STRING];
+
+    if (!take(j, '{')) {
+        return FALSE;
+    }
+    if (take(j, '}')) {
+        return TRUE;
+    }
+    do {
+        if (!parse_string(j, key, sizeof(key)) || !take(j, ':') || !member(j, call, key)) {
+            return FALSE;
+        }
+    } while (take(j, ','));
+    return take(j, '}');
+}
+
+/* A parameter of the wrong type is remembered and skipped, so the call can
+ * be answered with an error */
+static int parameter(struct json *j, struct call *call, const char *key) {
+    const char *start = j->p;
+    const char *name;
+    int ok;
+
+    if (strcmp(key, "uid") == 0 || strcmp(key, "gid") == 0) {
+        name = key[0] == 'u' ? "uid" : "gid";
+        ok = parse_literal(j, "null") || (call->has_id = parse_id(j, &call->id));
+    } else if (strcmp(key, "userName") == 0) {
+        name = "userName";
+        ok = parse_literal(j, "null") || parse_string(j, call->user_name, sizeof(call->user_name));
+    } else if (strcmp(key, "groupName") == 0) {
+        name = "groupName";
+        ok = parse_literal(j, "null") || parse_string(j, call->group_name, sizeof(call->group_name));
+    } else if (strcmp(key, "service") == 0) {
+        name = "service";
+        ok = parse_string(j, call->service, sizeof(call->service));
+    } else {
+        return skip_value(j, 1);
+    }
+    if (!ok) {
+        j->p = start;
+        if (call->bad_parameter == NULL) {
+            call->bad_parameter = name;
+        }
+        return skip_value(j, 1);
+    }
+    return TRUE;
+}
+
+static int message_member(struct json *j, struct call *call, const char *key) {
+    if (strcmp(key, "method") == 0) {
+        return parse_string(j, call->method, sizeof(call->method));
+    }
+    if (strcmp(key, "parameters") == 0) {
+        return parse_object(j, call, parameter);
+    }
+    if (strcmp(key, "more") == 0) {
+        return parse_bool(j, &call->more);
+    }
+    if (strcmp(key, "oneway") == 0) {
+        return parse_bool(j, &call->oneway);
+    }
+    return skip_value(j, 1);
+}
+
+/* JSON output */
+
+static void out_bytes(struct rs_client *client, const char *bytes, size_t len) {
+    char *out = add_client_output(client, len);
+    if (out != NULL) {
+        memcpy(out, bytes, len);
+    }
+}
+
+static void out_text(struct rs_client *client, const char *text) {
+    out_bytes(client, text, strlen(text));
+}
+
+static void out_format(struct rs_client *client, const char *format, ...) {
+    char buf[256];
+    va_list ap;
+    va_start(ap, format);
+    int len = vsnprintf(buf, sizeof(buf), format, ap);
+    va_end(ap);
+    if (len < 0) {
+        return;
+    }
+    out_bytes(client, buf, (size_t)len < sizeof(buf) ? (size_t)len : sizeof(buf) - 1);
+}
+
+static void out_string(struct rs_client *client, const char *s) {
+    const char *run = s;
+    out_text(client, "\"");
+    for (; *s != '\0'; s++) {
+        unsigned char c = *s;
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+        }
+        out_bytes(client, run, s - run);
+        if (c == '"' || c == '\\') {
+            out_format(client, "\\%c", c);
+        } else {
+            out_format(client, "\\u%04x", c);
+        }
+        run = s + 1;
+    }
+    out_bytes(client, run, s - run);
+    out_text(client, "\"");
+}
+
+static void out_error(struct rs_client *client, const char *error, const char *key, const char *value) {
+    out_text(client, "{\"error\":");
+    out_string(client, error);
+    out_text(client, ",\"parameters\":{");
+    if (key != NULL) {
+        out_string(client, key);
+        out_text(client, ":");
+        out_string(client, value);
+    }
+    out_text(client, "}}");
+    out_bytes(client, "", 1);
+}
+
+/* Start a reply's parameters. Returns FALSE if the call can't take another
+ * reply, because it didn't ask for more. */
+static int begin_reply(struct replies *replies) {
+    if (replies->count > 0 && !replies->call->more) {
+        replies->count++;
+        return FALSE;
+    }
+    out_text(replies->client, "{\"parameters\":{");
+    return TRUE;
+}
+
+static void end_reply(struct replies *replies) {
+    out_text(replies->client, "},\"continues\":true}");
+    out_bytes(replies->client, "", 1);
+    replies->count++;
+}
+
+/* Whether to keep looking for records */
+static int replies_wanted(struct replies *replies) {
+    return replies->call->more || replies->count <= 1;
+}
+
+/* Turn the replies into what the call expects. The last reply doesn't
+ * continue; no replies at all is an error. */
+static void finish_replies(struct replies *replies) {
+    struct rs_client *client = replies->client;
+    static const char continues[] = ",\"continues\":true}";
+
+    if (replies->count > 1 && !replies->call->more) {
+        client->out_len = replies->start;
+        out_error(client, ERROR_EXPECTED_MORE, NULL, NULL);
+    } else if (replies->count == 0) {
+        out_error(client, ERROR_NO_RECORD, NULL, NULL);
+    } else if (!client->out_failed) {
+        /* Drop the last reply's continues and its NUL */
+        client->out_len -= sizeof(continues);
+        out_text(client, "}");
+        out_bytes(client, "", 1);
+    }
+}
+
+/* Records */
+
+static void out_user(struct replies *replies, struct rs_policy *policy, int index,
+    int use_preferred) {
+    struct rs_policy_record *record = &policy->users[index];
+    struct rs_rendered *rendered = (struct rs_rendered *)
+        (policy->rendered + record->passwd[use_preferred == TRUE]);
+    const char *strings = (const char *)(rendered + 1);
+    struct rs_client *client = replies->client;
+
+    if (!begin_reply(replies)) {
+        return;
+    }
+    out_text(client, "\"record\":{\"userName\":");
+    out_string(client, strings);
+    out_format(client, ",\"uid\":%u,\"gid\":%u,\"realName\":", record->local_uid, record->local_uid);
+    out_string(client, strings + rendered->field[RENDERED_PW_GECOS]);
+    out_text(client, ",\"homeDirectory\":");
+    out_string(client, strings + rendered->field[RENDERED_PW_DIR]);
+    out_text(client, ",\"shell\":");
+    out_string(client, strings + rendered->field[RENDERED_PW_SHELL]);
+    out_text(client, ",\"disposition\":\"regular\",\"service\":");
+    out_string(client, service_name);
+    out_text(client, "},\"incomplete\":false");
+    end_reply(replies);
+}
+
+static void out_group(struct replies *replies, const char *name, gid_t gid,
+    const char *strings, const uint32_t *members, uint32_t num_members) {
+    struct rs_client *client = replies->client;
+    uint32_t i;
+
+    if (!begin_reply(replies)) {
+        return;
+    }
+    out_text(client, "\"record\":{\"groupName\":");
+    out_string(client, name);
+    out_format(client, ",\"gid\":%u", gid);
+    if (num_members > 0) {
+        out_text(client, ",\"members\":[");
+        for (i = 0; i < num_members; i++) {
+            if (i > 0) {
+                out_text(client, ",");
+            }
+            out_string(client, strings + members[i]);
+        }
+        out_text(client, "]");
+    }
+    out_text(client, ",\"disposition\":\"regular\",\"service\":");
+    out_string(client, service_name);
+    out_text(client, "},\"incomplete\":false");
+    end_reply(replies);
+}
+
+static void out_private_group(struct replies *replies, struct rs_policy *policy, int index,
+    int use_preferred) {
+    struct rs_user entry;
+    get_policy_user(policy, index, &entry);
+    out_group(replies, use_preferred ? entry.preferred_name : entry.unique_name,
+        entry.local_uid, NULL, NULL, 0);
+}
+
+static void out_membership(struct replies *replies, const char *user, const char *group) {
+    struct rs_client *client = replies->client;
+
+    if (!begin_reply(replies)) {
+        return;
+    }
+    out_text(client, "\"userName\":");
+    out_string(client, user);
+    out_text(client, ",\"groupName\":");
+    out_string(client, group);
+    end_reply(replies);
+}
+
+/* Methods */
+
+static void get_user_record(struct replies *replies, struct rs_policy *policy) {
+    struct call *call = replies->call;
+    int use_preferred = TRUE;
+    uint32_t i;
+
+    if (call->user_name[0] != '\0') {
+        int index = find_policy_user_by_name(policy, call->user_name, &use_preferred);
+        if (index >= 0 && call->has_id && policy->users[index].local_uid != call->id) {
+            replies->count = -1;
+            out_error(replies->client, ERROR_CONFLICT, NULL, NULL);
+        } else if (index >= 0) {
+            out_user(replies, policy, index, use_preferred);
+        }
+    } else if (call->has_id) {
+        int index = find_policy_user_by_uid(policy, call->id);
+        if (index >= 0) {
+            out_user(replies, policy, index, TRUE);
+        }
+    } else {
+        for (i = 0; i < policy->num_users && replies_wanted(replies); i++) {
+            struct rs_user entry;
+            get_policy_user(policy, i, &entry);
+            if (has_preferred_name(&entry)) {
+                out_user(replies, policy, i, TRUE);
+            }
+            out_user(replies, policy, i, FALSE);
+        }
+    }
+}
+
+static void get_group_record(struct replies *replies, struct rs_policy *policy) {
+    struct call *call = replies->call;
+    const char *name = call->group_name;
+    int use_preferred = FALSE;
+    int index = -1;
+    uint32_t i;
+
+    if (name[0] == '\0' && call->has_id) {
+        if (call->id == RS_GROUP_GID) {
+            name = RS_GROUP_NAME;
+        } else if (call->id == RS_SUDO_GROUP_GID) {
+            name = RS_SUDO_GROUP_NAME;
+        } else {
+            index = find_policy_user_by_uid(policy, call->id);
+            if (index >= 0) {
+                /* Like getgrgid, which names the group after any preferred name */
+                use_preferred = policy->strings[policy->users[index].preferred_name] != '\0';
+                out_private_group(replies, policy, index, use_preferred);
+            }
+            return;
+        }
+    }
+
+    if (strcmp(name, RS_GROUP_NAME) == 0 || strcmp(name, RS_SUDO_GROUP_NAME) == 0) {
+        int sudo = strcmp(name, RS_SUDO_GROUP_NAME) == 0;
+        gid_t gid = sudo ? RS_SUDO_GROUP_GID : RS_GROUP_GID;
+        if (call->has_id && call->id != gid) {
+            replies->count = -1;
+            out_error(replies->client, ERROR_CONFLICT, NULL, NULL);
+            return;
+        }
+        out_group(replies, name, gid, policy->strings,
+            sudo ? policy->sudo_members : policy->members,
+            sudo ? policy->num_sudo_members : policy->num_members);
+    } else if (name[0] != '\0') {
+        index = find_policy_user_by_name(policy, name, &use_preferred);
+        if (index >= 0 && call->has_id && policy->users[index].local_uid != call->id) {
+            replies->count = -1;
+            out_error(replies->client, ERROR_CONFLICT, NULL, NULL);
+        } else if (index >= 0) {
+            out_private_group(replies, policy, index, use_preferred);
+        }
+    } else {
+        /* In getgrent order */
+        for (i = 0; i < policy->num_users && replies_wanted(replies); i++) {
+            struct rs_user entry;
+            get_policy_user(policy, i, &entry);
+            if (has_preferred_name(&entry)) {
+                out_private_group(replies, policy, i, TRUE);
+            }
+            out_private_group(replies, policy, i, FALSE);
+        }
+        out_group(replies, RS_GROUP_NAME, RS_GROUP_GID, policy->strings,
+            policy->members, policy->num_members);
+        out_group(replies, RS_SUDO_GROUP_NAME, RS_SUDO_GROUP_GID, policy->strings,
+            policy->sudo_members, policy->num_sudo_members);
+    }
+}
+
+static void get_memberships(struct replies *replies, struct rs_policy *policy) {
+    struct call *call = replies->call;
+    const char *user = call->user_name;
+    const char *group = call->group_name;
+    int want_group = group[0] == '\0' || strcmp(group, RS_GROUP_NAME) == 0;
+    int want_sudo = group[0] == '\0' || strcmp(group, RS_SUDO_GROUP_NAME) == 0;
+    int use_preferred;
+    uint32_t i;
+
+    if (user[0] != '\0') {
+        int index = find_policy_user_by_name(policy, user, &use_preferred);
+        if (index < 0) {
+            return;
+        }
+        if (want_group) {
+            out_membership(replies, user, RS_GROUP_NAME);
+        }
+        if (want_sudo && policy->users[index].superuser == TRUE) {
+            out_membership(replies, user, RS_SUDO_GROUP_NAME);
+        }
+        return;
+    }
+    /* Private groups have no members, so only the fixed groups can match */
+    for (i = 0; want_group && i < policy->num_members && replies_wanted(replies); i++) {
+        out_membership(replies, policy->strings + policy->members[i], RS_GROUP_NAME);
+    }
+    for (i = 0; want_sudo && i < policy->num_sudo_members && replies_wanted(replies); i++) {
+        out_membership(replies, policy->strings + policy->sudo_members[i], RS_SUDO_GROUP_NAME);
+    }
+}
+
+static const struct {
+    const char *name;
+    void (*method)(struct replies *, struct rs_policy *);
+} methods[] = {
+    { "io.systemd.UserDatabase.GetUserRecord", get_user_record },
+    { "io.systemd.UserDatabase.GetGroupRecord", get_group_record },
+    { "io.systemd.UserDatabase.GetMemberships", get_memberships },
+};
+
+/* Answer one message. Returns FALSE if it isn't valid, which drops the
+ * client. */
+static int answer(struct rs_client *client, const char *message, size_t len) {
+    struct json j = { message, message + len };
+    struct call call;
+    size_t i;
+
+    memset(&call, 0, sizeof(call));
+    if (!parse_object(&j, &call, message_member)) {
+        return FALSE;
+    }
+    size_t start = client->out_len;
+    struct replies replies = { client, &call, start, 0 };
+
+    for (i = 0; i < sizeof(methods) / sizeof(methods[0]); i++) {
+        if (strcmp(call.method, methods[i].name) == 0) {
+            break;
+        }
+    }
+    if (i == sizeof(methods) / sizeof(methods[0])) {
+        out_error(client, ERROR_NO_METHOD, "method", call.method);
+    } else if (call.bad_parameter != NULL) {
+        out_error(client, ERROR_BAD_PARAMETER, "parameter", call.bad_parameter);
+    } else if (strcmp(call.service, service_name) != 0) {
+        out_error(client, ERROR_BAD_SERVICE, NULL, NULL);
+    } else {
+        int err;
+        struct rs_policy *policy = acquire_policy(&err);
+        if (policy == NULL) {
+            out_error(client, ERROR_NO_RECORD, NULL, NULL);
+        } else {
+            methods[i].method(&replies, policy);
+            release_policy(policy);
+            if (replies.count >= 0) {
+                finish_replies(&replies);
+            }
+        }
+    }
+    if (call.oneway) {
+        client->out_len = start;
+    }
+    return !client->out_failed;
+}
+
+/* Answer every message that has been read, up to its NUL. Returns how many
+ * bytes were answered, or -1 if one isn't valid. */
+static ssize_t answer_messages(struct rs_client *client, const char *in, size_t len) {
+    size_t pos = 0;
+    const char *end;
+
+    while ((end = memchr(in + pos, '\0', len - pos)) != NULL) {
+        if (!answer(client, in + pos, end - (in + pos))) {
+            return -1;
+        }
+        pos = end - in + 1;
+    }
+    return pos;
+}
+
+int main(int argc, char *argv[]) {
+    char *socket_path = USERDB_SOCKET;
+    char path[PATH_MAX];
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:s:")) != -1) {
+        switch (opt) {
+        case 'f':
+            set_policy_file(optarg);
+            break;
+        case 's':
+            socket_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc) {
+        usage(argv[0]);
+    }
+    snprintf(path, sizeof(path), "%s", socket_path);
+    service_name = strdup(basename(path));
+
+    int listen_fd = listen_server_socket(socket_path);
+    if (listen_fd < 0) {
+        return 1;
+    }
+    struct rs_server server = { MAX_MESSAGE, NULL, answer_messages, -1, NULL };
+    serve_clients(listen_fd, &server);
+
+    unlink(socket_path);
+    return 0;
+}
@@ -0,0 +1,283 @@
+/*
+ * rs-nss-stat.c : Show the lookup statistics the NSS module records in its
+ * shared memory segment (see stats.h), or set the segment up.
+ *
+ * Usage: rs-nss-stat [-k key] [-v]
+ *        rs-nss-stat [-k key] -c [-m mode]
+ *        rs-nss-stat [-k key] -r | -d
+ *
+ * Without options, prints for each entry point the calls, how they ended
+ * and their latency, then the processes making them. -v adds the latency
+ * histograms. -c creates the segment; only processes allowed by its mode
+ * (0666 by default, so all of them) count their lookups, and only if it
+ * belongs to root or to their own user. -r zeroes the counters and -d
+ * removes the segment, which processes that have it attached keep using
+ * until they exit.
+ *
+ * The key defaults to stats_key of the module's settings.
+ */
+
+#include "nss-rightscale.h"
+#include "settings.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <unistd.h>
+
+static const char *entry_point_names[RS_STAT_ENTRY_POINTS] = {
+    "getpwnam_r",
+    "getpwuid_r",
+    "getpwent_r",
+    "getspnam_r",
+    "getspent_r",
+    "getgrnam_r",
+    "getgrgid_r",
+    "getgrent_r",
+    "initgroups_dyn",
+};
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-k key] [-v | -c [-m mode] | -r | -d]\n", prog);
+    exit(2);
+}
+
+static int create_segment(key_t key, int mode) {
+    int id = shmget(key, sizeof(struct rs_stats), IPC_CREAT | IPC_EXCL | mode);
+    if (id < 0) {
+        fprintf(stderr, "Cannot create segment 0x%08x: %s\n", key, strerror(errno));
+        return 1;
+    }
+    struct rs_stats *stats = shmat(id, NULL, 0);
+    if (stats == (void *)-1) {
+        fprintf(stderr, "Cannot attach segment 0x%08x: %s\n", key, strerror(errno));
+        shmctl(id, IPC_RMID, NULL);
+        return 1;
+    }
+    /* The module ignores the segment until the header is written */
+    stats->version = RS_STATS_VERSION;
+    stats->size = sizeof(struct rs_stats);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(stats->magic, RS_STATS_MAGIC, sizeof(stats->magic));
+    shmdt(stats);
+    return 0;
+}
+
+static struct rs_stats * attach_segment(key_t key, int *id, int flags) {
+    *id = shmget(key, 0, 0);
+    if (*id < 0) {
+        fprintf(stderr, "No segment 0x%08x: %s\n", key, strerror(errno));
+        return NULL;
+    }
+    struct rs_stats *stats = shmat(*id, NULL, flags);
+    if (stats == (void *)-1) {
+        fprintf(stderr, "Cannot attach segment 0x%08x: %s\n", key, strerror(errno));
+        return NULL;
+    }
+    struct shmid_ds ds;
+    if (shmctl(*id, IPC_STAT, &ds) != 0 || ds.shm_segsz != sizeof(struct rs_stats) ||
+        !stats_valid(stats)) {
+        fprintf(stderr, "Segment 0x%08x isn't one of rs-nss-stat version %d\n", key,
+            RS_STATS_VERSION);
+        shmdt(stats);
+        return NULL;
+    }
+    return stats;
+}
+
+/* Upper bound of a latency bucket, in microseconds */
+static double bucket_us(int bucket) {
+    return (double)((uint64_t)1 << bucket) / 1000;
+}
+
+/* Upper bound of the bucket the given fraction of calls falls in */
+static double percentile_us(const struct rs_stats_entry *entry, double fraction) {
+    uint64_t target = (uint64_t)(entry->calls * fraction);
+    uint64_t seen = 0;
+    int i;
+
+    for (i = 0; i < RS_STATS_BUCKETS; i++) {
+        seen += entry->latency[i];
+        if (seen > target) {
+            break;
+        }
+    }
+    return bucket_us(i < RS_STATS_BUCKETS ? i : RS_STATS_BUCKETS - 1);
+}
+
+static int compare_callers(const void *a, const void *b) {
+    const struct rs_stats_caller *x = a, *y = b;
+    return x->calls < y->calls ? 1 : x->calls > y->calls ? -1 : 0;
+}
+
+static void print_stats(const struct rs_stats *stats, int histograms) {
+    struct rs_stats_entry total[RS_STAT_ENTRY_POINTS];
+    struct rs_stats_caller callers[RS_STATS_CALLERS];
+    uint64_t file_opens = 0, bytes_parsed = 0, loads = 0;
+    int i, j, k;
+
+    /* Add up the shards */
+    memset(total, 0, sizeof(total));
+    for (i = 0; i < RS_STATS_SHARDS; i++) {
+        const struct rs_stats_shard *shard = &stats->shard[i];
+        for (j = 0; j < RS_STAT_ENTRY_POINTS; j++) {
+            const struct rs_stats_entry *entry = &shard->entry[j];
+            total[j].calls += entry->calls;
+            total[j].hits += entry->hits;
+            total[j].misses += entry->misses;
+            total[j].erange += entry->erange;
+            total[j].errors += entry->errors;
+            total[j].total_ns += entry->total_ns;
+            for (k = 0; k < RS_STATS_BUCKETS; k++) {
+                total[j].latency[k] += entry->latency[k];
+            }
+        }
+        file_opens += shard->file_opens;
+        bytes_parsed += shard->bytes_parsed;
+        loads += shard->loads;
+    }
+
+    printf("policy file opens %llu, bytes parsed %llu, snapshots loaded %llu\n\n",
+        (unsigned long long)file_opens, (unsigned long long)bytes_parsed,
+        (unsigned long long)loads);
+
+    printf("%-16s %10s %10s %10s %8s %8s %10s %10s %10s\n", "entry point", "calls", "hits",
+        "misses", "erange", "errors", "avg us", "p50 us", "p99 us");
+    for (j = 0; j < RS_STAT_ENTRY_POINTS; j++) {
+        const struct rs_stats_entry *entry = &total[j];
+        if (entry->calls == 0) {
+            printf("%-16s %10d\n", entry_point_names[j], 0);
+            continue;
+        }
+        printf("%-16s %10llu %10llu %10llu %8llu %8llu %10.1f %10.1f %10.1f\n",
+            entry_point_names[j], (unsigned long long)entry->calls,
+            (unsigned long long)entry->hits, (unsigned long long)entry->misses,
+            (unsigned long long)entry->erange, (unsigned long long)entry->errors,
+            (double)entry->total_ns / entry->calls / 1000,
+            percentile_us(entry, 0.5), percentile_us(entry, 0.99));
+    }
+
+    if (histograms) {
+        for (j = 0; j < RS_STAT_ENTRY_POINTS; j++) {
+            const struct rs_stats_entry *entry = &total[j];
+            if (entry->calls == 0) {
+                continue;
+            }
+            printf("\n%s latency\n", entry_point_names[j]);
+            for (k = 0; k < RS_STATS_BUCKETS; k++) {
+                if (entry->latency[k] == 0) {
+                    continue;
+                }
+                if (k == RS_STATS_BUCKETS - 1) {
+                    printf("  >= %10.1f us %10llu\n", bucket_us(k - 1),
+                        (unsigned long long)entry->latency[k]);
+                } else {
+                    printf("   < %10.1f us %10llu\n", bucket_us(k),
+                        (unsigned long long)entry->latency[k]);
+                }
+            }
+        }
+    }
+
+    memcpy(callers, stats->caller, sizeof(callers));
+    qsort(callers, RS_STATS_CALLERS, sizeof(callers[0]), compare_callers);
+    printf("\n%-16s %10s\n", "caller", "calls");
+    for (i = 0; i < RS_STATS_CALLERS && callers[i].calls > 0; i++) {
+        char name[sizeof(callers[i].name) + 1];
+        memcpy(name, callers[i].name, sizeof(callers[i].name));
+        name[sizeof(callers[i].name)] = '\0';
+        for (k = 0; name[k] != '\0'; k++) {
+            if (name[k] < ' ' || name[k] > '~') {
+                name[k] = '?';
+            }
+        }
+        printf("%-16s %10llu\n", name, (unsigned long long)callers[i].calls);
+    }
+    if (stats->other_callers > 0) {
+        printf("%-16s %10llu\n", "(others)", (unsigned long long)stats->other_callers);
+    }
+}
+
+/* Zero the counters. Callers keep their slots: processes that claimed one
+ * go on counting in it. */
+static void reset_stats(struct rs_stats *stats) {
+    int i;
+
+    stats->other_callers = 0;
+    for (i = 0; i < RS_STATS_CALLERS; i++) {
+        stats->caller[i].calls = 0;
+    }
+    memset(stats->shard, 0, sizeof(stats->shard));
+}
+
+int main(int argc, char *argv[]) {
+    long key = get_settings()->stats_key;
+    int mode = 0666;
+    int action = 'p';
+    int histograms = FALSE;
+    int opt;
+    int id;
+    char *end;
+
+    while ((opt = getopt(argc, argv, "k:m:cdrvh")) != -1) {
+        switch (opt) {
+        case 'k':
+            key = strtol(optarg, &end, 0);
+            if (*optarg == '\0' || *end != '\0' || key <= 0 || key > INT32_MAX) {
+                fprintf(stderr, "Invalid key %s\n", optarg);
+                return 2;
+            }
+            break;
+        case 'm':
+            mode = strtol(optarg, &end, 8);
+            if (*optarg == '\0' || *end != '\0' || mode < 0 || mode > 0777) {
+                fprintf(stderr, "Invalid mode %s\n", optarg);
+                return 2;
+            }
+            break;
+        case 'c':
+        case 'd':
+        case 'r':
+            action = opt;
+            break;
+        case 'v':
+            histograms = TRUE;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc) {
+        usage(argv[0]);
+    }
+    if (key == 0) {
+        fprintf(stderr, "Statistics are turned off (stats_key = none)\n");
+        return 1;
+    }
+
+    if (action == 'c') {
+        return create_segment(key, mode);
+    }
+    struct rs_stats *stats = attach_segment(key, &id, action == 'p' ? SHM_RDONLY : 0);
+    if (stats == NULL) {
+        return 1;
+    }
+    if (action == 'p') {
+        print_stats(stats, histograms);
+    } else if (action == 'r') {
+        reset_stats(stats);
+    } else if (shmctl(id, IPC_RMID, NULL) != 0) {
+        fprintf(stderr, "Cannot remove segment 0x%08lx: %s\n", key, strerror(errno));
+        shmdt(stats);
+        return 1;
+    }
+    shmdt(stats);
+    if (fflush(stdout) != 0) {
+        return 1;
+    }
+    return 0;
+}
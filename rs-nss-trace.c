@@ -0,0 +1,318 @@
+/*
+ * rs-nss-trace.c : Print the trace the NSS module writes to its shared
+ * memory ring (see trace.h), or set the ring up and turn tracing on and off.
+ *
+ * Usage: rs-nss-trace [-k key] [-f] [-u name | -i id]
+ *        rs-nss-trace [-k key] -c [-m mode] [-n records]
+ *        rs-nss-trace [-k key] -e | -o | -d
+ *
+ * Without options, prints the records in the ring, oldest first: when, which
+ * process and thread, the entry point or event, the key looked up, how it
+ * ended, how long it took and how many policy lines it read. -f keeps
+ * printing records as they are written. -u and -i only print the lookups of
+ * the given name or uid/gid; names are only recorded as a hash, which is
+ * what they are matched by.
+ *
+ * -c creates the ring, with 4096 records unless -n says otherwise; its mode
+ * (0666 by default) decides which processes can write to it. Processes trace
+ * into it if started with RS_NSS_TRACE=1, or all of them after -e, until -o.
+ * -d removes the ring.
+ *
+ * The key defaults to trace_key of the module's settings.
+ */
+
+#include "nss-rightscale.h"
+#include "settings.h"
+#include "trace.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <time.h>
+#include <unistd.h>
+
+/* How often -f looks for new records */
+#define FOLLOW_INTERVAL_US 200000
+
+static const char *entry_point_names[RS_STAT_ENTRY_POINTS] = {
+    "getpwnam_r",
+    "getpwuid_r",
+    "getpwent_r",
+    "getspnam_r",
+    "getspent_r",
+    "getgrnam_r",
+    "getgrgid_r",
+    "getgrent_r",
+    "initgroups_dyn",
+};
+
+/* printf formats of the events, given their argument */
+static const char *event_formats[RS_TRACE_EVENTS] = {
+    NULL,
+    "setpwent",
+    "endpwent",
+    "setspent",
+    "endspent",
+    "setgrent",
+    "endgrent",
+    "cannot open policy file, errno %lld",
+    "parsed policy file with %lld users",
+    "ignored stale or invalid compiled policy",
+    "invalid policy line %lld",
+    "policy line %lld too long",
+    "invalid setting on line %lld",
+    "rightscale-nssd didn't answer",
+    "published policy snapshot with %lld users",
+};
+
+/* Which calls to print */
+static struct {
+    int set;
+    uint64_t key;
+    int by_id;
+} filter = { FALSE, 0, FALSE };
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-k key] [-f] [-u name | -i id]\n"
+        "       %s [-k key] -c [-m mode] [-n records]\n"
+        "       %s [-k key] -e | -o | -d\n", prog, prog, prog);
+    exit(2);
+}
+
+static int create_ring(key_t key, int mode, uint32_t num_records) {
+    size_t size = sizeof(struct rs_trace) + num_records * sizeof(struct rs_trace_record);
+    int id = shmget(key, size, IPC_CREAT | IPC_EXCL | mode);
+    if (id < 0) {
+        fprintf(stderr, "Cannot create ring 0x%08x: %s\n", key, strerror(errno));
+        return 1;
+    }
+    struct rs_trace *ring = shmat(id, NULL, 0);
+    if (ring == (void *)-1) {
+        fprintf(stderr, "Cannot attach ring 0x%08x: %s\n", key, strerror(errno));
+        shmctl(id, IPC_RMID, NULL);
+        return 1;
+    }
+    /* The module ignores the ring until the header is written */
+    ring->version = RS_TRACE_VERSION;
+    ring->num_records = num_records;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(ring->magic, RS_TRACE_MAGIC, sizeof(ring->magic));
+    shmdt(ring);
+    return 0;
+}
+
+static struct rs_trace * attach_ring(key_t key, int *id, int flags) {
+    struct shmid_ds ds;
+
+    *id = shmget(key, 0, 0);
+    if (*id < 0) {
+        fprintf(stderr, "No ring 0x%08x: %s\n", key, strerror(errno));
+        return NULL;
+    }
+    struct rs_trace *ring = shmat(*id, NULL, flags);
+    if (ring == (void *)-1) {
+        fprintf(stderr, "Cannot attach ring 0x%08x: %s\n", key, strerror(errno));
+        return NULL;
+    }
+    if (shmctl(*id, IPC_STAT, &ds) != 0 || !trace_valid(ring, ds.shm_segsz)) {
+        fprintf(stderr, "Segment 0x%08x isn't a ring of rs-nss-trace version %d\n", key,
+            RS_TRACE_VERSION);
+        shmdt(ring);
+        return NULL;
+    }
+    return ring;
+}
+
+static const char * status_name(int32_t status) {
+    switch (status) {
+    case NSS_STATUS_SUCCESS:
+        return "SUCCESS";
+    case NSS_STATUS_NOTFOUND:
+        return "NOTFOUND";
+    case NSS_STATUS_UNAVAIL:
+        return "UNAVAIL";
+    case NSS_STATUS_TRYAGAIN:
+        return "TRYAGAIN";
+    default:
+        return "RETURN";
+    }
+}
+
+static void print_record(const struct rs_trace_record *record) {
+    char when[32];
+    time_t sec = record->time_ns / 1000000000;
+    struct tm tm;
+
+    localtime_r(&sec, &tm);
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+    printf("%s.%06u %u/%u ", when, (unsigned int)(record->time_ns % 1000000000 / 1000),
+        record->pid, record->tid);
+
+    if (record->type == RS_TRACE_EVENT) {
+        const char *format = record->what < RS_TRACE_EVENTS ? event_formats[record->what] : NULL;
+        printf("event ");
+        printf(format != NULL ? format : "unknown %lld", (long long)record->key);
+        printf("\n");
+        return;
+    }
+
+    printf("%s ", record->what < RS_STAT_ENTRY_POINTS ? entry_point_names[record->what] : "unknown");
+    if (record->flags & RS_TRACE_BY_ID) {
+        printf("id %llu", (unsigned long long)record->key);
+    } else {
+        printf("name %016llx", (unsigned long long)record->key);
+    }
+    printf(" %s", status_name(record->status));
+    if (record->err != 0) {
+        printf(" (%s)", strerror(record->err));
+    }
+    printf(" %.1fus lines %u", (double)record->duration_ns / 1000, record->lines);
+    if (record->flags & RS_TRACE_NSSD) {
+        printf(" nssd");
+    }
+    if (record->flags & RS_TRACE_LOADED) {
+        printf(" loaded");
+    }
+    printf("\n");
+}
+
+/* Copy a record unless it is being written or isn't the one of sequence
+ * number seq anymore */
+static int read_record(const struct rs_trace *ring, uint64_t seq, uint32_t mask,
+    struct rs_trace_record *copy) {
+    const struct rs_trace_record *record = &ring->record[seq & mask];
+    if (__atomic_load_n(&record->seq, __ATOMIC_ACQUIRE) != seq + 1) {
+        return FALSE;
+    }
+    memcpy(copy, record, sizeof(*copy));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&record->seq, __ATOMIC_RELAXED) == seq + 1 && copy->seq == seq + 1;
+}
+
+static int matches(const struct rs_trace_record *record) {
+    return !filter.set || (record->type == RS_TRACE_CALL && record->key == filter.key &&
+        !(record->flags & RS_TRACE_BY_ID) == !filter.by_id);
+}
+
+/* Print the records from seq on that are still in the ring, which holds
+ * num_records as it was checked when attached. Returns the sequence number to
+ * go on from. */
+static uint64_t print_records(const struct rs_trace *ring, uint32_t num_records, uint64_t seq) {
+    struct rs_trace_record record;
+    uint64_t next = __atomic_load_n(&ring->next, __ATOMIC_ACQUIRE);
+
+    if (next - seq > num_records) {
+        if (seq > 0) {
+            printf("(%llu records lost)\n", (unsigned long long)(next - num_records - seq));
+        }
+        seq = next - num_records;
+    }
+    for (; seq < next; seq++) {
+        if (read_record(ring, seq, num_records - 1, &record) && matches(&record)) {
+            print_record(&record);
+        }
+    }
+    return seq;
+}
+
+int main(int argc, char *argv[]) {
+    long key = get_settings()->trace_key;
+    int mode = 0666;
+    long num_records = RS_TRACE_RECORDS;
+    int action = 'p';
+    int follow = FALSE;
+    int opt;
+    int id;
+    char *end;
+
+    while ((opt = getopt(argc, argv, "k:m:n:u:i:cdefoh")) != -1) {
+        switch (opt) {
+        case 'k':
+            key = strtol(optarg, &end, 0);
+            if (*optarg == '\0' || *end != '\0' || key <= 0 || key > INT32_MAX) {
+                fprintf(stderr, "Invalid key %s\n", optarg);
+                return 2;
+            }
+            break;
+        case 'm':
+            mode = strtol(optarg, &end, 8);
+            if (*optarg == '\0' || *end != '\0' || mode < 0 || mode > 0777) {
+                fprintf(stderr, "Invalid mode %s\n", optarg);
+                return 2;
+            }
+            break;
+        case 'n':
+            num_records = strtol(optarg, &end, 10);
+            if (*optarg == '\0' || *end != '\0' || num_records <= 0 ||
+                num_records > RS_TRACE_MAX_RECORDS || (num_records & (num_records - 1)) != 0) {
+                fprintf(stderr, "Invalid number of records %s, expected a power of two up to %d\n",
+                    optarg, RS_TRACE_MAX_RECORDS);
+                return 2;
+            }
+            break;
+        case 'u':
+            filter.set = TRUE;
+            filter.key = trace_name_hash(optarg);
+            filter.by_id = FALSE;
+            break;
+        case 'i':
+            filter.set = TRUE;
+            filter.key = strtoul(optarg, &end, 10);
+            filter.by_id = TRUE;
+            if (*optarg == '\0' || *end != '\0') {
+                fprintf(stderr, "Invalid id %s\n", optarg);
+                return 2;
+            }
+            break;
+        case 'f':
+            follow = TRUE;
+            break;
+        case 'c':
+        case 'd':
+        case 'e':
+        case 'o':
+            action = opt;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc) {
+        usage(argv[0]);
+    }
+    if (key == 0) {
+        fprintf(stderr, "Tracing is turned off (trace_key = none)\n");
+        return 1;
+    }
+
+    if (action == 'c') {
+        return create_ring(key, mode, num_records);
+    }
+    struct rs_trace *ring = attach_ring(key, &id, action == 'p' ? SHM_RDONLY : 0);
+    if (ring == NULL) {
+        return 1;
+    }
+    int res = 0;
+    if (action == 'p') {
+        uint32_t size = ring->num_records;
+        uint64_t seq = print_records(ring, size, 0);
+        while (follow && fflush(stdout) == 0) {
+            usleep(FOLLOW_INTERVAL_US);
+            seq = print_records(ring, size, seq);
+        }
+    } else if (action == 'e' || action == 'o') {
+        __atomic_store_n(&ring->enabled, action == 'e', __ATOMIC_RELAXED);
+    } else if (shmctl(id, IPC_RMID, NULL) != 0) {
+        fprintf(stderr, "Cannot remove ring 0x%08lx: %s\n", key, strerror(errno));
+        res = 1;
+    }
+    shmdt(ring);
+    if (fflush(stdout) != 0) {
+        return 1;
+    }
+    return res;
+}
@@ -0,0 +1,127 @@
+/*
+ * rs-policy-compile.c : Compile the policy file into the binary format the
+ * NSS module can mmap instead of parsing the text file.
+ *
+ * Usage: rs-policy-compile [-o output] [policy_file]
+ *
+ * The output defaults to the policy file name with ".db" appended, which is
+ * where the NSS module looks for it. It is installed atomically: written to
+ * a temporary file in the same directory, synced and renamed into place.
+ */
+
+#include "nss-rightscale.h"
+#include "utils.h"
+#include "policy.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-o output] [policy_file]\n", prog);
+    exit(2);
+}
+
+static int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(fd, buf, len);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += written;
+        len -= written;
+    }
+    return 0;
+}
+
+/* Make the rename itself durable */
+static void sync_parent_dir(const char *path) {
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", path);
+    int fd = open(dirname(dir), O_RDONLY | O_DIRECTORY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+static int install_image(struct rs_policy_header *header, const char *output) {
+    char tmp_file[PATH_MAX];
+
+    if (snprintf(tmp_file, sizeof(tmp_file), "%s.XXXXXX", output) >= (int)sizeof(tmp_file)) {
+        fprintf(stderr, "Output path too long: %s\n", output);
+        return -1;
+    }
+    int fd = mkstemp(tmp_file);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot create %s: %s\n", tmp_file, strerror(errno));
+        return -1;
+    }
+    if (fchmod(fd, 0644) != 0 ||
+        write_all(fd, (char *)header, header->total_size) != 0 ||
+        fsync(fd) != 0) {
+        fprintf(stderr, "Cannot write %s: %s\n", tmp_file, strerror(errno));
+        close(fd);
+        unlink(tmp_file);
+        return -1;
+    }
+    close(fd);
+
+    if (rename(tmp_file, output) != 0) {
+        fprintf(stderr, "Cannot rename %s to %s: %s\n", tmp_file, output, strerror(errno));
+        unlink(tmp_file);
+        return -1;
+    }
+    sync_parent_dir(output);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    char *output = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "o:h")) != -1) {
+        switch (opt) {
+        case 'o':
+            output = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind < argc - 1) {
+        usage(argv[0]);
+    }
+    if (optind == argc - 1) {
+        set_policy_file(argv[optind]);
+    }
+    if (output == NULL) {
+        output = get_policy_db_file();
+    }
+
+    struct rs_policy_file *pf = open_policy_file();
+    if (pf == NULL) {
+        fprintf(stderr, "Cannot open policy file: %s\n", strerror(errno));
+        return 1;
+    }
+    int err = 0;
+    struct rs_policy_header *header = build_policy_image(pf, RS_POLICY_KEYS_INDEXED, &err);
+    close_policy_file(pf);
+    if (header == NULL) {
+        fprintf(stderr, "Cannot compile policy file: %s\n", strerror(err));
+        return 1;
+    }
+
+    int res = install_image(header, output);
+    free(header);
+    return res == 0 ? 0 : 1;
+}
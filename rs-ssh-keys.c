@@ -0,0 +1,187 @@
+/*
+ * rs-ssh-keys.c : Print the public keys of a user in the policy file, for use
+ * as sshd's AuthorizedKeysCommand.
+ *
+ * Usage: rs-ssh-keys [-f policy_file] [-F fingerprint] [user]
+ *
+ * The user is found by unique or preferred name, like the NSS module does.
+ * The policy index records where each user's line starts, so only that line
+ * is read, and its keys are streamed straight to stdout. With a compiled
+ * policy (see rs-policy-compile) nothing else in the policy file is read.
+ *
+ * With -F only the keys with the given fingerprint, in the "SHA256:..." form
+ * sshd passes as %f, are printed. A compiled policy indexes keys by
+ * fingerprint, so only the matching keys are read. Without a user, every
+ * user with that key is listed as "unique_name<TAB>preferred_name<TAB>key",
+ * which needs the keys indexed: by rs-policy-compile, or in the shared
+ * snapshot that root keeps of the default policy file.
+ * Keys found through the index are only printed once they were all read,
+ * so that nothing is printed twice when the policy file changes under us
+ * and we start over.
+ */
+
+#include "nss-rightscale.h"
+#include "utils.h"
+#include "policy.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* The policy file can be replaced between indexing it and reading the
+ * user's line; give up if it keeps changing */
+#define MAX_ATTEMPTS 3
+
+/* Most keys belong to a single user; more matches are only counted */
+#define MAX_MATCHES 64
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-f policy_file] [-F fingerprint] [user]\n", prog);
+    exit(2);
+}
+
+/* Write the indexed keys of the given user (or of anyone, if user is -1)
+ * that have the given fingerprint to out. Returns the number written, or -1
+ * if the policy file no longer matches the index. */
+static int write_indexed_keys(struct rs_policy *policy, struct rs_policy_file *pf, int user,
+    const uint8_t *fingerprint, FILE *out) {
+    uint32_t matches[MAX_MATCHES];
+    int found = find_policy_keys(policy, fingerprint, matches, MAX_MATCHES);
+    int written = 0;
+    int i;
+
+    if (found > MAX_MATCHES) {
+        fprintf(stderr, "Key shared by %d users, only listing %d\n", found, MAX_MATCHES);
+        found = MAX_MATCHES;
+    }
+    for (i = 0; i < found; i++) {
+        struct rs_policy_key *key = &policy->keys[matches[i]];
+        if (user >= 0 && key->user != (uint32_t)user) {
+            continue;
+        }
+        if (user < 0) {
+            struct rs_policy_record *record = &policy->users[key->user];
+            fprintf(out, "%s\t%s\t", policy->strings + record->unique_name,
+                policy->strings + record->preferred_name);
+        }
+        if (!write_policy_key_at(pf, key->offset, key->len, fingerprint, out)) {
+            return -1;
+        }
+        written++;
+    }
+    return written;
+}
+
+/* Print the indexed keys of the given user (or of anyone, if user is -1)
+ * that have the given fingerprint, once they were all read. Returns the
+ * number printed, or -1 if the policy file no longer matches the index, in
+ * which case nothing was printed. */
+static int print_indexed_keys(struct rs_policy *policy, struct rs_policy_file *pf, int user,
+    const uint8_t *fingerprint) {
+    char *keys = NULL;
+    size_t keys_len = 0;
+
+    FILE *out = open_memstream(&keys, &keys_len);
+    if (out == NULL) {
+        fprintf(stderr, "Cannot allocate memory\n");
+        return 0;
+    }
+    int written = write_indexed_keys(policy, pf, user, fingerprint, out);
+    if (fclose(out) != 0) {
+        fprintf(stderr, "Cannot allocate memory\n");
+        written = 0;
+    } else if (written > 0) {
+        fwrite(keys, 1, keys_len, stdout);
+    }
+    free(keys);
+    return written;
+}
+
+/* Returns 0 once the keys are printed, 1 if the user is unknown or has no
+ * matching key, or -1 if the policy changed under us, in which case nothing
+ * was printed */
+static int print_keys(const char *name, const uint8_t *fingerprint) {
+    int err = 0;
+    int use_preferred;
+    int index = -1;
+    int res = 1;
+
+    struct rs_policy *policy = name != NULL ? acquire_policy(&err) : acquire_policy_keys(&err);
+    if (policy == NULL && err == ENODATA) {
+        fprintf(stderr, "Keys in %s aren't indexed by fingerprint; run rs-policy-compile %s\n",
+            get_policy_file(), get_policy_file());
+        return 1;
+    } else if (policy == NULL) {
+        fprintf(stderr, "Cannot load policy file: %s\n", strerror(err));
+        return 1;
+    }
+    if (name != NULL) {
+        index = find_policy_user_by_name(policy, name, &use_preferred);
+    }
+    if (name == NULL || index >= 0) {
+        struct rs_policy_file *pf = open_policy_file();
+        if (pf == NULL) {
+            fprintf(stderr, "Cannot open policy file: %s\n", strerror(errno));
+        } else {
+            int written = -1;
+            if (fingerprint != NULL && (policy->header->flags & RS_POLICY_KEYS_INDEXED)) {
+                written = print_indexed_keys(policy, pf, index, fingerprint);
+            } else if (seek_policy_file(pf, policy->users[index].line_offset)) {
+                /* The line's unique name is checked before any key is written */
+                written = write_policy_keys(pf,
+                    policy->strings + policy->users[index].unique_name, fingerprint, stdout);
+            }
+            if (written < 0) {
+                res = -1;
+            } else if (written > 0 || fingerprint == NULL) {
+                res = 0;
+            }
+            close_policy_file(pf);
+        }
+    }
+    release_policy(policy);
+    return res;
+}
+
+int main(int argc, char *argv[]) {
+    uint8_t fingerprint[SHA256_DIGEST_LEN];
+    int use_fingerprint = FALSE;
+    int opt;
+    int attempt;
+    int res = -1;
+
+    while ((opt = getopt(argc, argv, "f:F:h")) != -1) {
+        switch (opt) {
+        case 'f':
+            set_policy_file(optarg);
+            break;
+        case 'F':
+            if (!parse_fingerprint(optarg, fingerprint)) {
+                fprintf(stderr, "Invalid fingerprint %s, expected SHA256:...\n", optarg);
+                return 2;
+            }
+            use_fingerprint = TRUE;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 && !(optind == argc && use_fingerprint)) {
+        usage(argv[0]);
+    }
+    const char *name = optind < argc ? argv[optind] : NULL;
+
+    for (attempt = 0; attempt < MAX_ATTEMPTS && res < 0; attempt++) {
+        res = print_keys(name, use_fingerprint ? fingerprint : NULL);
+    }
+    if (res < 0) {
+        fprintf(stderr, "Policy file keeps changing\n");
+        return 1;
+    }
+    if (fflush(stdout) != 0) {
+        return 1;
+    }
+    return res;
+}
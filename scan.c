@@ -0,0 +1,134 @@
+/*
+ * scan.c : Vectorized search for policy file delimiters.
+ */
+
+#include "nss-rightscale.h"
+#include "scan.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SCANNERS 1
+#endif
+
+typedef const char * (*scanner_fn)(const char *, const char *);
+
+static const char * find_delim_scalar(const char *p, const char *end) {
+    while (p < end && *p != ':' && *p != '\n') {
+        p++;
+    }
+    return p;
+}
+
+#ifdef HAVE_X86_SCANNERS
+
+/* Compare a block against both delimiters at once and take the first match
+ * from the byte mask. The tail that doesn't fill a block is done a byte at a
+ * time; it is short, as the read buffer is much larger than a block. */
+__attribute__((target("sse2")))
+static const char * find_delim_sse2(const char *p, const char *end) {
+    const __m128i colon = _mm_set1_epi8(':');
+    const __m128i newline = _mm_set1_epi8('\n');
+    while (end - p >= 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)p);
+        unsigned int mask = _mm_movemask_epi8(_mm_or_si128(
+            _mm_cmpeq_epi8(block, colon), _mm_cmpeq_epi8(block, newline)));
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+    return find_delim_scalar(p, end);
+}
+
+__attribute__((target("avx2")))
+static const char * find_delim_avx2(const char *p, const char *end) {
+    const __m256i colon = _mm256_set1_epi8(':');
+    const __m256i newline = _mm256_set1_epi8('\n');
+    while (end - p >= 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)p);
+        unsigned int mask = _mm256_movemask_epi8(_mm256_or_si256(
+            _mm256_cmpeq_epi8(block, colon), _mm256_cmpeq_epi8(block, newline)));
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 32;
+    }
+    return find_delim_sse2(p, end);
+}
+
+#endif
+
+const char *policy_scanner_names[] = {
+    "scalar",
+#ifdef HAVE_X86_SCANNERS
+    "sse2",
+    "avx2",
+#endif
+    NULL
+};
+
+static scanner_fn scanner_fns[] = {
+    find_delim_scalar,
+#ifdef HAVE_X86_SCANNERS
+    find_delim_sse2,
+    find_delim_avx2,
+#endif
+};
+
+static int scanner_supported(int i) {
+#ifdef HAVE_X86_SCANNERS
+    __builtin_cpu_init();
+    if (strcmp(policy_scanner_names[i], "sse2") == 0) {
+        return __builtin_cpu_supports("sse2");
+    }
+    if (strcmp(policy_scanner_names[i], "avx2") == 0) {
+        return __builtin_cpu_supports("avx2");
+    }
+#endif
+    return TRUE;
+}
+
+/* Index of the scanner in use, or -1 until one is picked. Picking is
+ * idempotent, so threads racing to do it is harmless. */
+static int current_scanner = -1;
+
+static int pick_scanner(void) {
+    int i = sizeof(scanner_fns) / sizeof(scanner_fns[0]) - 1;
+    while (i > 0 && !scanner_supported(i)) {
+        i--;
+    }
+    __atomic_store_n(&current_scanner, i, __ATOMIC_RELAXED);
+    return i;
+}
+
+/* Find the first ':' or '\n' in [p, end). Returns end if there is none */
+const char * find_policy_delim(const char *p, const char *end) {
+    int i = __atomic_load_n(&current_scanner, __ATOMIC_RELAXED);
+    if (i < 0) {
+        i = pick_scanner();
+    }
+    return scanner_fns[i](p, end);
+}
+
+/* Use the named scanner rather than the widest one. Returns FALSE if it
+ * doesn't exist or the CPU doesn't support it. */
+int set_policy_scanner(const char *name) {
+    int i;
+    for (i = 0; policy_scanner_names[i] != NULL; i++) {
+        if (strcmp(policy_scanner_names[i], name) == 0) {
+            if (!scanner_supported(i)) {
+                return FALSE;
+            }
+            __atomic_store_n(&current_scanner, i, __ATOMIC_RELAXED);
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+const char * get_policy_scanner(void) {
+    int i = __atomic_load_n(&current_scanner, __ATOMIC_RELAXED);
+    return policy_scanner_names[i < 0 ? pick_scanner() : i];
+}
@@ -0,0 +1,15 @@
+#ifndef NSS_RIGHTSCALE_SCAN_H
+#define NSS_RIGHTSCALE_SCAN_H
+
+/* Finds the ':' and '\n' delimiters of the policy file a block of 16 or 32
+ * bytes at a time. The widest scanner the CPU supports is picked on first
+ * use; set_policy_scanner overrides it for tests and benchmarks. */
+
+/* Scanners, narrowest first */
+extern const char *policy_scanner_names[];
+
+const char * find_policy_delim(const char *, const char *);
+int set_policy_scanner(const char *);
+const char * get_policy_scanner(void);
+
+#endif
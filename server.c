@@ -0,0 +1,187 @@
+/*
+ * server.c : The socket and client loop of rightscale-nssd and
+ * rightscale-userdb, see server.h.
+ */
+
+#include "nss-rightscale.h"
+#include "server.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static struct rs_client *clients[RS_SERVER_MAX_CLIENTS];
+static int num_clients = 0;
+static volatile sig_atomic_t stopping = FALSE;
+
+static void stop(int sig) {
+    (void)sig;
+    stopping = TRUE;
+}
+
+/* Listen on a socket anybody can connect to, replacing whatever was at path.
+ * Returns -1 after saying why on failure. */
+int listen_server_socket(const char *path) {
+    struct sockaddr_un addr;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot create socket: %s\n", strerror(errno));
+        return -1;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        chmod(path, 0666) != 0 || listen(fd, SOMAXCONN) != 0) {
+        fprintf(stderr, "Cannot listen on %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void accept_client(int listen_fd, const struct rs_server *server) {
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    struct rs_client *client = calloc(1, sizeof(struct rs_client) + server->in_size);
+    if (client != NULL) {
+        client->fd = fd;
+    }
+    if (num_clients == RS_SERVER_MAX_CLIENTS || client == NULL ||
+        (server->accepted != NULL && !server->accepted(client))) {
+        free(client);
+        close(fd);
+        return;
+    }
+    clients[num_clients++] = client;
+}
+
+static void close_client(int i) {
+    close(clients[i]->fd);
+    free(clients[i]->out);
+    free(clients[i]);
+    clients[i] = clients[--num_clients];
+}
+
+/* Make room for len more bytes of replies. Returns where they go, or NULL
+ * and sets out_failed if there's no memory for them. */
+char * add_client_output(struct rs_client *client, size_t len) {
+    size_t needed = client->out_len + len;
+    if (needed > client->out_size) {
+        size_t size = client->out_size > 0 ? client->out_size : 4096;
+        while (size < needed) {
+            size *= 2;
+        }
+        char *out = realloc(client->out, size);
+        if (out == NULL) {
+            client->out_failed = TRUE;
+            return NULL;
+        }
+        client->out = out;
+        client->out_size = size;
+    }
+    char *data = client->out + client->out_len;
+    client->out_len = needed;
+    return data;
+}
+
+/* Returns FALSE if the client went away or should be dropped */
+static int read_requests(struct rs_client *client, const struct rs_server *server) {
+    ssize_t n = read(client->fd, client->in + client->in_len, server->in_size - client->in_len);
+    if (n < 0) {
+        return errno == EAGAIN || errno == EINTR;
+    }
+    if (n == 0) {
+        return FALSE;
+    }
+    client->in_len += n;
+
+    ssize_t used = server->answer(client, client->in, client->in_len);
+    if (used < 0) {
+        return FALSE;
+    }
+    memmove(client->in, client->in + used, client->in_len - used);
+    client->in_len -= used;
+    /* A request that doesn't fit is never going to be answered */
+    return client->in_len < server->in_size;
+}
+
+/* Returns FALSE if the client went away */
+static int write_replies(struct rs_client *client) {
+    while (client->out_pos < client->out_len) {
+        ssize_t n = send(client->fd, client->out + client->out_pos,
+            client->out_len - client->out_pos, MSG_NOSIGNAL);
+        if (n < 0) {
+            return errno == EAGAIN || errno == EINTR;
+        }
+        client->out_pos += n;
+    }
+    client->out_pos = 0;
+    client->out_len = 0;
+    return TRUE;
+}
+
+/* Answer clients of listen_fd until SIGINT or SIGTERM */
+void serve_clients(int listen_fd, const struct rs_server *server) {
+    struct pollfd fds[RS_SERVER_MAX_CLIENTS + 2];
+    int i;
+
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+    signal(SIGPIPE, SIG_IGN);
+
+    while (!stopping) {
+        fds[0].fd = listen_fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = server->watch_fd;
+        fds[1].events = POLLIN;
+        for (i = 0; i < num_clients; i++) {
+            fds[i + 2].fd = clients[i]->fd;
+            /* Stop reading from a client until it has read its replies */
+            fds[i + 2].events = clients[i]->out_len > 0 ? POLLOUT : POLLIN;
+        }
+        int polled = num_clients;
+        if (poll(fds, polled + 2, -1) < 0) {
+            continue;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            server->watched(server->watch_fd);
+        }
+        /* Backwards, as closing a client moves the last one into its slot */
+        for (i = polled - 1; i >= 0; i--) {
+            struct rs_client *client = clients[i];
+            short revents = fds[i + 2].revents;
+            int ok = TRUE;
+            if (revents & POLLOUT) {
+                ok = write_replies(client);
+            } else if (revents & (POLLIN | POLLHUP)) {
+                ok = read_requests(client, server) && write_replies(client);
+            } else if (revents & (POLLERR | POLLNVAL)) {
+                ok = FALSE;
+            }
+            if (!ok) {
+                close_client(i);
+            }
+        }
+        if (fds[0].revents & POLLIN) {
+            accept_client(listen_fd, server);
+        }
+    }
+}
@@ -0,0 +1,45 @@
+#ifndef NSS_RIGHTSCALE_SERVER_H
+#define NSS_RIGHTSCALE_SERVER_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Unix socket server shared by rightscale-nssd and rightscale-userdb. One
+ * thread polls the listening socket and every client. Clients may pipeline
+ * requests; each client's replies are written in order, and a client that
+ * doesn't read its replies isn't read from until it does. The daemons only
+ * say how to answer requests, and which clients to accept.
+ */
+#define RS_SERVER_MAX_CLIENTS 1024
+
+struct rs_client {
+    int fd;
+    uid_t uid;                 /* Of the peer, if the server looked it up */
+    char *out;                 /* Replies not written yet */
+    size_t out_pos;
+    size_t out_len;
+    size_t out_size;
+    int out_failed;            /* Ran out of memory for a reply */
+    size_t in_len;
+    char in[];                 /* Start of the requests not answered yet */
+};
+
+struct rs_server {
+    size_t in_size;            /* Room for requests, at least the longest */
+    /* Called for each new client. Returns FALSE to turn it away. May be
+     * NULL. */
+    int (*accepted)(struct rs_client *);
+    /* Answer the complete requests at the start of the len bytes read. Returns
+     * how many bytes were answered, or -1 to drop the client. */
+    ssize_t (*answer)(struct rs_client *, const char *, size_t);
+    /* Also polled, with watched called once it is readable. -1 for none. */
+    int watch_fd;
+    void (*watched)(int);
+};
+
+int listen_server_socket(const char *);
+void serve_clients(int, const struct rs_server *);
+char * add_client_output(struct rs_client *, size_t);
+
+#endif
@@ -0,0 +1,149 @@
+/*
+ * settings.c : Module settings.
+ */
+
+#include "nss-rightscale.h"
+#include "settings.h"
+#include "nssd.h"
+#include "utils.h"
+#include "policy.h"
+#include "stats.h"
+#include "trace.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+static char *settings_file = SETTINGS_FILE;
+
+static const struct rs_settings default_settings = {
+    0, /* revalidate_interval_ms */
+    RS_NSSD_SOCKET, /* nssd_socket */
+    RS_STATS_KEY, /* stats_key */
+    RS_TRACE_KEY, /* trace_key */
+    RS_SHARED_POLICY_DIR, /* shared_policy_dir */
+};
+
+/* Settings, once settings_loaded is set. Guarded by settings_lock until then */
+static struct rs_settings settings;
+static int settings_loaded = FALSE;
+static pthread_mutex_t settings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Parse a non-negative number. Returns FALSE if value isn't one */
+static int parse_number(const char *value, long *number) {
+    char *end;
+    errno = 0;
+    long n = strtol(value, &end, 10);
+    if (errno != 0 || end == value || *end != '\0' || n < 0) {
+        return FALSE;
+    }
+    *number = n;
+    return TRUE;
+}
+
+/* Parse a System V IPC key, in decimal or 0x hex. "none" is 0 */
+static int parse_key(const char *value, long *key) {
+    char *end;
+    if (strcmp(value, "none") == 0) {
+        *key = 0;
+        return TRUE;
+    }
+    errno = 0;
+    long n = strtol(value, &end, 0);
+    if (errno != 0 || end == value || *end != '\0' || n <= 0 || n > INT32_MAX) {
+        return FALSE;
+    }
+    *key = n;
+    return TRUE;
+}
+
+/* Read the config file into conf. Returns the number of the first line
+ * with a bad setting, or 0 if there is none. */
+static int read_settings_file(struct rs_settings *conf) {
+    char line[1024];
+    int line_no = 0;
+    int bad_line = 0;
+    int ok;
+
+    FILE *fp = fopen(settings_file, "re");
+    if (fp == NULL) {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        line_no++;
+        line[strcspn(line, "#\n")] = '\0';
+        char *key = line + strspn(line, " \t");
+        char *value = key + strcspn(key, " \t=");
+        if (*key == '\0') {
+            continue;
+        }
+        char *key_end = value;
+        value += strspn(value, " \t=");
+        *key_end = '\0';
+        value[strcspn(value, " \t")] = '\0';
+
+        if (strcmp(key, "revalidate_interval_ms") == 0) {
+            ok = parse_number(value, &conf->revalidate_interval_ms);
+        } else if (strcmp(key, "nssd_socket") == 0) {
+            /* "none" turns the daemon off */
+            if (strcmp(value, "none") == 0) {
+                value = "";
+            }
+            ok = strlen(value) < sizeof(conf->nssd_socket);
+            if (ok) {
+                strcpy(conf->nssd_socket, value);
+            }
+        } else if (strcmp(key, "shared_policy_dir") == 0) {
+            /* "none" parses the policy file in every process */
+            if (strcmp(value, "none") == 0) {
+                value = "";
+            }
+            ok = strlen(value) < sizeof(conf->shared_policy_dir);
+            if (ok) {
+                strcpy(conf->shared_policy_dir, value);
+            }
+        } else if (strcmp(key, "stats_key") == 0) {
+            ok = parse_key(value, &conf->stats_key);
+        } else if (strcmp(key, "trace_key") == 0) {
+            ok = parse_key(value, &conf->trace_key);
+        } else {
+            ok = FALSE;
+        }
+        if (!ok && bad_line == 0) {
+            bad_line = line_no;
+        }
+    }
+    fclose(fp);
+    return bad_line;
+}
+
+/* Use another config file. It is read on the next get_settings */
+void set_settings_file(char *new_file_name) {
+    pthread_mutex_lock(&settings_lock);
+    settings_file = new_file_name;
+    __atomic_store_n(&settings_loaded, FALSE, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&settings_lock);
+}
+
+/* Settings from the config file, with defaults for anything it doesn't set
+ * or if there isn't one */
+struct rs_settings * get_settings(void) {
+    int bad_line = 0;
+
+    if (!__atomic_load_n(&settings_loaded, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&settings_lock);
+        if (!settings_loaded) {
+            settings = default_settings;
+            bad_line = read_settings_file(&settings);
+            __atomic_store_n(&settings_loaded, TRUE, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&settings_lock);
+    }
+    /* Tracing needs the settings, so not before they are loaded */
+    if (bad_line != 0) {
+        trace_event(RS_EVENT_BAD_SETTING, bad_line);
+    }
+    return &settings;
+}
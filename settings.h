@@ -0,0 +1,29 @@
+#ifndef NSS_RIGHTSCALE_SETTINGS_H
+#define NSS_RIGHTSCALE_SETTINGS_H
+
+/* Optional settings, read once from the config file on first use. The
+ * file holds "key = value" lines; '#' starts a comment. */
+#define SETTINGS_FILE "/etc/rightscale.d/nss-rightscale.conf"
+
+struct rs_settings {
+    /* Trust the policy snapshot for this long after the policy file was last
+     * checked for changes. 0 checks on every lookup. */
+    long revalidate_interval_ms;
+    /* Socket of rightscale-nssd, tried before reading the policy file
+     * directly. Empty if the daemon isn't to be used. */
+    char nssd_socket[108];
+    /* Key of the shared memory segment lookups are counted in, 0 to count
+     * nothing. See stats.h */
+    long stats_key;
+    /* Key of the shared memory segment lookups are traced in, 0 to trace
+     * nothing. See trace.h */
+    long trace_key;
+    /* Directory parsed snapshots of the policy file are shared in. Empty if
+     * each process is to parse it for itself. See policy.h */
+    char shared_policy_dir[256];
+};
+
+void set_settings_file(char *);
+struct rs_settings * get_settings(void);
+
+#endif
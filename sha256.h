@@ -0,0 +1,12 @@
+#ifndef NSS_RIGHTSCALE_SHA256_H
+#define NSS_RIGHTSCALE_SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_DIGEST_LEN 32
+
+/* FIPS 180-4 SHA-256, just enough to fingerprint ssh keys like ssh-keygen -l */
+void sha256(const void *, size_t, uint8_t *);
+
+#endif
@@ -5,6 +5,7 @@
 #include <errno.h>
 #include <grp.h>
 #include <malloc.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <shadow.h>
 #include <string.h>
@@ -13,146 +14,142 @@
 
 #include "nss-rightscale.h"
 #include "utils.h"
+#include "policy.h"
+#include "nssd.h"
+#include "stats.h"
+#include "trace.h"
 
 /*
  * Get shadow information using username.
  */
 
 /*
- * struct used to store data used by getpwent.
+ * struct used to store data used by getspent, like pwent_data.
  */
 static struct {
-    FILE* fp;
-    int line_no;
-    int entry_seen_count;
-} spent_data = { NULL, 1, 0 };
+    struct rs_policy *policy;
+    uint32_t user;
+    int preferred_seen;
+} spent_data = { NULL, 0, FALSE };
+/* Guards spent_data, like pwent_lock */
+static pthread_mutex_t spent_lock = PTHREAD_MUTEX_INITIALIZER;
 
 
+static enum nss_status setspent_locked(void) {
+    trace_event(RS_EVENT_SETSPENT, 0);
+
+    int err;
+    struct rs_policy *policy = acquire_policy(&err);
+    if (policy == NULL) {
+        return policy_error_status(err);
+    }
+    if (spent_data.policy != NULL) {
+        release_policy(spent_data.policy);
+    }
+    spent_data.policy = policy;
+    spent_data.user = 0;
+    spent_data.preferred_seen = FALSE;
+    return NSS_STATUS_SUCCESS;
+}
+
 /**
  * Setup everything needed to retrieve shadow entries.
  */
 enum nss_status _nss_rightscale_setspent() {
-    NSS_DEBUG("rightscale setspent\n");
-    if (spent_data.fp == NULL) {
-        spent_data.fp = open_policy_file();
-        if (spent_data.fp == NULL) {
-            return NSS_STATUS_UNAVAIL;
-        }
-    } else {
-      rewind(spent_data.fp);
-    }
-    spent_data.line_no = 1;
-    spent_data.entry_seen_count = 0;
-    return NSS_STATUS_SUCCESS;
+    pthread_mutex_lock(&spent_lock);
+    enum nss_status res = setspent_locked();
+    pthread_mutex_unlock(&spent_lock);
+    return res;
 }
 
 /*
  * Free getspent resources.
  */
 enum nss_status _nss_rightscale_endspent() {
-    NSS_DEBUG("rightscale endspent\n");
-    if (spent_data.fp != NULL) {
-        close_policy_file(spent_data.fp);
-        spent_data.fp = NULL;
+    trace_event(RS_EVENT_ENDSPENT, 0);
+    pthread_mutex_lock(&spent_lock);
+    if (spent_data.policy != NULL) {
+        release_policy(spent_data.policy);
+        spent_data.policy = NULL;
     }
+    pthread_mutex_unlock(&spent_lock);
     return NSS_STATUS_SUCCESS;
 }
 
 
-/*
- * Return next shadow entry.
- */
-enum nss_status _nss_rightscale_getspent_r(struct spwd *spbuf, char *buf,
+static enum nss_status getspent_locked(struct spwd *spbuf, char *buf,
             size_t buflen, int *errnop) {
-
-    int res;
-    enum nss_status set_status;
-    NSS_DEBUG("rightscale getspent_r\n");
-    if (spent_data.fp == NULL) {
-        set_status = _nss_rightscale_setspent();
-        if (set_status != NSS_STATUS_SUCCESS) {
+    enum nss_status res;
+    if (spent_data.policy == NULL) {
+        res = setspent_locked();
+        if (res != NSS_STATUS_SUCCESS) {
             *errnop = ENOENT;
-            return set_status;
+            return res;
         }
     }
 
-    int previous_line_no = spent_data.line_no;
-    fpos_t previous_pos;
-    fgetpos(spent_data.fp, &previous_pos);
-    struct rs_user *entry;
-
-    entry = read_next_policy_entry(spent_data.fp, &spent_data.line_no);
-
-    if (entry == NULL) {
+    struct rs_policy *policy = spent_data.policy;
+    if (spent_data.user >= policy->num_users) {
         *errnop = ENOENT;
         return NSS_STATUS_NOTFOUND;
     }
-
-    int use_preferred = TRUE;
-    if (strlen(entry->preferred_name) == 0 || strcmp(entry->preferred_name, entry->unique_name) == 0) {
-        spent_data.entry_seen_count = 1;
-    }
-    if (spent_data.entry_seen_count == 1) {
-        use_preferred = FALSE;
-    }
-
-    res = fill_spwd(spbuf, buf, buflen, entry, use_preferred, errnop);
-    free_rs_user(entry);
-    // Rewind and re-read the current entry
-    if(res == NSS_STATUS_TRYAGAIN && (*errnop) == ERANGE) {
-        spent_data.line_no = previous_line_no;
-        fsetpos(spent_data.fp, &previous_pos);
-    } else {
-        if (spent_data.entry_seen_count == 0) {
-            spent_data.line_no = previous_line_no;
-            fsetpos(spent_data.fp, &previous_pos);
-            spent_data.entry_seen_count += 1;
+    struct rs_user entry;
+    get_policy_user(policy, spent_data.user, &entry);
+    int use_preferred = !spent_data.preferred_seen && has_preferred_name(&entry);
+    res = fill_policy_spwd(policy, spent_data.user, use_preferred, spbuf, buf, buflen, errnop);
+    /* buffer was long enough this time */
+    if (!(res == NSS_STATUS_TRYAGAIN && (*errnop) == ERANGE)) {
+        if (use_preferred) {
+            spent_data.preferred_seen = TRUE;
         } else {
-            spent_data.entry_seen_count = 0;
+            spent_data.user += 1;
+            spent_data.preferred_seen = FALSE;
         }
     }
     return res;
-
 }
 
-/**
- * Get shadow info by username.
+/*
+ * Return next shadow entry.
  */
-enum nss_status _nss_rightscale_getspnam_r(const char *name, struct spwd *spbuf,
-            char *buf, size_t buflen, int *errnop) {
-    int res;
-    struct rs_user *entry;
+enum nss_status _nss_rightscale_getspent_r(struct spwd *spbuf, char *buf,
+            size_t buflen, int *errnop) {
+    struct rs_call call;
+    start_call(&call);
+    pthread_mutex_lock(&spent_lock);
+    enum nss_status res = getspent_locked(spbuf, buf, buflen, errnop);
+    pthread_mutex_unlock(&spent_lock);
+    end_call(&call, RS_STAT_GETSPENT, NULL, 0, res, *errnop);
+    return res;
+}
 
-    NSS_DEBUG("rightscale getspnam_r: Looking for user %s\n", name);
+static enum nss_status lookup_spnam(const char *name, struct spwd *spbuf, char *buf,
+            size_t buflen, int *errnop) {
+    enum nss_status res;
+    struct rs_user entry;
 
-    FILE *fp = open_policy_file();
-    if (fp == NULL) {
-        *errnop = ENOENT;
-        return NSS_STATUS_UNAVAIL;
-    }
-    int found = FALSE;
-    int line_no = 1;
-    while (entry = read_next_policy_entry(fp, &line_no)) {
-        if (strcmp(entry->preferred_name, name) == 0 &&
-          strlen(entry->preferred_name) != 0 &&
-          strcmp(entry->preferred_name, entry->unique_name) != 0) {
-            found = TRUE;
-            res = fill_spwd(spbuf, buf, buflen, entry, TRUE, errnop);
-            break;
-        } else if (strcmp(entry->unique_name, name) == 0) {
-            found = TRUE;
-            res = fill_spwd(spbuf, buf, buflen, entry, FALSE, errnop);
-            break;
-        }
-        free_rs_user(entry);
+    if (nssd_getspnam(name, spbuf, buf, buflen, errnop, &res)) {
+        return res;
     }
 
-    /* We've gotten to the end of file without finding anything */
-    if (!found) {
-        res = NSS_STATUS_NOTFOUND;
-        *errnop = ENOENT;
+    struct rs_lookup lookup;
+    int use_preferred;
+    res = lookup_user_by_name(&lookup, name, &entry, &use_preferred, errnop);
+    if (res == NSS_STATUS_SUCCESS) {
+        res = fill_lookup_spwd(&lookup, spbuf, buf, buflen, &entry, use_preferred, errnop);
     }
+    end_lookup(&lookup);
+    return res;
+}
 
-    close_policy_file(fp);
+/**
+ * Get shadow info by username.
+ */
+enum nss_status _nss_rightscale_getspnam_r(const char *name, struct spwd *spbuf,
+            char *buf, size_t buflen, int *errnop) {
+    struct rs_call call;
+    start_call(&call);
+    enum nss_status res = lookup_spnam(name, spbuf, buf, buflen, errnop);
+    end_call(&call, RS_STAT_GETSPNAM, name, 0, res, *errnop);
     return res;
 }
@@ -0,0 +1,231 @@
+/*
+ * stats.c : Lookup counters and latency histograms, recorded into a shared
+ * memory segment for rs-nss-stat to show. Recording never makes a lookup
+ * fail: without a usable segment nothing is counted.
+ */
+
+#include "nss-rightscale.h"
+#include "settings.h"
+#include "stats.h"
+#include "trace.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <time.h>
+#include <unistd.h>
+
+/* How long to wait before looking for the segment again once it wasn't there */
+#define STATS_RETRY_MS 5000
+
+/* Key to use instead of the configured one, or -1 */
+static long stats_key = -1;
+
+/* The attached segment, or NULL while there is none to record into. It
+ * stays attached for the life of the process. */
+static struct rs_stats *stats = NULL;
+/* Where calls of this process are counted, or NULL to count them as others */
+static struct rs_stats_caller *stats_caller = NULL;
+static uint64_t stats_retry_ms = 0;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t stats_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t stats_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Whether a segment was set up by rs-nss-stat for this version */
+int stats_valid(const struct rs_stats *segment) {
+    return memcmp(segment->magic, RS_STATS_MAGIC, sizeof(segment->magic)) == 0 &&
+        segment->version == RS_STATS_VERSION && segment->size == sizeof(struct rs_stats);
+}
+
+/* Record into another segment than the configured one. -1 goes back to the
+ * configured one, 0 records nothing. Not to be called while other threads
+ * make lookups. */
+void set_stats_key(long key) {
+    pthread_mutex_lock(&stats_lock);
+    stats_key = key;
+    if (stats != NULL) {
+        shmdt(stats);
+        stats = NULL;
+        stats_caller = NULL;
+    }
+    stats_retry_ms = 0;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+/* Attach a segment the module writes to if it was set up by root or by us;
+ * nobody else gets to decide where we write. Sets size to its size, which
+ * can't change while it is attached. Returns NULL if there is none. */
+void * attach_trusted_segment(long key, size_t *size) {
+    struct shmid_ds ds;
+
+    int id = shmget(key, 0, 0);
+    if (id < 0 || shmctl(id, IPC_STAT, &ds) != 0 ||
+        (ds.shm_perm.uid != 0 && ds.shm_perm.uid != geteuid()) ||
+        (ds.shm_perm.cuid != 0 && ds.shm_perm.cuid != geteuid())) {
+        return NULL;
+    }
+    void *segment = shmat(id, NULL, 0);
+    if (segment == (void *)-1) {
+        return NULL;
+    }
+    *size = ds.shm_segsz;
+    return segment;
+}
+
+static struct rs_stats * attach_stats(long key) {
+    size_t size;
+    struct rs_stats *segment = attach_trusted_segment(key, &size);
+    if (segment != NULL && (size != sizeof(struct rs_stats) || !stats_valid(segment))) {
+        shmdt(segment);
+        return NULL;
+    }
+    return segment;
+}
+
+/* Find or claim the slot of this process's name */
+static struct rs_stats_caller * claim_caller(struct rs_stats *segment) {
+    const char *name = program_invocation_short_name;
+    size_t len = strnlen(name, sizeof(segment->caller[0].name));
+    uint64_t hash = 14695981039346656037ULL;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)name[i]) * 1099511628211ULL;
+    }
+    if (hash == 0) {
+        hash = 1;
+    }
+    for (i = 0; i < RS_STATS_CALLERS; i++) {
+        struct rs_stats_caller *caller = &segment->caller[(hash + i) % RS_STATS_CALLERS];
+        uint64_t seen = 0;
+        if (__atomic_compare_exchange_n(&caller->hash, &seen, hash, FALSE,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            memcpy(caller->name, name, len);
+            return caller;
+        }
+        if (seen == hash) {
+            return caller;
+        }
+    }
+    return NULL;
+}
+
+/* The segment to record into, or NULL */
+static struct rs_stats * get_stats(void) {
+    struct rs_stats *segment = __atomic_load_n(&stats, __ATOMIC_ACQUIRE);
+    if (segment != NULL) {
+        return segment;
+    }
+    uint64_t now = stats_now_ms();
+    if (now < __atomic_load_n(&stats_retry_ms, __ATOMIC_RELAXED)) {
+        return NULL;
+    }
+
+    /* Loading the settings can trace a bad one, so not while holding
+     * stats_lock */
+    long key = get_settings()->stats_key;
+    pthread_mutex_lock(&stats_lock);
+    if (stats == NULL && now >= stats_retry_ms) {
+        if (stats_key >= 0) {
+            key = stats_key;
+        }
+        segment = key != 0 ? attach_stats(key) : NULL;
+        if (segment != NULL) {
+            stats_caller = claim_caller(segment);
+            __atomic_store_n(&stats, segment, __ATOMIC_RELEASE);
+        } else {
+            __atomic_store_n(&stats_retry_ms, now + STATS_RETRY_MS, __ATOMIC_RELAXED);
+        }
+    }
+    segment = stats;
+    pthread_mutex_unlock(&stats_lock);
+    return segment;
+}
+
+/* Shard of the CPU we are on */
+static struct rs_stats_shard * get_shard(struct rs_stats *segment) {
+    int cpu = sched_getcpu();
+    return &segment->shard[(unsigned int)(cpu < 0 ? 0 : cpu) % RS_STATS_SHARDS];
+}
+
+static void add(uint64_t *counter, uint64_t n) {
+    __atomic_add_fetch(counter, n, __ATOMIC_RELAXED);
+}
+
+/* Call before doing a lookup */
+void start_call(struct rs_call *call) {
+    call->traced = tracing();
+    call->start_ns = call->traced || get_stats() != NULL ? stats_now_ns() : 0;
+    trace_begin(&call->lines);
+}
+
+/* Count and trace a lookup of the given entry point, for the given name or,
+ * if it is NULL, id, that returned res and, with it, err as errno */
+void end_call(struct rs_call *call, int entry_point, const char *name, uint32_t id,
+    enum nss_status res, int err) {
+    if (call->start_ns == 0) {
+        return;
+    }
+    uint64_t ns = stats_now_ns() - call->start_ns;
+    if (call->traced) {
+        trace_call(entry_point, name, id, call->lines, ns, res, err);
+    }
+
+    struct rs_stats *segment = __atomic_load_n(&stats, __ATOMIC_ACQUIRE);
+    if (segment == NULL) {
+        return;
+    }
+    int bucket = ns == 0 ? 0 : 64 - __builtin_clzll(ns);
+    if (bucket >= RS_STATS_BUCKETS) {
+        bucket = RS_STATS_BUCKETS - 1;
+    }
+
+    struct rs_stats_entry *entry = &get_shard(segment)->entry[entry_point];
+    add(&entry->calls, 1);
+    if (res == NSS_STATUS_SUCCESS) {
+        add(&entry->hits, 1);
+    } else if (res == NSS_STATUS_NOTFOUND) {
+        add(&entry->misses, 1);
+    } else if (res == NSS_STATUS_TRYAGAIN && err == ERANGE) {
+        add(&entry->erange, 1);
+    } else {
+        add(&entry->errors, 1);
+    }
+    add(&entry->total_ns, ns);
+    add(&entry->latency[bucket], 1);
+    add(stats_caller != NULL ? &stats_caller->calls : &segment->other_callers, 1);
+}
+
+void count_file_open(void) {
+    struct rs_stats *segment = get_stats();
+    if (segment != NULL) {
+        add(&get_shard(segment)->file_opens, 1);
+    }
+}
+
+void count_bytes_parsed(size_t n) {
+    struct rs_stats *segment = get_stats();
+    if (segment != NULL) {
+        add(&get_shard(segment)->bytes_parsed, n);
+    }
+}
+
+void count_load(void) {
+    struct rs_stats *segment = get_stats();
+    if (segment != NULL) {
+        add(&get_shard(segment)->loads, 1);
+    }
+}
@@ -0,0 +1,95 @@
+#ifndef NSS_RIGHTSCALE_STATS_H
+#define NSS_RIGHTSCALE_STATS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Lookup statistics, added up across every process that uses the module in
+ * a small System V shared memory segment. The module only records into a
+ * segment that already exists and looks right: rs-nss-stat creates it, and
+ * its permissions decide whose lookups are counted. Unlike a file, the
+ * segment can't be shrunk under a process that has it attached, so anyone
+ * allowed to write to it can skew the numbers but not crash lookups.
+ *
+ * Counters are only ever added to, with atomic instructions, so a reader
+ * may see a call counted before its latency. They are kept in shards picked
+ * by the CPU a thread runs on, so that lookups on different CPUs don't
+ * fight over cache lines; readers add the shards up.
+ */
+#define RS_STATS_KEY 0x52534e53 /* "RSNS" */
+#define RS_STATS_MAGIC "RSSTATS"
+#define RS_STATS_VERSION 1
+
+/* Entry points with counters */
+enum {
+    RS_STAT_GETPWNAM,
+    RS_STAT_GETPWUID,
+    RS_STAT_GETPWENT,
+    RS_STAT_GETSPNAM,
+    RS_STAT_GETSPENT,
+    RS_STAT_GETGRNAM,
+    RS_STAT_GETGRGID,
+    RS_STAT_GETGRENT,
+    RS_STAT_INITGROUPS,
+    RS_STAT_ENTRY_POINTS
+};
+
+/* Latency bucket i counts calls that took at least 2^(i-1) and less than
+ * 2^i ns. The last one also counts anything slower (about a second). */
+#define RS_STATS_BUCKETS 32
+
+#define RS_STATS_SHARDS 16
+
+/* Process names calls are counted under */
+#define RS_STATS_CALLERS 64
+
+struct rs_stats_entry {
+    uint64_t calls;
+    uint64_t hits;      /* NSS_STATUS_SUCCESS */
+    uint64_t misses;    /* NSS_STATUS_NOTFOUND */
+    uint64_t erange;    /* Buffer too small, the caller retries with a bigger one */
+    uint64_t errors;    /* Anything else */
+    uint64_t total_ns;
+    uint64_t latency[RS_STATS_BUCKETS];
+};
+
+struct rs_stats_shard {
+    struct rs_stats_entry entry[RS_STAT_ENTRY_POINTS];
+    uint64_t file_opens;   /* Of the policy file and the compiled policy */
+    uint64_t bytes_parsed; /* Read from the policy file */
+    uint64_t loads;        /* Snapshots loaded, the first one included */
+} __attribute__((aligned(64)));
+
+struct rs_stats_caller {
+    uint64_t hash;      /* Of the name; 0 while the slot is free */
+    char name[16];      /* Set after the slot is claimed, not NUL terminated */
+    uint64_t calls;
+};
+
+struct rs_stats {
+    char magic[8];
+    uint32_t version;
+    uint32_t size;            /* sizeof(struct rs_stats) */
+    uint64_t other_callers;   /* Calls of processes that found no free slot */
+    struct rs_stats_caller caller[RS_STATS_CALLERS];
+    struct rs_stats_shard shard[RS_STATS_SHARDS];
+};
+
+/* A lookup being counted and traced, from start_call to end_call */
+struct rs_call {
+    uint64_t start_ns;  /* 0 if it is neither counted nor traced */
+    int traced;
+    uint32_t lines;     /* Policy lines the thread had read before it */
+};
+
+void set_stats_key(long);
+int stats_valid(const struct rs_stats *);
+void * attach_trusted_segment(long, size_t *);
+void start_call(struct rs_call *);
+void end_call(struct rs_call *, int, const char *, uint32_t, enum nss_status, int);
+void count_file_open(void);
+void count_bytes_parsed(size_t);
+void count_load(void);
+
+#endif
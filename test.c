@@ -1,14 +1,35 @@
 /* Test script.
- * Compile with: make && gcc -g test.c -o run_tests shadow.o utils.o passwd.o group.o
+ * Compile with: make && gcc -g test.c -o run_tests shadow.o utils.o passwd.o group.o policy.o settings.o sha256.o scan.o nssd.o stats.o trace.o -lpthread
  * Run with: ./run_tests
 */
 
 
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <limits.h>
 #include <malloc.h>
+#include <pthread.h>
+#include <stdlib.h>
 #include <stdio.h>
+#include <signal.h>
 #include <string.h>
+#include <sys/file.h>
+#include <sys/shm.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "nss-rightscale.h"
+#include "utils.h"
+#include "policy.h"
+#include "settings.h"
+#include "scan.h"
+#include "nssd.h"
+#include "stats.h"
+#include "trace.h"
 
 static int nss_errno;
 static enum nss_status last_error;
@@ -482,6 +503,1556 @@ static void nss_test_groups(void) {
   nss_endgrent();
 }
 
+static int nss_initgroups(const char *user, gid_t group, gid_t **groups, long int *size) {
+  long int start = 0;
+  enum nss_status status;
+
+  status = _nss_rightscale_initgroups_dyn(user, group, &start, size, groups, 0, &nss_errno);
+  if (status == NSS_STATUS_NOTFOUND) {
+    return -1;
+  }
+  if (status != NSS_STATUS_SUCCESS) {
+    report_nss_error("initgroups_dyn", status);
+    return -1;
+  }
+  return start;
+}
+
+// Make sure initgroups returns the user, rightscale and rightscale_sudo groups
+// without going through group enumeration
+static void nss_test_initgroups(void) {
+  static const struct {
+    const char *user;
+    int expected;
+  } cases[] = {
+    { "peter", 3 },            /* superuser: own group, rightscale, rightscale_sudo */
+    { "rightscale41000", 3 },  /* same user by unique name */
+    { "lopaka", 2 },           /* regular user: own group, rightscale */
+    { "rightscale41003", 3 },  /* superuser with no preferred name */
+    { "rightscale41004", 2 },  /* preferred name same as unique name */
+  };
+  long int size = 1; /* intentionally tiny to make sure the list gets grown */
+  gid_t *groups = malloc(size * sizeof(gid_t));
+  int i;
+
+  printf("Testing initgroups\n");
+  for (i = 0; i < (int)(sizeof(cases) / sizeof(cases[0])); i++) {
+    int count = nss_initgroups(cases[i].user, 0, &groups, &size);
+    printf("  %s: %d groups\n", cases[i].user, count);
+    if (count != cases[i].expected) {
+      total_errors++;
+      printf("ERROR: %s should be in %d groups\n", cases[i].user, cases[i].expected);
+    }
+  }
+
+  /* The primary group passed in is not returned again */
+  if (nss_initgroups("peter", 51000, &groups, &size) != 2) {
+    total_errors++;
+    printf("ERROR: initgroups returned the primary group\n");
+  }
+
+  if (nss_initgroups("nosuchname", 0, &groups, &size) != -1) {
+    total_errors++;
+    printf("ERROR: initgroups found a non existent user\n");
+  }
+  free(groups);
+  printf("\n");
+}
+
+// Make sure the in-place scan used when there's no snapshot resolves names
+// and uids the same way the snapshot index does
+static void nss_test_policy_scan(void) {
+  char line[POLICY_BUF_SIZE];
+  struct rs_user entry;
+  int use_preferred;
+  struct rs_policy_file *pf;
+
+  printf("Testing policy scan\n");
+  pf = open_policy_file();
+  if (!find_policy_entry_by_name(pf, line, sizeof(line), "peter", &entry, &use_preferred) ||
+      !use_preferred || entry.local_uid != 51000 || strcmp(entry.gecos, "Peter Schroeter") != 0) {
+    total_errors++;
+    printf("ERROR: scan didn't find peter by preferred name\n");
+  }
+  close_policy_file(pf);
+
+  pf = open_policy_file();
+  if (!find_policy_entry_by_name(pf, line, sizeof(line), "rightscale41004", &entry, &use_preferred) ||
+      use_preferred || entry.local_uid != 50004) {
+    total_errors++;
+    printf("ERROR: scan didn't find rightscale41004 by unique name\n");
+  }
+  close_policy_file(pf);
+
+  pf = open_policy_file();
+  if (!find_policy_entry_by_uid(pf, line, sizeof(line), 50003, &entry) ||
+      strcmp(entry.unique_name, "rightscale41003") != 0 || entry.superuser != TRUE) {
+    total_errors++;
+    printf("ERROR: scan didn't find uid 50003\n");
+  }
+  close_policy_file(pf);
+
+  pf = open_policy_file();
+  if (find_policy_entry_by_name(pf, line, sizeof(line), "nosuchname", &entry, &use_preferred)) {
+    total_errors++;
+    printf("ERROR: scan found a non existent user\n");
+  }
+  close_policy_file(pf);
+  printf("\n");
+}
+
+// Make sure every delimiter scanner the CPU supports finds the same
+// delimiters, wherever they fall in a block
+static void nss_test_scanners(void) {
+  char text[100];
+  char line[POLICY_BUF_SIZE];
+  struct rs_policy_file *pf;
+  struct rs_user entry;
+  int use_preferred;
+  const char *scanner = get_policy_scanner();
+  size_t pos;
+  int i;
+
+  printf("Testing delimiter scanners\n");
+  for (i = 0; policy_scanner_names[i] != NULL; i++) {
+    if (!set_policy_scanner(policy_scanner_names[i])) {
+      continue;
+    }
+    for (pos = 0; pos <= sizeof(text); pos++) {
+      memset(text, 'a', sizeof(text));
+      if (pos < sizeof(text)) {
+        text[pos] = pos % 2 ? ':' : '\n';
+      }
+      if (find_policy_delim(text, text + sizeof(text)) != text + pos) {
+        total_errors++;
+        printf("ERROR: %s scanner missed the delimiter at %zu\n", policy_scanner_names[i], pos);
+        break;
+      }
+    }
+    pf = open_policy_file();
+    if (!find_policy_entry_by_name(pf, line, sizeof(line), "rightscale41004", &entry, &use_preferred) ||
+        entry.local_uid != 50004) {
+      total_errors++;
+      printf("ERROR: %s scanner didn't find rightscale41004\n", policy_scanner_names[i]);
+    }
+    close_policy_file(pf);
+  }
+  if (set_policy_scanner("nosuchscanner")) {
+    total_errors++;
+    printf("ERROR: unknown scanner accepted\n");
+  }
+  set_policy_scanner(scanner);
+  printf("\n");
+}
+
+// Make sure entries filled from the snapshot's rendered entries match the
+// ones filled from the policy file, and need exactly as much buffer
+static void nss_test_rendered_entries(void) {
+  const char *names[] = { "peter", "rightscale41000", "rightscale41003", "rightscale41004" };
+  char line[POLICY_BUF_SIZE];
+  char buf[1000], expected_buf[1000];
+  struct passwd pwd, expected_pwd;
+  struct spwd spwd, expected_spwd;
+  struct rs_policy_file *pf;
+  struct rs_user entry;
+  int use_preferred;
+  size_t size, expected_size;
+  int i;
+
+  printf("Testing rendered entries\n");
+  for (i = 0; i < (int)(sizeof(names) / sizeof(names[0])); i++) {
+    pf = open_policy_file();
+    find_policy_entry_by_name(pf, line, sizeof(line), names[i], &entry, &use_preferred);
+    close_policy_file(pf);
+
+    for (expected_size = 0; fill_passwd(&expected_pwd, expected_buf, expected_size, &entry,
+        use_preferred, &nss_errno) != NSS_STATUS_SUCCESS; expected_size++);
+    for (size = 0; _nss_rightscale_getpwnam_r(names[i], &pwd, buf, size, &nss_errno) ==
+        NSS_STATUS_TRYAGAIN && nss_errno == ERANGE; size++);
+    if (size != expected_size || strcmp(pwd.pw_name, expected_pwd.pw_name) != 0 ||
+        strcmp(pwd.pw_dir, expected_pwd.pw_dir) != 0 ||
+        strcmp(pwd.pw_passwd, expected_pwd.pw_passwd) != 0 ||
+        strcmp(pwd.pw_shell, expected_pwd.pw_shell) != 0 ||
+        strcmp(pwd.pw_gecos, expected_pwd.pw_gecos) != 0 ||
+        pwd.pw_uid != expected_pwd.pw_uid || pwd.pw_gid != expected_pwd.pw_gid) {
+      total_errors++;
+      printf("ERROR: rendered passwd entry for %s differs (%lu bytes, expected %lu)\n",
+        names[i], (unsigned long)size, (unsigned long)expected_size);
+    }
+
+    for (expected_size = 0; fill_spwd(&expected_spwd, expected_buf, expected_size, &entry,
+        use_preferred, &nss_errno) != NSS_STATUS_SUCCESS; expected_size++);
+    for (size = 0; _nss_rightscale_getspnam_r(names[i], &spwd, buf, size, &nss_errno) ==
+        NSS_STATUS_TRYAGAIN && nss_errno == ERANGE; size++);
+    if (size != expected_size || strcmp(spwd.sp_namp, expected_spwd.sp_namp) != 0 ||
+        strcmp(spwd.sp_pwdp, expected_spwd.sp_pwdp) != 0) {
+      total_errors++;
+      printf("ERROR: rendered shadow entry for %s differs\n", names[i]);
+    }
+  }
+  printf("\n");
+}
+
+// Enumeration must list every user of the policy file in order, under their
+// preferred name and then their unique name
+static void nss_test_enumeration(void) {
+  char line[POLICY_BUF_SIZE];
+  struct rs_policy_file *pf;
+  struct rs_user entry;
+  struct passwd *pwd;
+  struct spwd *sp;
+  int line_no = 1;
+  int preferred;
+
+  printf("Testing enumeration order\n");
+  pf = open_policy_file();
+  nss_setpwent();
+  nss_setspent();
+  while (read_policy_entry(pf, line, sizeof(line), &entry, &line_no)) {
+    for (preferred = has_preferred_name(&entry); preferred >= 0; preferred--) {
+      const char *name = preferred ? entry.preferred_name : entry.unique_name;
+      pwd = nss_getpwent();
+      sp = nss_getspent();
+      if (pwd == NULL || sp == NULL || strcmp(pwd->pw_name, name) != 0 ||
+          strcmp(sp->sp_namp, name) != 0 || pwd->pw_uid != entry.local_uid) {
+        total_errors++;
+        printf("ERROR: enumeration didn't return %s next\n", name);
+      }
+    }
+  }
+  if (nss_getpwent() != NULL || nss_getspent() != NULL) {
+    total_errors++;
+    printf("ERROR: enumeration returned more entries than the policy file has\n");
+  }
+  nss_endspent();
+  nss_endpwent();
+  close_policy_file(pf);
+  printf("\n");
+}
+
+// Rendered groups must match groups filled from the member lists
+static void nss_test_rendered_groups(void) {
+  const char *names[] = { RS_GROUP_NAME, RS_SUDO_GROUP_NAME };
+  char buf[4096] __attribute__((aligned(8)));
+  char expected_buf[4096] __attribute__((aligned(8)));
+  struct group grp, expected_grp;
+  struct rs_policy *policy;
+  size_t size, expected_size;
+  int i, j;
+
+  printf("Testing rendered groups\n");
+  policy = acquire_policy(&nss_errno);
+  if (policy == NULL) {
+    total_errors++;
+    printf("ERROR: policy could not be loaded\n");
+    return;
+  }
+  for (i = 0; i < 2; i++) {
+    for (expected_size = 0; fill_policy_group(&expected_grp, expected_buf, expected_size,
+        names[i], i == 0 ? RS_GROUP_GID : RS_SUDO_GROUP_GID, policy->strings,
+        i == 0 ? policy->members : policy->sudo_members,
+        i == 0 ? policy->num_members : policy->num_sudo_members,
+        &nss_errno) != NSS_STATUS_SUCCESS; expected_size++);
+    for (size = 0; _nss_rightscale_getgrnam_r(names[i], &grp, buf, size, &nss_errno) ==
+        NSS_STATUS_TRYAGAIN && nss_errno == ERANGE; size++);
+    if (size != expected_size || strcmp(grp.gr_name, expected_grp.gr_name) != 0 ||
+        strcmp(grp.gr_passwd, expected_grp.gr_passwd) != 0 ||
+        grp.gr_gid != expected_grp.gr_gid) {
+      total_errors++;
+      printf("ERROR: rendered group %s differs (%lu bytes, expected %lu)\n",
+        names[i], (unsigned long)size, (unsigned long)expected_size);
+      continue;
+    }
+    for (j = 0; expected_grp.gr_mem[j] != NULL; j++) {
+      if (grp.gr_mem[j] == NULL || strcmp(grp.gr_mem[j], expected_grp.gr_mem[j]) != 0 ||
+          grp.gr_mem[j] < buf || grp.gr_mem[j] >= buf + size) {
+        break;
+      }
+    }
+    if (expected_grp.gr_mem[j] != NULL || grp.gr_mem[j] != NULL) {
+      total_errors++;
+      printf("ERROR: rendered group %s has different members\n", names[i]);
+    }
+  }
+  release_policy(policy);
+  printf("\n");
+}
+
+// Make sure the cached policy is re-read once the policy file changes
+static void nss_test_reload(void) {
+  char policy_file[] = "/tmp/rs_test_policy.XXXXXX";
+  int fd = mkstemp(policy_file);
+  FILE *fp = fdopen(fd, "w");
+
+  printf("Testing policy reload\n");
+  fprintf(fp, "reload1:rightscale42000:42000:52000:N:Reload One:\n");
+  fclose(fp);
+  set_policy_file(policy_file);
+
+  if (!nss_getpwnam("reload1") || nss_getpwnam("reload2")) {
+    total_errors++;
+    printf("ERROR: unexpected users in initial policy\n");
+  }
+
+  fp = fopen(policy_file, "a");
+  fprintf(fp, "reload2:rightscale42001:42001:52001:N:Reload Two With Longer Gecos:\n");
+  fclose(fp);
+
+  if (!nss_getpwnam("reload2") || !nss_getpwuid(52001)) {
+    total_errors++;
+    printf("ERROR: policy change was not picked up\n");
+  }
+
+  unlink(policy_file);
+  struct passwd pwd;
+  char buf[1000];
+  if (_nss_rightscale_getpwnam_r("reload1", &pwd, buf, sizeof(buf), &nss_errno) != NSS_STATUS_UNAVAIL) {
+    total_errors++;
+    printf("ERROR: removed policy file still served users\n");
+  }
+
+  set_policy_file("./scripts/sample_policy");
+  printf("\n");
+}
+
+// Look up every user of a policy large enough to spread its indexes over
+// many Bloom filter blocks, and some that aren't there
+static void nss_test_large_policy(void) {
+  char policy_file[] = "/tmp/rs_test_policy.XXXXXX";
+  int fd = mkstemp(policy_file);
+  FILE *fp = fdopen(fd, "w");
+  struct passwd pwd;
+  char buf[1000];
+  char name[64];
+  int missing = 0;
+  int found = 0;
+  int i;
+
+  printf("Testing large policy\n");
+  for (i = 0; i < 5000; i++) {
+    fprintf(fp, "large%d:rightscale%d:%d:%d:N:Large:\n", i, 60000 + i, 60000 + i, 70000 + i);
+  }
+  fclose(fp);
+  set_policy_file(policy_file);
+
+  for (i = 0; i < 5000; i++) {
+    snprintf(name, sizeof(name), "large%d", i);
+    missing += _nss_rightscale_getpwnam_r(name, &pwd, buf, sizeof(buf), &nss_errno) != NSS_STATUS_SUCCESS;
+    snprintf(name, sizeof(name), "rightscale%d", 60000 + i);
+    missing += _nss_rightscale_getpwnam_r(name, &pwd, buf, sizeof(buf), &nss_errno) != NSS_STATUS_SUCCESS;
+    missing += _nss_rightscale_getpwuid_r(70000 + i, &pwd, buf, sizeof(buf), &nss_errno) != NSS_STATUS_SUCCESS;
+    snprintf(name, sizeof(name), "nosuch%d", i);
+    found += _nss_rightscale_getpwnam_r(name, &pwd, buf, sizeof(buf), &nss_errno) != NSS_STATUS_NOTFOUND;
+    found += _nss_rightscale_getpwuid_r(80000 + i, &pwd, buf, sizeof(buf), &nss_errno) != NSS_STATUS_NOTFOUND;
+  }
+  if (missing || found) {
+    total_errors++;
+    printf("ERROR: %d users not found, %d unknown users found\n", missing, found);
+  }
+
+  unlink(policy_file);
+  set_policy_file("./scripts/sample_policy");
+  printf("\n");
+}
+
+// Make sure lines of any length parse, and a line whose fields before the
+// keys are too long is skipped as a whole
+static void nss_test_long_lines(void) {
+  char policy_file[] = "/tmp/rs_test_policy.XXXXXX";
+  int fd = mkstemp(policy_file);
+  FILE *fp = fdopen(fd, "w");
+  char line[POLICY_BUF_SIZE];
+  struct rs_policy_file *pf;
+  struct rs_user entry;
+  struct passwd pwd;
+  char buf[1000];
+  char output[1024];
+  char command[1024];
+  int use_preferred;
+  int entries = 0;
+  size_t len = 0;
+  size_t n;
+  int i;
+
+  printf("Testing long policy lines\n");
+  fprintf(fp, "long1:rightscale47000:47000:57000:N:Long One");
+  for (i = 0; i < 3; i++) {
+    fprintf(fp, ":ssh-rsa %09990d", i);
+  }
+  fprintf(fp, "\ntoolong:rightscale47001:47001:57001:N:%05000d:ssh-rsa AAAA\n", 0);
+  fprintf(fp, "long2:rightscale47002:47002:57002:N:Long Two:ssh-rsa AAAA\n");
+  fclose(fp);
+  set_policy_file(policy_file);
+
+  if (_nss_rightscale_getpwnam_r("long1", &pwd, buf, sizeof(buf), &nss_errno) != NSS_STATUS_SUCCESS ||
+      _nss_rightscale_getpwnam_r("long2", &pwd, buf, sizeof(buf), &nss_errno) != NSS_STATUS_SUCCESS ||
+      _nss_rightscale_getpwnam_r("toolong", &pwd, buf, sizeof(buf), &nss_errno) != NSS_STATUS_NOTFOUND) {
+    total_errors++;
+    printf("ERROR: wrong users found in a policy with long lines\n");
+  }
+
+  pf = open_policy_file();
+  if (!find_policy_entry_by_name(pf, line, sizeof(line), "long2", &entry, &use_preferred) ||
+      entry.local_uid != 57002) {
+    total_errors++;
+    printf("ERROR: scan didn't find the user after long lines\n");
+  }
+  close_policy_file(pf);
+
+  nss_setpwent();
+  while (nss_getpwent() != NULL) {
+    entries++;
+  }
+  nss_endpwent();
+  if (entries != 4) {
+    total_errors++;
+    printf("ERROR: %d passwd entries in a policy with long lines\n", entries);
+  }
+
+  snprintf(command, sizeof(command), "./rs-ssh-keys -f %s long1", policy_file);
+  fp = popen(command, "r");
+  while ((n = fread(output, 1, sizeof(output), fp)) > 0) {
+    len += n;
+  }
+  if (pclose(fp) != 0 || len != 3 * (strlen("ssh-rsa ") + 9990 + 1)) {
+    total_errors++;
+    printf("ERROR: rs-ssh-keys wrote %lu bytes of long keys\n", (unsigned long)len);
+  }
+
+  unlink(policy_file);
+  set_policy_file("./scripts/sample_policy");
+  printf("\n");
+}
+
+// Make sure changes are only picked up after the configured revalidation
+// interval, and right away without one
+static void nss_test_revalidate(void) {
+  char policy_file[] = "/tmp/rs_test_policy.XXXXXX";
+  char settings_file[] = "/tmp/rs_test_config.XXXXXX";
+  int fd = mkstemp(policy_file);
+  FILE *fp = fdopen(fd, "w");
+
+  printf("Testing revalidation interval\n");
+  fprintf(fp, "fresh1:rightscale45000:45000:55000:N:Fresh One:\n");
+  fclose(fp);
+  fd = mkstemp(settings_file);
+  fp = fdopen(fd, "w");
+  fprintf(fp, "# Test config\nrevalidate_interval_ms = 60000\n");
+  fclose(fp);
+  set_settings_file(settings_file);
+  set_policy_file(policy_file);
+
+  if (get_settings()->revalidate_interval_ms != 60000) {
+    total_errors++;
+    printf("ERROR: revalidate_interval_ms not read from config file\n");
+  }
+  if (!nss_getpwnam("fresh1")) {
+    total_errors++;
+    printf("ERROR: user missing from initial policy\n");
+  }
+
+  fp = fopen(policy_file, "a");
+  fprintf(fp, "fresh2:rightscale45001:45001:55001:N:Fresh Two:\n");
+  fclose(fp);
+  struct passwd pwd;
+  char buf[1000];
+  if (_nss_rightscale_getpwnam_r("fresh2", &pwd, buf, sizeof(buf), &nss_errno) != NSS_STATUS_NOTFOUND) {
+    total_errors++;
+    printf("ERROR: policy was checked within the revalidation interval\n");
+  }
+
+  // No config file means no interval
+  unlink(settings_file);
+  set_settings_file(settings_file);
+  if (!nss_getpwnam("fresh2")) {
+    total_errors++;
+    printf("ERROR: policy change was not picked up without an interval\n");
+  }
+
+  unlink(policy_file);
+  set_settings_file(SETTINGS_FILE);
+  set_policy_file("./scripts/sample_policy");
+  printf("\n");
+}
+
+static int thread_failures;
+
+static void *lookup_thread(void *arg) {
+  struct passwd pwd;
+  struct group grp;
+  char buf[1000];
+  int err;
+  int i;
+
+  (void)arg;
+
+  for (i = 0; i < 2000; i++) {
+    if (_nss_rightscale_getpwnam_r("thread1", &pwd, buf, sizeof(buf), &err) != NSS_STATUS_SUCCESS ||
+        _nss_rightscale_getpwuid_r(54000, &pwd, buf, sizeof(buf), &err) != NSS_STATUS_SUCCESS ||
+        _nss_rightscale_getgrgid_r(54000, &grp, buf, sizeof(buf), &err) != NSS_STATUS_SUCCESS) {
+      __atomic_add_fetch(&thread_failures, 1, __ATOMIC_RELAXED);
+    }
+  }
+  return NULL;
+}
+
+// Look users up from several threads while the policy keeps changing and
+// another thread enumerates it
+static void nss_test_threads(void) {
+  char policy_file[] = "/tmp/rs_test_policy.XXXXXX";
+  int fd = mkstemp(policy_file);
+  FILE *fp = fdopen(fd, "w");
+  pthread_t threads[4];
+  struct group grp;
+  char buf[1000];
+  int i;
+
+  printf("Testing concurrent lookups\n");
+  fprintf(fp, "thread1:rightscale44000:44000:54000:N:Thread One:\n");
+  fclose(fp);
+  set_policy_file(policy_file);
+
+  thread_failures = 0;
+  for (i = 0; i < 4; i++) {
+    pthread_create(&threads[i], NULL, lookup_thread, NULL);
+  }
+  for (i = 0; i < 50; i++) {
+    fp = fopen(policy_file, "a");
+    fprintf(fp, "thread%d:rightscale%d:%d:%d:N:Thread:\n", i + 2, 44001 + i, 44001 + i, 54001 + i);
+    fclose(fp);
+    _nss_rightscale_setgrent();
+    while (_nss_rightscale_getgrent_r(&grp, buf, sizeof(buf), &nss_errno) == NSS_STATUS_SUCCESS);
+    _nss_rightscale_endgrent();
+  }
+  for (i = 0; i < 4; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  if (thread_failures) {
+    total_errors++;
+    printf("ERROR: %d concurrent lookups failed\n", thread_failures);
+  }
+
+  unlink(policy_file);
+  set_policy_file("./scripts/sample_policy");
+  printf("\n");
+}
+
+// Make sure a compiled policy is used while it is current and ignored once the
+// text policy changes
+static void nss_test_compiled_policy(void) {
+  char policy_file[] = "/tmp/rs_test_policy.XXXXXX";
+  char command[1024];
+  int fd = mkstemp(policy_file);
+  FILE *fp = fdopen(fd, "w");
+  struct rs_policy *policy;
+
+  printf("Testing compiled policy\n");
+  fprintf(fp, "compiled1:rightscale43000:43000:53000:Y:Compiled One:\n");
+  fclose(fp);
+  set_policy_file(policy_file);
+
+  snprintf(command, sizeof(command), "./rs-policy-compile %s", policy_file);
+  if (system(command) != 0) {
+    total_errors++;
+    printf("ERROR: rs-policy-compile failed\n");
+  }
+
+  policy = acquire_policy(&nss_errno);
+  if (!policy || !policy->mapped) {
+    total_errors++;
+    printf("ERROR: compiled policy was not used\n");
+  }
+  if (policy) {
+    release_policy(policy);
+  }
+  if (!nss_getpwnam("compiled1") || !nss_getpwuid(53000)) {
+    total_errors++;
+    printf("ERROR: user missing from compiled policy\n");
+  }
+
+  fp = fopen(policy_file, "a");
+  fprintf(fp, "compiled2:rightscale43001:43001:53001:N:Compiled Two:\n");
+  fclose(fp);
+
+  policy = acquire_policy(&nss_errno);
+  if (!policy || policy->mapped) {
+    total_errors++;
+    printf("ERROR: stale compiled policy was used\n");
+  }
+  if (policy) {
+    release_policy(policy);
+  }
+  if (!nss_getpwnam("compiled2")) {
+    total_errors++;
+    printf("ERROR: text policy change was not picked up\n");
+  }
+
+  unlink(get_policy_db_file());
+  unlink(policy_file);
+  set_policy_file("./scripts/sample_policy");
+  printf("\n");
+}
+
+// Find the snapshot shared in dir with the given suffix, which should only
+// hold one
+static int shared_policy_stat(const char *dir, const char *suffix, struct stat *st) {
+  char pattern[PATH_MAX];
+  glob_t matches;
+  int res = -1;
+
+  snprintf(pattern, sizeof(pattern), "%s/%s????????????????%s", dir, RS_SHARED_POLICY_PREFIX,
+    suffix);
+  if (glob(pattern, 0, NULL, &matches) == 0) {
+    if (matches.gl_pathc == 1) {
+      res = stat(matches.gl_pathv[0], st);
+    }
+    globfree(&matches);
+  }
+  return res;
+}
+
+// Make the process load policy_file again, as another process would, with
+// snapshots shared in dir
+static struct rs_policy *reload_shared_policy(char *policy_file, char *dir) {
+  set_shared_policy_dir("");
+  set_policy_file("./scripts/sample_policy");
+  struct rs_policy *policy = acquire_policy(&nss_errno);
+  if (policy) {
+    release_policy(policy);
+  }
+  set_shared_policy_dir(dir);
+  set_policy_file(policy_file);
+  return acquire_policy(&nss_errno);
+}
+
+// Hold the lock of the snapshot shared in dir from another process, for
+// hold_ms or, if it is 0, until killed
+static pid_t hold_shared_policy_lock(const char *dir, int hold_ms) {
+  char pattern[PATH_MAX];
+  glob_t matches;
+  int ready[2];
+  char c;
+
+  snprintf(pattern, sizeof(pattern), "%s/%s*.lock", dir, RS_SHARED_POLICY_PREFIX);
+  if (glob(pattern, 0, NULL, &matches) != 0) {
+    return -1;
+  }
+  pipe(ready);
+  pid_t pid = fork();
+  if (pid == 0) {
+    int fd = open(matches.gl_pathv[0], O_RDWR);
+    flock(fd, LOCK_EX);
+    write(ready[1], "x", 1);
+    if (hold_ms > 0) {
+      usleep(hold_ms * 1000);
+    } else {
+      pause();
+    }
+    _exit(0);
+  }
+  globfree(&matches);
+  close(ready[1]);
+  read(ready[0], &c, 1);
+  close(ready[0]);
+  return pid;
+}
+
+// Look up a user added to policy_file, returning how long it took in ms
+static long add_shared_user(char *policy_file, int n) {
+  char name[32];
+  struct timespec start, end;
+  FILE *fp = fopen(policy_file, "a");
+
+  fprintf(fp, "shared%d:rightscale%d:%d:%d:N:Shared:\n", n, 44000 + n, 44000 + n, 54000 + n);
+  fclose(fp);
+  snprintf(name, sizeof(name), "shared%d", n);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (!nss_getpwnam(name)) {
+    total_errors++;
+    printf("ERROR: %s missing from the policy\n", name);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+}
+
+static void nss_test_shared_policy(void) {
+  char policy_file[] = "/tmp/rs_test_policy.XXXXXX";
+  char dir[] = "/tmp/rs_test_shared.XXXXXX";
+  char command[1024];
+  struct stat st;
+  ino_t published;
+  int fd = mkstemp(policy_file);
+  FILE *fp = fdopen(fd, "w");
+  struct rs_policy *policy;
+
+  printf("Testing shared policy snapshots\n");
+  fprintf(fp, "shared1:rightscale44000:44000:54000:N:Shared One:\n");
+  fclose(fp);
+  mkdtemp(dir);
+  set_shared_policy_dir(dir);
+  set_policy_file(policy_file);
+
+  policy = acquire_policy(&nss_errno);
+  if (!policy || !policy->mapped) {
+    total_errors++;
+    printf("ERROR: published snapshot was not mapped\n");
+  }
+  if (policy) {
+    release_policy(policy);
+  }
+  if (shared_policy_stat(dir, "", &st) != 0) {
+    total_errors++;
+    printf("ERROR: no snapshot was published in %s\n", dir);
+    st.st_ino = 0;
+  } else if ((st.st_mode & (S_IWGRP | S_IWOTH)) || (st.st_uid != 0 && st.st_uid != geteuid())) {
+    total_errors++;
+    printf("ERROR: published snapshot can be written by others\n");
+  }
+  published = st.st_ino;
+
+  // Another process maps it rather than publish its own
+  policy = reload_shared_policy(policy_file, dir);
+  if (!policy || !policy->mapped || shared_policy_stat(dir, "", &st) != 0 ||
+      st.st_ino != published) {
+    total_errors++;
+    printf("ERROR: published snapshot was not reused\n");
+  }
+  if (policy) {
+    release_policy(policy);
+  }
+  if (!nss_getpwnam("shared1") || !nss_getpwuid(54000)) {
+    total_errors++;
+    printf("ERROR: user missing from shared snapshot\n");
+  }
+
+  fp = fopen(policy_file, "a");
+  fprintf(fp, "shared2:rightscale44001:44001:54001:N:Shared Two:\n");
+  fclose(fp);
+  if (!nss_getpwnam("shared2")) {
+    total_errors++;
+    printf("ERROR: policy change was not picked up\n");
+  }
+  if (shared_policy_stat(dir, "", &st) != 0 || st.st_ino == published) {
+    total_errors++;
+    printf("ERROR: snapshot was not published again after a policy change\n");
+  }
+
+  // One anybody could have written is replaced rather than used
+  snprintf(command, sizeof(command), "chmod 666 %s/%s*[0-9a-f]", dir, RS_SHARED_POLICY_PREFIX);
+  system(command);
+  policy = reload_shared_policy(policy_file, dir);
+  if (!policy || shared_policy_stat(dir, "", &st) != 0 || (st.st_mode & (S_IWGRP | S_IWOTH))) {
+    total_errors++;
+    printf("ERROR: untrusted snapshot was not replaced\n");
+  }
+  if (policy) {
+    release_policy(policy);
+  }
+
+  // While another process publishes, we wait for it, then map what it
+  // published or, if it takes too long, parse the policy ourselves
+  int status;
+  long ms;
+  pid_t pid = hold_shared_policy_lock(dir, 200);
+  ms = add_shared_user(policy_file, 3);
+  policy = acquire_policy(&nss_errno);
+  if (pid < 0 || !policy || !policy->mapped || ms < 150 || ms > 1500) {
+    total_errors++;
+    printf("ERROR: snapshot was not published after waiting %ldms for the lock\n", ms);
+  }
+  if (policy) {
+    release_policy(policy);
+  }
+  waitpid(pid, &status, 0);
+  pid = hold_shared_policy_lock(dir, 0);
+  ms = add_shared_user(policy_file, 4);
+  policy = acquire_policy(&nss_errno);
+  if (pid < 0 || !policy || policy->mapped || ms < 1500 || ms > 5000) {
+    total_errors++;
+    printf("ERROR: lookup took %ldms while the lock was held\n", ms);
+  }
+  if (policy) {
+    release_policy(policy);
+  }
+  if (pid > 0) {
+    kill(pid, SIGTERM);
+    waitpid(pid, &status, 0);
+  }
+
+  // Keys are indexed in a snapshot of their own, which is reused too
+  policy = acquire_policy_keys(&nss_errno);
+  if (!policy || !policy->mapped || !(policy->header->flags & RS_POLICY_KEYS_INDEXED) ||
+      shared_policy_stat(dir, RS_SHARED_POLICY_KEYS_SUFFIX, &st) != 0) {
+    total_errors++;
+    printf("ERROR: snapshot with keys was not published\n");
+    st.st_ino = 0;
+  }
+  if (policy) {
+    release_policy(policy);
+  }
+  published = st.st_ino;
+  policy = reload_shared_policy(policy_file, dir);
+  if (policy) {
+    release_policy(policy);
+  }
+  policy = acquire_policy_keys(&nss_errno);
+  if (!policy || !policy->mapped ||
+      shared_policy_stat(dir, RS_SHARED_POLICY_KEYS_SUFFIX, &st) != 0 || st.st_ino != published) {
+    total_errors++;
+    printf("ERROR: snapshot with keys was not reused\n");
+  }
+  if (policy) {
+    release_policy(policy);
+  }
+
+  policy = reload_shared_policy(policy_file, "");
+  if (!policy || policy->mapped) {
+    total_errors++;
+    printf("ERROR: snapshot was shared while sharing is off\n");
+  }
+  if (policy) {
+    release_policy(policy);
+  }
+
+  set_shared_policy_dir(NULL);
+  snprintf(command, sizeof(command), "rm -rf %s", dir);
+  system(command);
+  unlink(policy_file);
+  set_policy_file("./scripts/sample_policy");
+  printf("\n");
+}
+
+// Connect to rightscale-nssd, waiting for it to come up
+static int nssd_test_connect(const char *path) {
+  struct sockaddr_un addr;
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  int i;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+  for (i = 0; i < 500; i++) {
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+      return fd;
+    }
+    usleep(10000);
+  }
+  close(fd);
+  return -1;
+}
+
+// Requests can be pipelined; replies come back in order
+static void nssd_test_pipelining(int fd) {
+  struct rs_nssd_request requests[3] = {
+    { 0, RS_NSSD_GETPWUID, 0, 7, 51000 },
+    { 0, RS_NSSD_GETGRGID, 0, 8, RS_SUDO_GROUP_GID },
+    { 0, RS_NSSD_GETPWUID, 0, 9, 59999 },
+  };
+  enum nss_status expected[3] = { NSS_STATUS_SUCCESS, NSS_STATUS_SUCCESS, NSS_STATUS_NOTFOUND };
+  struct rs_nssd_reply reply;
+  char data[4096];
+  int i;
+
+  if (write(fd, requests, sizeof(requests)) != sizeof(requests)) {
+    total_errors++;
+    printf("ERROR: cannot write requests to rightscale-nssd\n");
+    return;
+  }
+  for (i = 0; i < 3; i++) {
+    if (recv(fd, &reply, sizeof(reply), MSG_WAITALL) != sizeof(reply) ||
+        reply.len > sizeof(data) ||
+        (reply.len > 0 && recv(fd, data, reply.len, MSG_WAITALL) != reply.len) ||
+        reply.id != requests[i].id || reply.status != expected[i]) {
+      total_errors++;
+      printf("ERROR: unexpected reply %d to pipelined requests\n", i);
+      return;
+    }
+  }
+}
+
+// Lookups are answered by rightscale-nssd while it runs, and from the policy
+// file once it's gone
+// Look up a user only rightscale-nssd knows about
+static void *nssd_lookup_thread(void *arg) {
+  struct passwd pwd;
+  char buf[1000];
+  int err;
+  int i;
+
+  (void)arg;
+
+  for (i = 0; i < 500; i++) {
+    if (_nss_rightscale_getpwnam_r("nssd1", &pwd, buf, sizeof(buf), &err) != NSS_STATUS_SUCCESS ||
+        _nss_rightscale_getpwuid_r(54000, &pwd, buf, sizeof(buf), &err) != NSS_STATUS_SUCCESS) {
+      __atomic_add_fetch(&thread_failures, 1, __ATOMIC_RELAXED);
+    }
+  }
+  return NULL;
+}
+
+static void nss_test_nssd(void) {
+  char dir[] = "/tmp/rs_test_nssd.XXXXXX";
+  char policy_file[PATH_MAX], socket_path[PATH_MAX], command[PATH_MAX + 64];
+  pthread_t threads[4];
+  FILE *fp;
+  int fd, status, i;
+
+  printf("Testing rightscale-nssd\n");
+  mkdtemp(dir);
+  snprintf(policy_file, sizeof(policy_file), "%s/login_policy", dir);
+  snprintf(socket_path, sizeof(socket_path), "%s/socket", dir);
+  snprintf(command, sizeof(command), "cp ./scripts/sample_policy %s", policy_file);
+  if (system(command) != 0) {
+    total_errors++;
+    printf("ERROR: cannot copy the sample policy\n");
+    return;
+  }
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    execl("./rightscale-nssd", "rightscale-nssd", "-f", policy_file, "-s", socket_path, NULL);
+    _exit(127);
+  }
+  fd = nssd_test_connect(socket_path);
+  if (fd < 0) {
+    total_errors++;
+    printf("ERROR: rightscale-nssd didn't start\n");
+    kill(pid, SIGTERM);
+    waitpid(pid, &status, 0);
+    return;
+  }
+  nssd_test_pipelining(fd);
+  close(fd);
+
+  // The daemon serves a copy of the sample policy, so every answer must be
+  // the same as the module's own
+  set_nssd_socket(socket_path);
+  nss_test_users();
+  nss_test_groups();
+  nss_test_shadow();
+  nss_test_initgroups();
+  nss_test_rendered_entries();
+  nss_test_rendered_groups();
+
+  // Only the daemon sees this user
+  fp = fopen(policy_file, "a");
+  fprintf(fp, "nssd1:rightscale44000:44000:54000:Y:Daemon One:\n");
+  fclose(fp);
+  for (i = 0; i < 500 && !nss_getpwnam("nssd1"); i++) {
+    usleep(10000);
+  }
+  struct group *grp = nss_getgrgid(54000);
+  if (!nss_getpwnam("nssd1") || !nss_getpwuid(54000) || !grp || strcmp(grp->gr_name, "nssd1") != 0) {
+    total_errors++;
+    printf("ERROR: rightscale-nssd didn't pick up the policy change\n");
+  }
+
+  // Threads each get answers of their own
+  thread_failures = 0;
+  for (i = 0; i < 4; i++) {
+    pthread_create(&threads[i], NULL, nssd_lookup_thread, NULL);
+  }
+  for (i = 0; i < 4; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  if (thread_failures) {
+    total_errors++;
+    printf("ERROR: %d concurrent lookups through rightscale-nssd failed\n", thread_failures);
+  }
+
+  kill(pid, SIGTERM);
+  waitpid(pid, &status, 0);
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    total_errors++;
+    printf("ERROR: rightscale-nssd didn't exit cleanly\n");
+  }
+  if (nss_getpwnam("nssd1") || !nss_getpwnam("peter")) {
+    total_errors++;
+    printf("ERROR: lookups didn't fall back to the policy file\n");
+  }
+  set_nssd_socket(NULL);
+
+  unlink(policy_file);
+  rmdir(dir);
+  printf("\n");
+}
+
+// Make a Varlink call and read its replies, up to the one that doesn't
+// continue. Returns them all, or an empty string on failure.
+static const char *varlink_call(int fd, const char *call) {
+  static char replies[65536];
+  size_t len = 0;
+  char *reply = replies;
+
+  if (write(fd, call, strlen(call) + 1) != (ssize_t)strlen(call) + 1) {
+    return "";
+  }
+  while (len < sizeof(replies) - 1) {
+    ssize_t n = read(fd, replies + len, sizeof(replies) - 1 - len);
+    if (n <= 0) {
+      return "";
+    }
+    len += n;
+    /* Every reply ends with a NUL; the last doesn't continue */
+    char *end;
+    while ((end = memchr(reply, '\0', replies + len - reply)) != NULL) {
+      if (strstr(reply, "\"continues\":true") == NULL) {
+        /* Show the replies as one string */
+        for (reply = replies; reply < end; reply++) {
+          if (*reply == '\0') {
+            *reply = '\n';
+          }
+        }
+        return replies;
+      }
+      reply = end + 1;
+    }
+  }
+  return "";
+}
+
+// Make sure rightscale-userdb answers userdb calls like the module answers
+// NSS lookups
+static void nss_test_userdb(void) {
+  static const struct {
+    const char *call;
+    const char *expected[3];
+  } cases[] = {
+    { "{\"method\":\"io.systemd.UserDatabase.GetUserRecord\",\"parameters\":"
+      "{\"userName\":\"rightscale41000\",\"service\":\"io.rightscale.Test\"}}",
+      { "\"userName\":\"rightscale41000\",\"uid\":51000,\"gid\":51000,\"realName\":\"Peter Schroeter\"",
+        "\"homeDirectory\":\"/home/rightscale41000\",\"shell\":\"/bin/bash\"" } },
+    { "{\"method\":\"io.systemd.UserDatabase.GetUserRecord\",\"parameters\":"
+      "{\"uid\":51000,\"service\":\"io.rightscale.Test\"}}",
+      { "\"userName\":\"peter\"" } },
+    { "{\"method\":\"io.systemd.UserDatabase.GetUserRecord\",\"parameters\":"
+      "{\"userName\":\"peter\",\"uid\":50001,\"service\":\"io.rightscale.Test\"}}",
+      { "\"error\":\"io.systemd.UserDatabase.ConflictingRecordFound\"" } },
+    { "{\"method\":\"io.systemd.UserDatabase.GetUserRecord\",\"parameters\":"
+      "{\"userName\":\"nobody\",\"service\":\"io.rightscale.Test\"}}",
+      { "\"error\":\"io.systemd.UserDatabase.NoRecordFound\"" } },
+    { "{\"method\":\"io.systemd.UserDatabase.GetUserRecord\",\"parameters\":"
+      "{\"userName\":\"peter\",\"service\":\"io.systemd.Other\"}}",
+      { "\"error\":\"io.systemd.UserDatabase.BadService\"" } },
+    { "{\"method\":\"io.systemd.UserDatabase.GetUserRecord\",\"parameters\":"
+      "{\"uid\":\"peter\",\"service\":\"io.rightscale.Test\"}}",
+      { "\"error\":\"org.varlink.service.InvalidParameter\",\"parameters\":{\"parameter\":\"uid\"}" } },
+    { "{\"method\":\"io.systemd.UserDatabase.GetUserRecord\",\"parameters\":"
+      "{\"service\":\"io.rightscale.Test\"}}",
+      { "\"error\":\"org.varlink.service.ExpectedMore\"" } },
+    { "{\"method\":\"io.systemd.UserDatabase.GetUserRecord\",\"parameters\":"
+      "{\"service\":\"io.rightscale.Test\"},\"more\":true}",
+      { "\"userName\":\"peter\"", "\"userName\":\"rightscale41000\"",
+        "\"userName\":\"rightscale41004\",\"uid\":50004,\"gid\":50004,\"realName\":\"Noname User\"" } },
+    { "{\"method\":\"io.systemd.UserDatabase.GetGroupRecord\",\"parameters\":"
+      "{\"groupName\":\"rightscale_sudo\",\"service\":\"io.rightscale.Test\"}}",
+      { "\"groupName\":\"rightscale_sudo\",\"gid\":10001,"
+        "\"members\":[\"peter\",\"rightscale41000\",\"rightscale41003\"]" } },
+    { "{\"method\":\"io.systemd.UserDatabase.GetGroupRecord\",\"parameters\":"
+      "{\"gid\":50001,\"service\":\"io.rightscale.Test\"}}",
+      { "\"groupName\":\"lopaka\",\"gid\":50001" } },
+    { "{\"method\":\"io.systemd.UserDatabase.GetMemberships\",\"parameters\":"
+      "{\"userName\":\"peter\",\"service\":\"io.rightscale.Test\"},\"more\":true}",
+      { "{\"parameters\":{\"userName\":\"peter\",\"groupName\":\"rightscale\"},\"continues\":true}\n",
+        "{\"parameters\":{\"userName\":\"peter\",\"groupName\":\"rightscale_sudo\"}}" } },
+    { "{\"method\":\"io.systemd.UserDatabase.GetMemberships\",\"parameters\":"
+      "{\"groupName\":\"rightscale_sudo\",\"service\":\"io.rightscale.Test\"},\"more\":true}",
+      { "\"userName\":\"rightscale41003\",\"groupName\":\"rightscale_sudo\"}}" } },
+    { "{\"method\":\"io.systemd.UserDatabase.Frobnicate\",\"parameters\":{}}",
+      { "\"error\":\"org.varlink.service.MethodNotFound\"" } },
+  };
+  char dir[] = "/tmp/rs_test_userdb.XXXXXX";
+  char socket_path[PATH_MAX];
+  int fd, status, i, j;
+
+  printf("Testing rightscale-userdb\n");
+  mkdtemp(dir);
+  snprintf(socket_path, sizeof(socket_path), "%s/io.rightscale.Test", dir);
+  pid_t pid = fork();
+  if (pid == 0) {
+    execl("./rightscale-userdb", "rightscale-userdb", "-f", "./scripts/sample_policy",
+      "-s", socket_path, NULL);
+    _exit(127);
+  }
+  fd = nssd_test_connect(socket_path);
+  if (fd < 0) {
+    total_errors++;
+    printf("ERROR: rightscale-userdb didn't start\n");
+  }
+  for (i = 0; fd >= 0 && i < (int)(sizeof(cases) / sizeof(cases[0])); i++) {
+    const char *replies = varlink_call(fd, cases[i].call);
+    for (j = 0; j < 3 && cases[i].expected[j] != NULL; j++) {
+      if (strstr(replies, cases[i].expected[j]) == NULL) {
+        total_errors++;
+        printf("ERROR: %s\n  returned %s\n  expected %s\n", cases[i].call, replies,
+          cases[i].expected[j]);
+      }
+    }
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+
+  kill(pid, SIGTERM);
+  waitpid(pid, &status, 0);
+  rmdir(dir);
+  printf("\n");
+}
+
+// Make sure rs-ssh-keys prints exactly the keys of the requested user, with
+// and without a compiled policy
+static void nss_test_ssh_keys(void) {
+  char policy_file[] = "/tmp/rs_test_policy.XXXXXX";
+  char command[1024];
+  char output[1024];
+  int fd = mkstemp(policy_file);
+  FILE *fp = fdopen(fd, "w");
+  int compiled;
+
+  printf("Testing rs-ssh-keys\n");
+  fprintf(fp, "# comment\n");
+  fprintf(fp, "keys1:rightscale46000:46000:56000:N:Keys One:ssh-rsa AAAA1 one:ssh-ed25519 AAAA2 two\n");
+  fprintf(fp, "keys2:rightscale46001:46001:56001:N:Keys Two:ssh-rsa AAAA3 three\n");
+  fclose(fp);
+  set_policy_file(policy_file);
+
+  for (compiled = 0; compiled < 2; compiled++) {
+    if (compiled) {
+      snprintf(command, sizeof(command), "./rs-policy-compile %s", policy_file);
+      if (system(command) != 0) {
+        total_errors++;
+        printf("ERROR: rs-policy-compile failed\n");
+      }
+    }
+    snprintf(command, sizeof(command), "./rs-ssh-keys -f %s keys1", policy_file);
+    fp = popen(command, "r");
+    size_t len = fread(output, 1, sizeof(output) - 1, fp);
+    output[len] = '\0';
+    if (pclose(fp) != 0 || strcmp(output, "ssh-rsa AAAA1 one\nssh-ed25519 AAAA2 two\n") != 0) {
+      total_errors++;
+      printf("ERROR: wrong keys for keys1: %s\n", output);
+    }
+    snprintf(command, sizeof(command), "./rs-ssh-keys -f %s rightscale46001", policy_file);
+    fp = popen(command, "r");
+    len = fread(output, 1, sizeof(output) - 1, fp);
+    output[len] = '\0';
+    if (pclose(fp) != 0 || strcmp(output, "ssh-rsa AAAA3 three\n") != 0) {
+      total_errors++;
+      printf("ERROR: wrong keys for rightscale46001: %s\n", output);
+    }
+    snprintf(command, sizeof(command), "./rs-ssh-keys -f %s nosuchuser >/dev/null", policy_file);
+    if (system(command) == 0) {
+      total_errors++;
+      printf("ERROR: rs-ssh-keys succeeded for an unknown user\n");
+    }
+  }
+
+  unlink(get_policy_db_file());
+  unlink(policy_file);
+  set_policy_file("./scripts/sample_policy");
+  printf("\n");
+}
+
+#define TEST_KEY_ONE "ssh-ed25519 AAAAC3NzaC1lZDI1NTE5AAAAIBFhUzn1384FvWxmj2KPbXxzOU5Qpzwv2lvVrgGhVCdh one"
+#define TEST_KEY_ONE_FP "SHA256:aQXJTscGv2KHn8Q+f8jbKot7EieI8NdB9o+PYEysnUI"
+#define TEST_KEY_TWO "ssh-ed25519 AAAAC3NzaC1lZDI1NTE5AAAAIA/rgz67vTQbjfxNarJJPUjFzo1TLjrRZqm5nM3xwGEu two"
+#define TEST_KEY_TWO_FP "SHA256:vyWA5GehVF/gqWwEUGDbKc3/5DsGF2WPlod4SKuQr2s"
+
+/* Run rs-ssh-keys with the given arguments and capture its output.
+ * Returns its exit status. */
+static int run_ssh_keys(const char *policy_file, const char *args, char *output, size_t size) {
+  char command[1024];
+  snprintf(command, sizeof(command), "./rs-ssh-keys -f %s %s 2>/dev/null", policy_file, args);
+  FILE *fp = popen(command, "r");
+  size_t len = fread(output, 1, size - 1, fp);
+  output[len] = '\0';
+  int status = pclose(fp);
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static void nss_test_ssh_key_fingerprints(void) {
+  char policy_file[] = "/tmp/rs_test_policy.XXXXXX";
+  char command[1024];
+  char output[1024];
+  int fd = mkstemp(policy_file);
+  FILE *fp = fdopen(fd, "w");
+  int compiled;
+
+  printf("Testing rs-ssh-keys with fingerprints\n");
+  fprintf(fp, "keys1:rightscale46000:46000:56000:N:Keys One:" TEST_KEY_ONE ":" TEST_KEY_TWO "\n");
+  fprintf(fp, "keys2:rightscale46001:46001:56001:N:Keys Two:ssh-rsa AAAA3 three:" TEST_KEY_TWO "\n");
+  fclose(fp);
+  set_policy_file(policy_file);
+
+  for (compiled = 0; compiled < 2; compiled++) {
+    if (compiled) {
+      snprintf(command, sizeof(command), "./rs-policy-compile %s", policy_file);
+      if (system(command) != 0) {
+        total_errors++;
+        printf("ERROR: rs-policy-compile failed\n");
+      }
+    }
+    if (run_ssh_keys(policy_file, "-F " TEST_KEY_ONE_FP " keys1", output, sizeof(output)) != 0 ||
+        strcmp(output, TEST_KEY_ONE "\n") != 0) {
+      total_errors++;
+      printf("ERROR: wrong key one for keys1: %s\n", output);
+    }
+    if (run_ssh_keys(policy_file, "-F " TEST_KEY_TWO_FP " rightscale46001", output, sizeof(output)) != 0 ||
+        strcmp(output, TEST_KEY_TWO "\n") != 0) {
+      total_errors++;
+      printf("ERROR: wrong key two for rightscale46001: %s\n", output);
+    }
+    if (run_ssh_keys(policy_file, "-F " TEST_KEY_ONE_FP " keys2", output, sizeof(output)) != 1 ||
+        strlen(output) != 0) {
+      total_errors++;
+      printf("ERROR: key one found for keys2: %s\n", output);
+    }
+    // Keys of a policy that isn't compiled or shared aren't indexed, and
+    // indexing them on every call would be too slow
+    if (!compiled &&
+        (run_ssh_keys(policy_file, "-F " TEST_KEY_TWO_FP, output, sizeof(output)) != 1 ||
+         strlen(output) != 0)) {
+      total_errors++;
+      printf("ERROR: owners of key two listed without an index: %s\n", output);
+    }
+    if (compiled && (run_ssh_keys(policy_file, "-F " TEST_KEY_TWO_FP, output, sizeof(output)) != 0 ||
+        strstr(output, "rightscale46000\tkeys1\t" TEST_KEY_TWO "\n") == NULL ||
+        strstr(output, "rightscale46001\tkeys2\t" TEST_KEY_TWO "\n") == NULL ||
+        strlen(output) != 2 * strlen("rightscale4600x\tkeysx\t" TEST_KEY_TWO "\n"))) {
+      total_errors++;
+      printf("ERROR: wrong owners of key two: %s\n", output);
+    }
+    if (run_ssh_keys(policy_file, "-F SHA256:notafingerprint keys1", output, sizeof(output)) != 2) {
+      total_errors++;
+      printf("ERROR: rs-ssh-keys accepted an invalid fingerprint\n");
+    }
+  }
+
+  unlink(get_policy_db_file());
+  unlink(policy_file);
+  set_policy_file("./scripts/sample_policy");
+  printf("\n");
+}
+
+// Make sure lookups are counted in the stats segment and rs-nss-stat shows them
+static void nss_test_stats(void) {
+  char policy_file[] = "/tmp/rs_test_policy.XXXXXX";
+  char command[1024];
+  char output[4096];
+  struct passwd pwd;
+  struct group grp;
+  char buf[1024];
+  int err;
+  long key = 0x52530000 | (getpid() & 0xffff);
+  int fd = mkstemp(policy_file);
+  FILE *fp = fdopen(fd, "w");
+  int i, j;
+
+  printf("Testing lookup statistics\n");
+  fprintf(fp, "stats1:rightscale47000:47000:57000:N:Stats One:ssh-rsa AAAA1 one\n");
+  fclose(fp);
+  set_policy_file(policy_file);
+
+  snprintf(command, sizeof(command), "./rs-nss-stat -k %ld -c -m 600", key);
+  if (system(command) != 0) {
+    total_errors++;
+    printf("ERROR: rs-nss-stat didn't create the segment\n");
+  }
+  set_stats_key(key);
+
+  _nss_rightscale_getpwnam_r("stats1", &pwd, buf, sizeof(buf), &err);
+  _nss_rightscale_getpwnam_r("nosuchname", &pwd, buf, sizeof(buf), &err);
+  _nss_rightscale_getpwnam_r("stats1", &pwd, buf, 4, &err);
+  _nss_rightscale_getgrgid_r(57000, &grp, buf, sizeof(buf), &err);
+
+  int id = shmget(key, 0, 0);
+  struct rs_stats *stats = id >= 0 ? shmat(id, NULL, SHM_RDONLY) : (void *)-1;
+  if (stats == (void *)-1) {
+    total_errors++;
+    printf("ERROR: no stats segment\n");
+  } else {
+    struct rs_stats_entry pwnam, grgid;
+    uint64_t latencies = 0, opens = 0, bytes = 0, loads = 0;
+    memset(&pwnam, 0, sizeof(pwnam));
+    memset(&grgid, 0, sizeof(grgid));
+    for (i = 0; i < RS_STATS_SHARDS; i++) {
+      struct rs_stats_entry *entry = &stats->shard[i].entry[RS_STAT_GETPWNAM];
+      pwnam.calls += entry->calls;
+      pwnam.hits += entry->hits;
+      pwnam.misses += entry->misses;
+      pwnam.erange += entry->erange;
+      pwnam.errors += entry->errors;
+      for (j = 0; j < RS_STATS_BUCKETS; j++) {
+        latencies += entry->latency[j];
+      }
+      grgid.calls += stats->shard[i].entry[RS_STAT_GETGRGID].calls;
+      grgid.hits += stats->shard[i].entry[RS_STAT_GETGRGID].hits;
+      opens += stats->shard[i].file_opens;
+      bytes += stats->shard[i].bytes_parsed;
+      loads += stats->shard[i].loads;
+    }
+    if (pwnam.calls != 3 || pwnam.hits != 1 || pwnam.misses != 1 || pwnam.erange != 1 ||
+        pwnam.errors != 0 || latencies != 3) {
+      total_errors++;
+      printf("ERROR: getpwnam_r counted %llu calls, %llu hits, %llu misses, %llu erange, "
+        "%llu errors, %llu latencies\n", (unsigned long long)pwnam.calls,
+        (unsigned long long)pwnam.hits, (unsigned long long)pwnam.misses,
+        (unsigned long long)pwnam.erange, (unsigned long long)pwnam.errors,
+        (unsigned long long)latencies);
+    }
+    if (grgid.calls != 1 || grgid.hits != 1) {
+      total_errors++;
+      printf("ERROR: getgrgid_r counted %llu calls, %llu hits\n",
+        (unsigned long long)grgid.calls, (unsigned long long)grgid.hits);
+    }
+    if (opens < 1 || loads != 1 || bytes != strlen(
+        "stats1:rightscale47000:47000:57000:N:Stats One:ssh-rsa AAAA1 one\n")) {
+      total_errors++;
+      printf("ERROR: counted %llu opens, %llu loads, %llu bytes parsed\n",
+        (unsigned long long)opens, (unsigned long long)loads, (unsigned long long)bytes);
+    }
+    for (i = 0; i < RS_STATS_CALLERS; i++) {
+      if (strncmp(stats->caller[i].name, "run_tests", sizeof(stats->caller[i].name)) == 0) {
+        break;
+      }
+    }
+    if (i == RS_STATS_CALLERS || stats->caller[i].calls != 4) {
+      total_errors++;
+      printf("ERROR: calls of run_tests not counted\n");
+    }
+    shmdt(stats);
+  }
+
+  snprintf(command, sizeof(command), "./rs-nss-stat -k %ld", key);
+  fp = popen(command, "r");
+  size_t len = fread(output, 1, sizeof(output) - 1, fp);
+  output[len] = '\0';
+  pclose(fp);
+  if (strstr(output, "\ngetpwnam_r                3          1          1        1        0 ") == NULL ||
+      strstr(output, "\nrun_tests                 4\n") == NULL) {
+    total_errors++;
+    printf("ERROR: rs-nss-stat printed\n%s\n", output);
+  }
+
+  snprintf(command, sizeof(command), "./rs-nss-stat -k %ld -r && ./rs-nss-stat -k %ld", key, key);
+  fp = popen(command, "r");
+  len = fread(output, 1, sizeof(output) - 1, fp);
+  output[len] = '\0';
+  pclose(fp);
+  if (strstr(output, "\ngetpwnam_r                0\n") == NULL) {
+    total_errors++;
+    printf("ERROR: rs-nss-stat -r didn't reset the counters\n%s\n", output);
+  }
+
+  snprintf(command, sizeof(command), "./rs-nss-stat -k %ld -d", key);
+  if (system(command) != 0 || shmget(key, 0, 0) >= 0) {
+    total_errors++;
+    printf("ERROR: rs-nss-stat didn't remove the segment\n");
+  }
+
+  set_stats_key(-1);
+  unlink(policy_file);
+  set_policy_file("./scripts/sample_policy");
+  printf("\n");
+}
+
+/* Run a command and capture its output */
+static void run_command(const char *command, char *output, size_t size) {
+  FILE *fp = popen(command, "r");
+  size_t len = fread(output, 1, size - 1, fp);
+  output[len] = '\0';
+  pclose(fp);
+}
+
+// Make sure lookups are traced only while tracing is on, and rs-nss-trace
+// prints them
+static void nss_test_trace(void) {
+  char policy_file[] = "/tmp/rs_test_policy.XXXXXX";
+  char command[1024];
+  char expected[256];
+  char output[8192];
+  struct passwd pwd;
+  char buf[1024];
+  int err, i;
+  long key = 0x52540000 | (getpid() & 0xffff);
+  int fd = mkstemp(policy_file);
+  FILE *fp = fdopen(fd, "w");
+
+  printf("Testing lookup traces\n");
+  fprintf(fp, "trace1:rightscale48000:48000:58000:N:Trace One:ssh-rsa AAAA1 one\n");
+  fprintf(fp, "\n");
+  fprintf(fp, "trace2:rightscale48001:48001:58001:N:Trace Two:ssh-rsa AAAA2 two\n");
+  fclose(fp);
+  set_policy_file(policy_file);
+
+  snprintf(command, sizeof(command), "./rs-nss-trace -k %ld -c -n 8 -m 600", key);
+  if (system(command) != 0) {
+    total_errors++;
+    printf("ERROR: rs-nss-trace didn't create the ring\n");
+  }
+  set_trace_key(key);
+  int id = shmget(key, 0, 0);
+  struct rs_trace *ring = id >= 0 ? shmat(id, NULL, SHM_RDONLY) : (void *)-1;
+  if (ring == (void *)-1) {
+    total_errors++;
+    printf("ERROR: no trace ring\n");
+    set_trace_key(-1);
+    set_policy_file("./scripts/sample_policy");
+    unlink(policy_file);
+    return;
+  }
+
+  // Off until turned on
+  _nss_rightscale_getpwnam_r("trace1", &pwd, buf, sizeof(buf), &err);
+  if (ring->next != 0) {
+    total_errors++;
+    printf("ERROR: %llu records written while tracing was off\n", (unsigned long long)ring->next);
+  }
+
+  snprintf(command, sizeof(command), "./rs-nss-trace -k %ld -e", key);
+  system(command);
+  // Change the policy so the lookup reloads it
+  fp = fopen(policy_file, "a");
+  fprintf(fp, "trace3:rightscale48002:48002:58002:N:Trace Three:ssh-rsa AAAA3 three\n");
+  fclose(fp);
+  _nss_rightscale_getpwnam_r("trace3", &pwd, buf, sizeof(buf), &err);
+  _nss_rightscale_getpwuid_r(909090, &pwd, buf, sizeof(buf), &err);
+  _nss_rightscale_setpwent();
+  _nss_rightscale_endpwent();
+
+  // The policy was parsed during the first call, so its event comes first
+  struct rs_trace_record *record = ring->record;
+  if (ring->next != 5 ||
+      record[0].type != RS_TRACE_EVENT || record[0].what != RS_EVENT_POLICY_PARSED ||
+      record[0].key != 3 ||
+      record[1].type != RS_TRACE_CALL || record[1].what != RS_STAT_GETPWNAM ||
+      record[1].key != trace_name_hash("trace3") || record[1].status != NSS_STATUS_SUCCESS ||
+      record[1].lines != 4 || record[1].flags != RS_TRACE_LOADED ||
+      record[1].pid != (uint32_t)getpid() || record[1].seq != 2 ||
+      record[2].what != RS_STAT_GETPWUID || record[2].key != 909090 ||
+      record[2].status != NSS_STATUS_NOTFOUND || record[2].flags != RS_TRACE_BY_ID ||
+      record[2].lines != 0 ||
+      record[3].type != RS_TRACE_EVENT || record[3].what != RS_EVENT_SETPWENT ||
+      record[4].type != RS_TRACE_EVENT || record[4].what != RS_EVENT_ENDPWENT) {
+    total_errors++;
+    printf("ERROR: wrong trace records, %llu written\n", (unsigned long long)ring->next);
+  }
+
+  snprintf(command, sizeof(command), "./rs-nss-trace -k %ld", key);
+  run_command(command, output, sizeof(output));
+  snprintf(expected, sizeof(expected), "getpwnam_r name %016llx SUCCESS ",
+    (unsigned long long)trace_name_hash("trace3"));
+  if (strstr(output, "event parsed policy file with 3 users\n") == NULL ||
+      strstr(output, expected) == NULL || strstr(output, " lines 4 loaded\n") == NULL ||
+      strstr(output, "getpwuid_r id 909090 NOTFOUND (No such file or directory) ") == NULL ||
+      strstr(output, "event setpwent\n") == NULL || strstr(output, "event endpwent\n") == NULL) {
+    total_errors++;
+    printf("ERROR: rs-nss-trace printed\n%s\n", output);
+  }
+  snprintf(command, sizeof(command), "./rs-nss-trace -k %ld -i 909090", key);
+  run_command(command, output, sizeof(output));
+  if (strstr(output, "getpwuid_r id 909090") == NULL || strstr(output, "getpwnam_r") != NULL ||
+      strstr(output, "event") != NULL) {
+    total_errors++;
+    printf("ERROR: rs-nss-trace -i printed\n%s\n", output);
+  }
+
+  // Only the last 8 records are kept
+  for (i = 0; i < 20; i++) {
+    _nss_rightscale_getpwnam_r("trace1", &pwd, buf, sizeof(buf), &err);
+  }
+  snprintf(command, sizeof(command), "./rs-nss-trace -k %ld | grep -c getpwnam_r", key);
+  run_command(command, output, sizeof(output));
+  if (ring->next != 25 || strcmp(output, "8\n") != 0) {
+    total_errors++;
+    printf("ERROR: %llu records written, %s printed\n", (unsigned long long)ring->next, output);
+  }
+
+  // Turned off for everyone, but on for processes that ask for it
+  snprintf(command, sizeof(command), "./rs-nss-trace -k %ld -o", key);
+  system(command);
+  _nss_rightscale_getpwnam_r("trace1", &pwd, buf, sizeof(buf), &err);
+  setenv(RS_TRACE_ENV, "1", 1);
+  set_trace_key(key);
+  _nss_rightscale_getpwnam_r("trace1", &pwd, buf, sizeof(buf), &err);
+  unsetenv(RS_TRACE_ENV);
+  if (ring->next != 26) {
+    total_errors++;
+    printf("ERROR: %llu records written after tracing was turned off\n",
+      (unsigned long long)ring->next);
+  }
+
+  shmdt(ring);
+  snprintf(command, sizeof(command), "./rs-nss-trace -k %ld -d", key);
+  if (system(command) != 0 || shmget(key, 0, 0) >= 0) {
+    total_errors++;
+    printf("ERROR: rs-nss-trace didn't remove the ring\n");
+  }
+
+  set_trace_key(-1);
+  unlink(policy_file);
+  set_policy_file("./scripts/sample_policy");
+  printf("\n");
+}
+
+// A bad setting is traced on the first lookup after the settings are read,
+// which must not hang on it
+static void nss_test_bad_settings(void) {
+  char settings_file[] = "/tmp/rs_test_settings.XXXXXX";
+  char command[1024];
+  long key = 0x52550000 | (getpid() & 0xffff);
+  int fd = mkstemp(settings_file);
+  FILE *fp = fdopen(fd, "w");
+  int status, found = FALSE;
+  uint64_t i;
+
+  printf("Testing bad settings\n");
+  fprintf(fp, "trace_key = %ld\n", key);
+  fprintf(fp, "bogus_key = 1\n");
+  fclose(fp);
+  snprintf(command, sizeof(command), "./rs-nss-trace -k %ld -c -m 600 && ./rs-nss-trace -k %ld -e",
+    key, key);
+  if (system(command) != 0) {
+    total_errors++;
+    printf("ERROR: rs-nss-trace didn't create the ring\n");
+  }
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    alarm(10);
+    set_settings_file(settings_file);
+    set_trace_key(-1);
+    _exit(nss_getpwnam("peter") ? 0 : 1);
+  }
+  waitpid(pid, &status, 0);
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    total_errors++;
+    printf("ERROR: lookup hung or failed with a bad setting\n");
+  }
+
+  int id = shmget(key, 0, 0);
+  struct rs_trace *ring = id >= 0 ? shmat(id, NULL, SHM_RDONLY) : (void *)-1;
+  if (ring != (void *)-1) {
+    for (i = 0; i < ring->next && i < ring->num_records; i++) {
+      struct rs_trace_record *record = &ring->record[i];
+      if (record->type == RS_TRACE_EVENT && record->what == RS_EVENT_BAD_SETTING &&
+          record->key == 2) {
+        found = TRUE;
+      }
+    }
+    shmdt(ring);
+  }
+  if (!found) {
+    total_errors++;
+    printf("ERROR: bad setting was not traced\n");
+  }
+
+  snprintf(command, sizeof(command), "./rs-nss-trace -k %ld -d", key);
+  system(command);
+  unlink(settings_file);
+  printf("\n");
+}
+
 static void nss_test_errors(void) {
   struct passwd *pwd;
   struct group *grp;
@@ -524,6 +2095,26 @@ static void nss_test_errors(void) {
   nss_test_users();
   nss_test_groups();
   nss_test_shadow();
+  nss_test_initgroups();
+  nss_test_policy_scan();
+  nss_test_scanners();
+  nss_test_rendered_entries();
+  nss_test_rendered_groups();
+  nss_test_enumeration();
+  nss_test_reload();
+  nss_test_large_policy();
+  nss_test_long_lines();
+  nss_test_revalidate();
+  nss_test_threads();
+  nss_test_compiled_policy();
+  nss_test_shared_policy();
+  nss_test_nssd();
+  nss_test_userdb();
+  nss_test_ssh_keys();
+  nss_test_ssh_key_fingerprints();
+  nss_test_stats();
+  nss_test_trace();
+  nss_test_bad_settings();
   nss_test_errors();
   nss_test_idempotency();
 
@@ -0,0 +1,206 @@
+/*
+ * trace.c : Binary trace of lookups and of what happened during them,
+ * written into a ring in shared memory for rs-nss-trace to print. Like the
+ * counters in stats.c, tracing never makes a lookup fail.
+ */
+
+#include "nss-rightscale.h"
+#include "settings.h"
+#include "stats.h"
+#include "trace.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/shm.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/* How long to wait before looking for the ring again once it wasn't there */
+#define TRACE_RETRY_MS 5000
+
+/* Key to use instead of the configured one, or -1 */
+static long trace_key = -1;
+
+/* The attached ring, or NULL while there is none to write to. It stays
+ * attached for the life of the process. Its size is kept here, as anyone
+ * allowed to write to the ring can change its header. */
+static struct rs_trace *ring = NULL;
+static uint64_t ring_mask;
+static int trace_env = FALSE;    /* RS_NSS_TRACE is set */
+static uint64_t trace_retry_ms = 0;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Policy lines the thread has read, and what happened during its current call */
+static __thread struct {
+    uint32_t lines;
+    uint32_t flags;
+} trace_thread;
+
+static uint64_t trace_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t trace_realtime_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Whether a segment of the given size is a ring set up by rs-nss-trace for
+ * this version */
+int trace_valid(const struct rs_trace *segment, size_t size) {
+    uint32_t n = segment->num_records;
+    return size >= sizeof(struct rs_trace) &&
+        memcmp(segment->magic, RS_TRACE_MAGIC, sizeof(segment->magic)) == 0 &&
+        segment->version == RS_TRACE_VERSION &&
+        n > 0 && n <= RS_TRACE_MAX_RECORDS && (n & (n - 1)) == 0 &&
+        size == sizeof(struct rs_trace) + n * sizeof(struct rs_trace_record);
+}
+
+/* Hash names are recorded under; rs-nss-trace finds a user's calls by it */
+uint64_t trace_name_hash(const char *name) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (; *name != '\0'; name++) {
+        hash = (hash ^ (unsigned char)*name) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+/* Write to another ring than the configured one. -1 goes back to the
+ * configured one, 0 traces nothing. Not to be called while other threads
+ * make lookups. */
+void set_trace_key(long key) {
+    pthread_mutex_lock(&trace_lock);
+    trace_key = key;
+    if (ring != NULL) {
+        shmdt(ring);
+        ring = NULL;
+    }
+    trace_retry_ms = 0;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+/* The ring to write to, or NULL */
+static struct rs_trace * get_ring(void) {
+    struct rs_trace *segment = __atomic_load_n(&ring, __ATOMIC_ACQUIRE);
+    if (segment != NULL) {
+        return segment;
+    }
+    uint64_t now = trace_now_ms();
+    if (now < __atomic_load_n(&trace_retry_ms, __ATOMIC_RELAXED)) {
+        return NULL;
+    }
+
+    /* Loading the settings can trace a bad one, which comes back here, so
+     * not while holding trace_lock */
+    long key = get_settings()->trace_key;
+    pthread_mutex_lock(&trace_lock);
+    if (ring == NULL && now >= trace_retry_ms) {
+        if (trace_key >= 0) {
+            key = trace_key;
+        }
+        size_t size;
+        segment = key != 0 ? attach_trusted_segment(key, &size) : NULL;
+        if (segment != NULL && !trace_valid(segment, size)) {
+            shmdt(segment);
+            segment = NULL;
+        }
+        if (segment != NULL) {
+            /* Like any environment variable, ignored by setuid programs */
+            const char *env = secure_getenv(RS_TRACE_ENV);
+            trace_env = env != NULL && strcmp(env, "1") == 0;
+            ring_mask = segment->num_records - 1;
+            __atomic_store_n(&ring, segment, __ATOMIC_RELEASE);
+        } else {
+            __atomic_store_n(&trace_retry_ms, now + TRACE_RETRY_MS, __ATOMIC_RELAXED);
+        }
+    }
+    segment = ring;
+    pthread_mutex_unlock(&trace_lock);
+    return segment;
+}
+
+/* Whether to trace what we do now */
+int tracing(void) {
+    struct rs_trace *segment = get_ring();
+    return segment != NULL && (trace_env || __atomic_load_n(&segment->enabled, __ATOMIC_RELAXED));
+}
+
+/* Claim the next record and fill in what every record has. Publish it with
+ * publish_record once the rest is filled in. */
+static struct rs_trace_record * claim_record(struct rs_trace *segment, uint64_t *seq,
+    int type, int what) {
+    *seq = __atomic_fetch_add(&segment->next, 1, __ATOMIC_RELAXED);
+    struct rs_trace_record *record = &segment->record[*seq & ring_mask];
+    __atomic_store_n(&record->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    record->pid = getpid();
+    record->tid = syscall(SYS_gettid);
+    record->type = type;
+    record->what = what;
+    return record;
+}
+
+static void publish_record(struct rs_trace_record *record, uint64_t seq) {
+    __atomic_store_n(&record->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Trace a lookup of the given entry point, for the given name or, if it is
+ * NULL, id. lines is what trace_begin returned before the call. */
+void trace_call(int entry_point, const char *name, uint32_t id, uint32_t lines,
+    uint64_t duration_ns, enum nss_status res, int err) {
+    struct rs_trace *segment = __atomic_load_n(&ring, __ATOMIC_ACQUIRE);
+    uint64_t seq;
+    if (segment == NULL) {
+        return;
+    }
+    struct rs_trace_record *record = claim_record(segment, &seq, RS_TRACE_CALL, entry_point);
+    record->time_ns = trace_realtime_ns() - duration_ns;
+    record->flags = trace_thread.flags | (name == NULL ? RS_TRACE_BY_ID : 0);
+    record->key = name != NULL ? trace_name_hash(name) : id;
+    record->status = res;
+    record->err = res == NSS_STATUS_SUCCESS ? 0 : err;
+    record->duration_ns = duration_ns;
+    record->lines = trace_thread.lines - lines;
+    record->reserved = 0;
+    publish_record(record, seq);
+}
+
+/* Trace an event, if tracing is on */
+void trace_event(int event, int64_t arg) {
+    uint64_t seq;
+    if (!tracing()) {
+        return;
+    }
+    struct rs_trace_record *record = claim_record(ring, &seq, RS_TRACE_EVENT, event);
+    record->time_ns = trace_realtime_ns();
+    record->flags = 0;
+    record->key = arg;
+    record->status = 0;
+    record->err = 0;
+    record->duration_ns = 0;
+    record->lines = 0;
+    record->reserved = 0;
+    publish_record(record, seq);
+}
+
+/* Call for every policy line read */
+void trace_line(void) {
+    trace_thread.lines++;
+}
+
+/* Note something that happened during the current call */
+void trace_flag(uint32_t flag) {
+    trace_thread.flags |= flag;
+}
+
+/* Start tracing a call: returns the lines read so far through lines and
+ * forgets what happened during the previous call */
+void trace_begin(uint32_t *lines) {
+    *lines = trace_thread.lines;
+    trace_thread.flags = 0;
+}
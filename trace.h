@@ -0,0 +1,94 @@
+#ifndef NSS_RIGHTSCALE_TRACE_H
+#define NSS_RIGHTSCALE_TRACE_H
+
+#include <stdint.h>
+
+/*
+ * Binary trace of lookups, to find out why a login is slow without
+ * rebuilding the module. Fixed size records go into a ring in a System V
+ * shared memory segment, created by rs-nss-trace and trusted like the stats
+ * segment (see stats.h). Nothing is written unless tracing is on: for every
+ * process while the segment's enabled flag is set (rs-nss-trace -e), or for
+ * processes started with RS_NSS_TRACE=1 in their environment. When it is
+ * off a lookup only checks the flag.
+ *
+ * Writers claim a record by bumping next, and mark it as being written by
+ * zeroing its seq until it is complete, so readers can skip records that are
+ * being overwritten. Names are not recorded, only their hash.
+ */
+#define RS_TRACE_KEY 0x52534e54 /* "RSNT" */
+#define RS_TRACE_MAGIC "RSTRACE"
+#define RS_TRACE_VERSION 1
+#define RS_TRACE_ENV "RS_NSS_TRACE"
+
+/* Default and largest number of records in the ring */
+#define RS_TRACE_RECORDS 4096
+#define RS_TRACE_MAX_RECORDS (1 << 20)
+
+/* Record types */
+enum {
+    RS_TRACE_CALL = 1,  /* A lookup through an entry point */
+    RS_TRACE_EVENT      /* Something worth knowing happened */
+};
+
+/* Events, with what their argument is */
+enum {
+    RS_EVENT_SETPWENT = 1,
+    RS_EVENT_ENDPWENT,
+    RS_EVENT_SETSPENT,
+    RS_EVENT_ENDSPENT,
+    RS_EVENT_SETGRENT,
+    RS_EVENT_ENDGRENT,
+    RS_EVENT_POLICY_OPEN_FAILED,       /* errno */
+    RS_EVENT_POLICY_PARSED,            /* Users in it */
+    RS_EVENT_COMPILED_POLICY_IGNORED,
+    RS_EVENT_BAD_POLICY_LINE,          /* Line number */
+    RS_EVENT_LONG_POLICY_LINE,         /* Line number */
+    RS_EVENT_BAD_SETTING,              /* Line number in the settings file */
+    RS_EVENT_NSSD_UNANSWERED,
+    RS_EVENT_POLICY_PUBLISHED,         /* Users in it */
+    RS_TRACE_EVENTS
+};
+
+/* Call flags */
+#define RS_TRACE_BY_ID 1     /* key is a uid or gid rather than a name hash */
+#define RS_TRACE_NSSD 2      /* Answered by rightscale-nssd */
+#define RS_TRACE_LOADED 4    /* Loaded a new policy snapshot */
+
+struct rs_trace_record {
+    uint64_t seq;          /* Its sequence number plus one; 0 while being written */
+    uint64_t time_ns;      /* CLOCK_REALTIME at the start of the call */
+    uint32_t pid;
+    uint32_t tid;
+    uint16_t type;
+    uint16_t what;         /* RS_STAT_* entry point or RS_EVENT_* */
+    uint32_t flags;
+    uint64_t key;          /* Hash of the name looked up, uid, gid or event argument */
+    int32_t status;        /* enum nss_status */
+    int32_t err;
+    uint64_t duration_ns;
+    uint32_t lines;        /* Policy lines read during the call */
+    uint32_t reserved;
+};
+
+struct rs_trace {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_records;  /* Power of two */
+    uint32_t enabled;      /* Trace every process */
+    uint32_t reserved;
+    uint64_t next;         /* Sequence number of the next record */
+    struct rs_trace_record record[];
+};
+
+void set_trace_key(long);
+int trace_valid(const struct rs_trace *, size_t);
+uint64_t trace_name_hash(const char *);
+int tracing(void);
+void trace_call(int, const char *, uint32_t, uint32_t, uint64_t, enum nss_status, int);
+void trace_event(int, int64_t);
+void trace_line(void);
+void trace_flag(uint32_t);
+void trace_begin(uint32_t *);
+
+#endif
@@ -3,13 +3,21 @@
  */
 
 #include "nss-rightscale.h"
+#include "utils.h"
+#include "sha256.h"
+#include "scan.h"
+#include "stats.h"
+#include "trace.h"
 
 #include <errno.h>
+#include <limits.h>
 #include <grp.h>
 #include <malloc.h>
+#include <stdlib.h>
 #include <pwd.h>
 #include <string.h>
 #include <shadow.h>
+#include <sys/stat.h>
 #include <sys/un.h>
 
 #include <stdio.h>
@@ -17,96 +25,601 @@
 #include <sys/types.h>
 #include <unistd.h>
 
-/* This must be longer than any single line in the policy file */
-#define BUF_SIZE 4096
+#define DEFAULT_POLICY_FILE "/var/lib/rightlink/login_policy"
+char * POLICY_FILE = DEFAULT_POLICY_FILE;
 
-char * POLICY_FILE = "/var/lib/rightlink/login_policy";
+/* Compiled copy of the policy file written by rs-policy-compile */
+#define POLICY_DB_SUFFIX ".db"
+static char POLICY_DB_FILE[PATH_MAX] = DEFAULT_POLICY_FILE POLICY_DB_SUFFIX;
 
 void set_policy_file(char *new_file_name) {
     POLICY_FILE = new_file_name;
+    snprintf(POLICY_DB_FILE, sizeof(POLICY_DB_FILE), "%s%s", new_file_name, POLICY_DB_SUFFIX);
 }
 
+char * get_policy_file() {
+    return POLICY_FILE;
+}
+
+/* Whether the policy file is the one the module reads unless told otherwise */
+int is_default_policy_file() {
+    return strcmp(POLICY_FILE, DEFAULT_POLICY_FILE) == 0;
+}
+
+char * get_policy_db_file() {
+    return POLICY_DB_FILE;
+}
+
+/* stat() the policy file, so callers can tell whether it changed */
+int stat_policy_file(struct stat *st) {
+    return stat(POLICY_FILE, st);
+}
+
+struct rs_policy_file * open_policy_file() {
+    struct rs_policy_file *pf = malloc(sizeof(struct rs_policy_file));
+    if (pf == NULL) {
+        return NULL;
+    }
+    pf->fd = open(POLICY_FILE, O_RDONLY | O_CLOEXEC);
+    if (pf->fd < 0) {
+        int err = errno;
+        trace_event(RS_EVENT_POLICY_OPEN_FAILED, err);
+        free(pf);
+        errno = err;
+        return NULL;
+    }
+    count_file_open();
+    pf->offset = 0;
+    pf->pos = 0;
+    pf->len = 0;
+    pf->in_keys = FALSE;
+    return pf;
+}
+
+/* Move to the given offset in the policy file, which should be the start of
+ * a line. Offsets that are still buffered don't need a system call.
+ * Returns FALSE on failure. */
+int seek_policy_file(struct rs_policy_file *pf, long offset) {
+    pf->in_keys = FALSE;
+    if (offset >= pf->offset && offset <= pf->offset + (long)pf->len) {
+        pf->pos = offset - pf->offset;
+        return TRUE;
+    }
+    if (lseek(pf->fd, offset, SEEK_SET) != offset) {
+        return FALSE;
+    }
+    pf->offset = offset;
+    pf->pos = 0;
+    pf->len = 0;
+    return TRUE;
+}
+
+/* Offset of the next unread byte */
+static long tell_policy_file(struct rs_policy_file *pf) {
+    return pf->offset + pf->pos;
+}
+
+/* Refill the buffer once it has all been read. Returns FALSE at end of file
+ * or on error. */
+static int fill_policy_file(struct rs_policy_file *pf) {
+    ssize_t n;
+    if (pf->pos < pf->len) {
+        return TRUE;
+    }
+    do {
+        n = read(pf->fd, pf->buf, sizeof(pf->buf));
+    } while (n < 0 && errno == EINTR);
+    pf->offset += pf->len;
+    pf->pos = 0;
+    pf->len = n > 0 ? n : 0;
+    if (n > 0) {
+        count_bytes_parsed(n);
+    }
+    return n > 0;
+}
+
+static int getc_policy_file(struct rs_policy_file *pf) {
+    if (!fill_policy_file(pf)) {
+        return EOF;
+    }
+    return (unsigned char)pf->buf[pf->pos++];
+}
+
+/* Skip to the start of the next line without looking at what is in between */
+static void skip_policy_line(struct rs_policy_file *pf) {
+    while (fill_policy_file(pf)) {
+        char *newline = memchr(pf->buf + pf->pos, '\n', pf->len - pf->pos);
+        if (newline != NULL) {
+            pf->pos = newline - pf->buf + 1;
+            break;
+        }
+        pf->pos = pf->len;
+    }
+    pf->in_keys = FALSE;
+}
+
+int open_policy_db_file() {
+    int fd = open(POLICY_DB_FILE, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        count_file_open();
+    }
+    return fd;
+}
+
+/* Offset of the line the next read_policy_line will start from, for
+ * seek_policy_file to go back to */
+long tell_policy_line(struct rs_policy_file *pf) {
+    if (pf->in_keys) {
+        skip_policy_line(pf);
+    }
+    return tell_policy_file(pf);
+}
+
+/* Read the fields of the next non-empty line up to and including gecos into
+ * buf. The delimiters are found a block at a time by find_policy_delim, and
+ * the fields are split as they are copied. The public keys that follow are
+ * left unread: the next call skips over them, or read_policy_key reads them
+ * first. A line whose fields don't fit in buf is returned with no fields, so
+ * it fails to parse as a whole.
+ * Returns FALSE at end of file. */
+int read_policy_line(struct rs_policy_file *pf, char *buf, size_t size,
+    struct rs_policy_line *line, int *line_no) {
+    size_t len;
+    size_t field_start;
+    int c;
+
+    do {
+        if (pf->in_keys) {
+            skip_policy_line(pf);
+        }
+        line->offset = tell_policy_file(pf);
+        line->fields = 0;
+        len = 0;
+        field_start = 0;
+        c = EOF;
+        while (fill_policy_file(pf)) {
+            char *start = pf->buf + pf->pos;
+            char *end = pf->buf + pf->len;
+            char *delim = (char *)find_policy_delim(start, end);
+            size_t n = delim - start;
+            if (len + n < size) {
+                memcpy(buf + len, start, n);
+            }
+            len += n;
+            pf->pos += n;
+            if (delim == end) {
+                continue;
+            }
+            c = *delim;
+            pf->pos++;
+            if (c == '\n') {
+                break;
+            }
+            line->field[line->fields].ptr = buf + field_start;
+            line->field[line->fields].len = len - field_start;
+            line->fields++;
+            if (line->fields == POLICY_ID_FIELDS) {
+                pf->in_keys = TRUE;
+                break;
+            }
+            if (len < size) {
+                buf[len] = ':';
+            }
+            len++;
+            field_start = len;
+        }
+        if (c == EOF && len == 0 && line->fields == 0) {
+            return FALSE;
+        }
+        *line_no += 1;
+        trace_line();
+    } while (len == 0 && line->fields == 0);
 
-FILE* open_policy_file() {
-    /* Create input file descriptor */
-    FILE* fp = fopen(POLICY_FILE, "r");
-    if (fp == NULL) {
-        NSS_DEBUG("Cannot open policy file %s\n", POLICY_FILE);
+    if (!pf->in_keys) {
+        line->field[line->fields].ptr = buf + field_start;
+        line->field[line->fields].len = len - field_start;
+        line->fields++;
     }
-    return fp;
+    if (len >= size) {
+        trace_event(RS_EVENT_LONG_POLICY_LINE, *line_no - 1);
+        line->fields = 0;
+    }
+    return TRUE;
+}
+
+/* Read the next non-empty public key of the line read_policy_line just
+ * returned into *key, which is grown as needed. Returns FALSE once there are
+ * no more keys, or if there isn't enough memory for one. */
+int read_policy_key(struct rs_policy_file *pf, char **key, size_t *size,
+    size_t *len, long *offset) {
+    while (pf->in_keys) {
+        int c = EOF;
+        *offset = tell_policy_file(pf);
+        *len = 0;
+        while (fill_policy_file(pf)) {
+            char *start = pf->buf + pf->pos;
+            char *end = pf->buf + pf->len;
+            char *delim = (char *)find_policy_delim(start, end);
+            size_t n = delim - start;
+            if (*len + n > *size) {
+                size_t bigger_size = (*len + n) * 2;
+                char *bigger = realloc(*key, bigger_size);
+                if (bigger == NULL) {
+                    skip_policy_line(pf);
+                    return FALSE;
+                }
+                *key = bigger;
+                *size = bigger_size;
+            }
+            memcpy(*key + *len, start, n);
+            *len += n;
+            pf->pos += n;
+            if (delim != end) {
+                c = *delim;
+                pf->pos++;
+                break;
+            }
+        }
+        if (c != ':') {
+            pf->in_keys = FALSE;
+        }
+        if (*len > 0) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/* Whether the line has the given field. read_policy_line already split the
+ * fields into spans into the line buffer; nothing is NUL terminated yet. */
+static int has_policy_field(struct rs_policy_line *line, int field) {
+    return line->fields > field;
+}
+
+static int span_equal(struct rs_span *span, const char *str) {
+    return strncmp(span->ptr, str, span->len) == 0 && str[span->len] == '\0';
+}
+
+static int spans_equal(struct rs_span *a, struct rs_span *b) {
+    return a->len == b->len && memcmp(a->ptr, b->ptr, a->len) == 0;
+}
+
+/* Decimal uid without sscanf. Returns FALSE if the span isn't one */
+static int parse_uid(struct rs_span *span, uid_t *uid) {
+    unsigned long value = 0;
+    size_t i;
+    if (span->len == 0 || span->len > 10) {
+        return FALSE;
+    }
+    for (i = 0; i < span->len; i++) {
+        if (span->ptr[i] < '0' || span->ptr[i] > '9') {
+            return FALSE;
+        }
+        value = value * 10 + (span->ptr[i] - '0');
+    }
+    if (value >= (uid_t)-1) {
+        return FALSE;
+    }
+    *uid = value;
+    return TRUE;
+}
+
+/* Check whether a line is for the given login name, only splitting the two
+ * name fields. The preferred name only counts when it is non-empty and
+ * differs from the unique name. */
+int policy_line_name_matches(struct rs_policy_line *line, const char *name, int *use_preferred) {
+    if (!has_policy_field(line, FIELD_UNIQUE_NAME)) {
+        return FALSE;
+    }
+    struct rs_span *preferred_name = &line->field[FIELD_PREFERRED_NAME];
+    struct rs_span *unique_name = &line->field[FIELD_UNIQUE_NAME];
+    if (preferred_name->len != 0 && span_equal(preferred_name, name) &&
+        !spans_equal(preferred_name, unique_name)) {
+        *use_preferred = TRUE;
+        return TRUE;
+    }
+    if (span_equal(unique_name, name)) {
+        *use_preferred = FALSE;
+        return TRUE;
+    }
+    return FALSE;
+}
+
+/* Decode just the local uid of a line */
+int policy_line_local_uid(struct rs_policy_line *line, uid_t *local_uid) {
+    return has_policy_field(line, FIELD_LOCAL_UID) &&
+        parse_uid(&line->field[FIELD_LOCAL_UID], local_uid);
 }
 
-/* Reads the next policy entry into the passed in struct.
- * Its up to the caller to free everything in the passwd struct.
- * Valid policy entry line is:
+/* Fully parse and validate a line. The strings in entry point into the line
+ * buffer, which gets NUL terminated in place, so they are valid for as long
+ * as the buffer is. Valid policy entry line is:
  * preferred_name:unique_name:rs_uid:local_uid:superuser:gecos:public_key1:public_key2:..."
- */ 
-struct rs_user * read_next_policy_entry(FILE* fp, int* line_no) {
-    char rawentry[BUF_SIZE];
-    char *name, *gecos, *unique_name, *preferred_name;
+ */
+int policy_line_entry(struct rs_policy_line *line, struct rs_user *entry) {
     uid_t rs_uid = 0;
     uid_t local_uid = 0;
     int superuser = -1;
-    const char *delimiters = ":";
 
-    int entry_valid = FALSE;
-    while (!entry_valid) {
-        if( fgets (rawentry, BUF_SIZE, fp) == NULL ) {
-            return NULL;
+    if (!has_policy_field(line, FIELD_GECOS)) {
+        return FALSE;
+    }
+    parse_uid(&line->field[FIELD_RS_UID], &rs_uid);
+    parse_uid(&line->field[FIELD_LOCAL_UID], &local_uid);
+    struct rs_span *superuser_s = &line->field[FIELD_SUPERUSER];
+    if (span_equal(superuser_s, "1") || span_equal(superuser_s, "Y")) {
+        superuser = TRUE;
+    } else if (span_equal(superuser_s, "0") || span_equal(superuser_s, "N")) {
+        superuser = FALSE;
+    }
+    if (superuser == -1 || rs_uid == 0 || local_uid <= 500) {
+        return FALSE;
+    }
+
+    line->field[FIELD_PREFERRED_NAME].ptr[line->field[FIELD_PREFERRED_NAME].len] = '\0';
+    line->field[FIELD_UNIQUE_NAME].ptr[line->field[FIELD_UNIQUE_NAME].len] = '\0';
+    line->field[FIELD_GECOS].ptr[line->field[FIELD_GECOS].len] = '\0';
+    entry->preferred_name = line->field[FIELD_PREFERRED_NAME].ptr;
+    entry->unique_name = line->field[FIELD_UNIQUE_NAME].ptr;
+    entry->gecos = line->field[FIELD_GECOS].ptr;
+    entry->rs_uid = rs_uid;
+    entry->local_uid = local_uid;
+    entry->superuser = superuser;
+    return TRUE;
+}
+
+/* Whether a user's preferred name is usable as a login name: it must be
+ * non-empty and differ from their unique name */
+int has_preferred_name(struct rs_user *entry) {
+    return strlen(entry->preferred_name) != 0 &&
+        strcmp(entry->preferred_name, entry->unique_name) != 0;
+}
+
+/* Reads the next valid policy entry. Nothing is allocated: the strings in
+ * entry point into buf. Returns FALSE at end of file. */
+int read_policy_entry(struct rs_policy_file *pf, char *buf, size_t size, struct rs_user *entry, int *line_no) {
+    struct rs_policy_line line;
+    while (read_policy_line(pf, buf, size, &line, line_no)) {
+        if (policy_line_entry(&line, entry)) {
+            return TRUE;
         }
-        *line_no += 1;
+        trace_event(RS_EVENT_BAD_POLICY_LINE, *line_no - 1);
+    }
+    return FALSE;
+}
 
-        if (strlen(rawentry) < 2) {
-            continue;
+/* Scan the policy file for a user by name, using the same rules as the
+ * snapshot index. Only the name fields of other lines are looked at. */
+int find_policy_entry_by_name(struct rs_policy_file *pf, char *buf, size_t size, const char *name,
+    struct rs_user *entry, int *use_preferred) {
+    struct rs_policy_line line;
+    int line_no = 1;
+    while (read_policy_line(pf, buf, size, &line, &line_no)) {
+        if (policy_line_name_matches(&line, name, use_preferred) &&
+            policy_line_entry(&line, entry)) {
+            return TRUE;
         }
-        char *rawentryp = rawentry;
-
-        preferred_name  = strsep(&rawentryp, delimiters);
-        unique_name  = strsep(&rawentryp, delimiters);
-        char *rs_uid_s = strsep(&rawentryp, delimiters);
-        char *local_uid_s = strsep(&rawentryp, delimiters);
-        if (local_uid_s != NULL) { sscanf(local_uid_s, "%d", &local_uid); }
-        if (rs_uid_s != NULL) { sscanf(rs_uid_s, "%d", &rs_uid); }
-        char *superuser_s = strsep(&rawentryp, delimiters);
-        if (superuser_s != NULL) {
-            if (strcmp(superuser_s, "1") == 0 || strcmp(superuser_s, "Y") == 0) {
-                superuser = TRUE;
-            } else if (strcmp(superuser_s, "0") == 0 || strcmp(superuser_s, "N") == 0) {
-                superuser = FALSE;
-            }
+    }
+    return FALSE;
+}
+
+/* Scan the policy file for a user by local uid. Only the uid field of other
+ * lines is decoded. */
+int find_policy_entry_by_uid(struct rs_policy_file *pf, char *buf, size_t size, uid_t uid, struct rs_user *entry) {
+    struct rs_policy_line line;
+    int line_no = 1;
+    uid_t local_uid;
+    while (read_policy_line(pf, buf, size, &line, &line_no)) {
+        if (policy_line_local_uid(&line, &local_uid) && local_uid == uid &&
+            policy_line_entry(&line, entry)) {
+            return TRUE;
         }
+    }
+    return FALSE;
+}
 
-        gecos = strsep(&rawentryp, delimiters);
+/* Decode base64, with or without padding. out must have room for len * 3 / 4
+ * bytes. Returns the decoded length, or -1 if in isn't base64. */
+static long base64_decode(const char *in, size_t len, uint8_t *out) {
+    uint32_t bits = 0;
+    int nbits = 0;
+    long out_len = 0;
+    size_t i;
 
-        if (preferred_name != NULL && unique_name != NULL && gecos != NULL &&
-            superuser != -1 && rs_uid > 0 && local_uid > 500) {
-            entry_valid = TRUE;
+    while (len > 0 && in[len - 1] == '=') {
+        len--;
+    }
+    for (i = 0; i < len; i++) {
+        char c = in[i];
+        int value;
+        if (c >= 'A' && c <= 'Z') {
+            value = c - 'A';
+        } else if (c >= 'a' && c <= 'z') {
+            value = c - 'a' + 26;
+        } else if (c >= '0' && c <= '9') {
+            value = c - '0' + 52;
+        } else if (c == '+') {
+            value = 62;
+        } else if (c == '/') {
+            value = 63;
         } else {
-            NSS_DEBUG("%s:%d: Invalid format\n", POLICY_FILE, *line_no - 1);
+            return -1;
+        }
+        bits = bits << 6 | value;
+        nbits += 6;
+        if (nbits >= 8) {
+            nbits -= 8;
+            out[out_len++] = bits >> nbits;
         }
     }
+    return out_len;
+}
 
-    struct rs_user *entry = malloc(sizeof(struct rs_user));
+/* If token is the base64 blob of a key of the given type, store its
+ * fingerprint. Key blobs start with their type as an ssh string. */
+static int blob_fingerprint(const char *token, size_t len, const char *type, size_t type_len,
+    uint8_t *fingerprint) {
+    int res = FALSE;
+    uint8_t *blob = malloc(len * 3 / 4 + 1);
+    if (blob == NULL) {
+        return FALSE;
+    }
+    long blob_len = base64_decode(token, len, blob);
+    if (blob_len >= 4 + (long)type_len &&
+        ((uint32_t)blob[0] << 24 | (uint32_t)blob[1] << 16 | (uint32_t)blob[2] << 8 | blob[3]) == type_len &&
+        memcmp(blob + 4, type, type_len) == 0) {
+        sha256(blob, blob_len, fingerprint);
+        res = TRUE;
+    }
+    free(blob);
+    return res;
+}
 
-    entry->preferred_name = malloc(sizeof(char)*(strlen(preferred_name) + 1));
-    strcpy(entry->preferred_name, preferred_name);
+/* Fingerprint a public key field ("[options] type blob [comment]") the way
+ * ssh-keygen -l does: the SHA-256 of the decoded blob. The blob is the token
+ * that follows the one naming its type. Returns FALSE if there is none. */
+int policy_key_fingerprint(const char *key, size_t len, uint8_t *fingerprint) {
+    const char *end = key + len;
+    const char *prev = NULL;
+    size_t prev_len = 0;
+    const char *p = key;
+
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t')) {
+            p++;
+        }
+        const char *token = p;
+        while (p < end && *p != ' ' && *p != '\t') {
+            p++;
+        }
+        if (p == token) {
+            break;
+        }
+        if (prev != NULL && blob_fingerprint(token, p - token, prev, prev_len, fingerprint)) {
+            return TRUE;
+        }
+        prev = token;
+        prev_len = p - token;
+    }
+    return FALSE;
+}
 
-    entry->unique_name = malloc(sizeof(char)*(strlen(unique_name) + 1));
-    strcpy(entry->unique_name, unique_name);
+/* Parse a fingerprint as sshd's %f and ssh-keygen -l print it: "SHA256:"
+ * followed by unpadded base64. Returns FALSE if it isn't one. */
+int parse_fingerprint(const char *str, uint8_t *fingerprint) {
+    uint8_t decoded[SHA256_DIGEST_LEN + 3];
+    size_t len;
 
-    entry->gecos = malloc(sizeof(char)*(strlen(gecos) + 1));
-    strcpy(entry->gecos, gecos);
+    if (strncmp(str, "SHA256:", 7) != 0) {
+        return FALSE;
+    }
+    str += 7;
+    len = strlen(str);
+    if (len > 44 || base64_decode(str, len, decoded) != SHA256_DIGEST_LEN) {
+        return FALSE;
+    }
+    memcpy(fingerprint, decoded, SHA256_DIGEST_LEN);
+    return TRUE;
+}
 
-    entry->rs_uid = rs_uid;
-    entry->local_uid = local_uid;
-    entry->superuser = superuser;
+static int key_matches(const char *key, size_t len, const uint8_t *fingerprint) {
+    uint8_t key_fingerprint[SHA256_DIGEST_LEN];
+    return policy_key_fingerprint(key, len, key_fingerprint) &&
+        memcmp(key_fingerprint, fingerprint, SHA256_DIGEST_LEN) == 0;
+}
 
-    return entry;
+/* Copy the key of the given length at offset in pf to out, if it still has
+ * the given fingerprint. Returns FALSE if it doesn't. */
+int write_policy_key_at(struct rs_policy_file *pf, uint64_t offset, size_t len,
+    const uint8_t *fingerprint, FILE *out) {
+    int res = FALSE;
+    size_t i = 0;
+    int c = 0;
+    char *key = malloc(len);
+    if (key == NULL) {
+        return FALSE;
+    }
+    if (seek_policy_file(pf, offset)) {
+        while (i < len && (c = getc_policy_file(pf)) != EOF) {
+            key[i++] = c;
+        }
+    }
+    if (i == len && key_matches(key, len, fingerprint)) {
+        fwrite(key, 1, len, out);
+        putc_unlocked('\n', out);
+        res = TRUE;
+    }
+    free(key);
+    return res;
 }
 
+/* Copy the public keys (fields 7 and up) of the line starting at the current
+ * position of pf to out, one per line, if it is the line of the user with
+ * the given unique name. If fingerprint isn't NULL, only keys with that
+ * fingerprint are copied. The line is streamed, and at most one key is held
+ * in memory, so memory use doesn't depend on the number of keys.
+ * Returns the number of keys copied, or -1 if the line belongs to someone
+ * else or there isn't enough memory for a key. */
+int write_policy_keys(struct rs_policy_file *pf, const char *unique_name,
+    const uint8_t *fingerprint, FILE *out) {
+    int field = FIELD_PREFERRED_NAME;
+    const char *name = unique_name;
+    char *key = NULL;
+    size_t key_len = 0;
+    size_t key_size = 0;
+    int written = 0;
+    int c;
+
+    do {
+        c = getc_policy_file(pf);
+        if (c == ':' || c == '\n' || c == EOF) {
+            if (field == FIELD_UNIQUE_NAME && *name != '\0') {
+                free(key);
+                return -1;
+            }
+            if (field > FIELD_GECOS && key_len > 0) {
+                if (fingerprint == NULL) {
+                    putc_unlocked('\n', out);
+                    written++;
+                } else if (key_matches(key, key_len, fingerprint)) {
+                    fwrite(key, 1, key_len, out);
+                    putc_unlocked('\n', out);
+                    written++;
+                }
+            }
+            key_len = 0;
+            field++;
+        } else if (field == FIELD_UNIQUE_NAME) {
+            if (c != (unsigned char)*name++) {
+                free(key);
+                return -1;
+            }
+        } else if (field > FIELD_GECOS) {
+            if (fingerprint == NULL) {
+                putc_unlocked(c, out);
+            } else {
+                if (key_len == key_size) {
+                    char *bigger = realloc(key, key_size * 2 + 256);
+                    if (bigger == NULL) {
+                        free(key);
+                        return -1;
+                    }
+                    key = bigger;
+                    key_size = key_size * 2 + 256;
+                }
+                key[key_len] = c;
+            }
+            key_len++;
+        }
+    } while (c != '\n' && c != EOF);
+
+    free(key);
+    return field > FIELD_UNIQUE_NAME ? written : -1;
+}
 
-void close_policy_file(FILE* fp) {
-    fclose(fp);
+void close_policy_file(struct rs_policy_file *pf) {
+    close(pf->fd);
+    free(pf);
 }
 
 /*
@@ -226,84 +739,235 @@ enum nss_status fill_spwd(struct spwd *spbuf, char *buf, size_t buflen,
     return NSS_STATUS_SUCCESS;
 }
 
-void free_rs_user(struct rs_user *entry) {
-    free(entry->preferred_name);
-    free(entry->unique_name);
-    free(entry->gecos);
-    free(entry);
+/* Name an entry is listed under, as in fill_passwd */
+static const char * entry_name(struct rs_user *entry, int use_preferred) {
+    if (use_preferred == TRUE && strlen(entry->preferred_name) > 0) {
+        return entry->preferred_name;
+    }
+    return entry->unique_name;
 }
 
-void print_rs_user(struct rs_user *entry) {
-    NSS_DEBUG("rs_user (%p) preferred_name %s unique_name %s gecos %s rs_uid %d local_uid %d\n",
-        entry, entry->preferred_name, entry->unique_name, entry->gecos, entry->rs_uid, entry->local_uid);
+/* Append a NUL terminated string to a rendered entry, if there is one */
+static size_t render_string(struct rs_rendered *rendered, size_t len, const char *prefix,
+    const char *str) {
+    size_t prefix_length = strlen(prefix);
+    size_t length = strlen(str);
+    if (rendered != NULL) {
+        char *strings = (char *)(rendered + 1);
+        memcpy(strings + len, prefix, prefix_length);
+        memcpy(strings + len + prefix_length, str, length + 1);
+    }
+    return len + prefix_length + length + 1;
 }
 
+/*
+ * Render the strings of a passwd entry the way fill_passwd lays them out.
+ * @param rendered Where to render it, followed by room for the strings, or
+ *                 NULL to only compute the length.
+ * @return Length of the strings.
+ */
+size_t render_passwd(struct rs_rendered *rendered, struct rs_user *entry, int use_preferred) {
+    uint16_t field[4];
+    size_t len = render_string(rendered, 0, "", entry_name(entry, use_preferred));
+    field[RENDERED_PW_DIR] = len;
+    len = render_string(rendered, len, "/home/", entry->unique_name);
+    field[RENDERED_PW_PASSWD] = len;
+    len = render_string(rendered, len, "", "x");
+    field[RENDERED_PW_SHELL] = len;
+    len = render_string(rendered, len, "", "/bin/bash");
+    field[RENDERED_PW_GECOS] = len;
+    len = render_string(rendered, len, "", entry->gecos);
+    if (rendered != NULL) {
+        rendered->len = len;
+        memcpy(rendered->field, field, sizeof(field));
+    }
+    return len;
+}
+
+/* Render the strings of a shadow entry the way fill_spwd lays them out. See
+ * render_passwd */
+size_t render_spwd(struct rs_rendered *rendered, struct rs_user *entry, int use_preferred) {
+    size_t len = render_string(rendered, 0, "", entry_name(entry, use_preferred));
+    if (rendered != NULL) {
+        memset(rendered->field, 0, sizeof(rendered->field));
+        rendered->field[RENDERED_SP_PWDP] = len;
+    }
+    len = render_string(rendered, len, "", "*");
+    if (rendered != NULL) {
+        rendered->len = len;
+    }
+    return len;
+}
+
+/* Fill a passwd struct from a rendered entry: one bounds check, one copy and
+ * pointers into the copy. */
+enum nss_status fill_rendered_passwd(struct passwd *pwbuf, char *buf, size_t buflen,
+    const struct rs_rendered *rendered, uid_t uid, int *errnop) {
+    if (buflen < rendered->len) {
+        *errnop = ERANGE;
+        return NSS_STATUS_TRYAGAIN;
+    }
+    memcpy(buf, rendered + 1, rendered->len);
+    pwbuf->pw_name = buf;
+    pwbuf->pw_dir = buf + rendered->field[RENDERED_PW_DIR];
+    pwbuf->pw_passwd = buf + rendered->field[RENDERED_PW_PASSWD];
+    pwbuf->pw_shell = buf + rendered->field[RENDERED_PW_SHELL];
+    pwbuf->pw_gecos = buf + rendered->field[RENDERED_PW_GECOS];
+    pwbuf->pw_uid = uid;
+    pwbuf->pw_gid = uid;
+    return NSS_STATUS_SUCCESS;
+}
+
+/* Fill a spwd struct from a rendered entry. See fill_rendered_passwd */
+enum nss_status fill_rendered_spwd(struct spwd *spbuf, char *buf, size_t buflen,
+    const struct rs_rendered *rendered, int *errnop) {
+    if (buflen < rendered->len) {
+        *errnop = ERANGE;
+        return NSS_STATUS_TRYAGAIN;
+    }
+    memcpy(buf, rendered + 1, rendered->len);
+    spbuf->sp_namp = buf;
+    spbuf->sp_pwdp = buf + rendered->field[RENDERED_SP_PWDP];
+    spbuf->sp_warn = 7;
+    return NSS_STATUS_SUCCESS;
+}
 
 /*
- * Fill an group struct using given information.
+ * Render a group with the given members the way fill_policy_group lays it
+ * out, but with offsets in place of pointers.
+ * @param rendered Where to render it, followed by room for the layout, or
+ *                 NULL to only compute the length.
+ * @param strings String pool the members are in.
+ * @param members Offsets of the member names in the string pool.
+ * @return Length of the layout.
+ */
+size_t render_group(struct rs_rendered_group *rendered, const char *name,
+    const char *strings, const uint32_t *members, uint32_t num_members) {
+    char *layout = rendered != NULL ? (char *)(rendered + 1) : NULL;
+    size_t len = sizeof(char *) * ((size_t)num_members + 1);
+    uint32_t i;
+
+    for (i = 0; i < num_members; i++) {
+        const char *member = strings + members[i];
+        size_t member_length = strlen(member) + 1;
+        if (rendered != NULL) {
+            ((uintptr_t *)layout)[i] = len;
+            memcpy(layout + len, member, member_length);
+        }
+        len += member_length;
+    }
+    if (rendered != NULL) {
+        ((uintptr_t *)layout)[num_members] = 0;
+        rendered->num_members = num_members;
+        rendered->name = len;
+        memcpy(layout + len, name, strlen(name) + 1);
+    }
+    len += strlen(name) + 1;
+    if (rendered != NULL) {
+        rendered->passwd = len;
+        memcpy(layout + len, "x", 2);
+    }
+    len += 2;
+    if (rendered != NULL) {
+        rendered->len = len;
+    }
+    return len;
+}
+
+/* Fill a group struct from a rendered group: one bounds check, one copy,
+ * and the member offsets turned into pointers into the copy. */
+enum nss_status fill_rendered_group(struct group *grbuf, char *buf, size_t buflen,
+    const struct rs_rendered_group *rendered, gid_t gid, int *errnop) {
+    /* gr_mem must be pointer aligned */
+    size_t offset = (sizeof(char *) - (uintptr_t)buf % sizeof(char *)) % sizeof(char *);
+    uint32_t i;
+
+    if (buflen < offset + rendered->len) {
+        *errnop = ERANGE;
+        return NSS_STATUS_TRYAGAIN;
+    }
+    buf += offset;
+    memcpy(buf, rendered + 1, rendered->len);
+    char **members = (char **)buf;
+    for (i = 0; i < rendered->num_members; i++) {
+        members[i] = buf + (uintptr_t)members[i];
+    }
+    members[i] = NULL;
+    grbuf->gr_mem = members;
+    grbuf->gr_name = buf + rendered->name;
+    grbuf->gr_passwd = buf + rendered->passwd;
+    grbuf->gr_gid = gid;
+    return NSS_STATUS_SUCCESS;
+}
+
+
+/*
+ * Fill a group struct for a group whose members are names in a policy
+ * snapshot's string pool.
  * @param grbuf Struct which will be filled with various info.
  * @param buf Buffer which will contain all strings pointed to by grbuf.
  * @param buflen Buffer length.
- * @param entry Source struct populated from policy file.
+ * @param name Group name.
+ * @param gid Group id.
+ * @param strings String pool of the snapshot.
+ * @param members Offsets of the member names in the string pool.
+ * @param num_members Number of members.
  * @param errnop Pointer to errno, will be filled if something goes wrong.
  */
-enum nss_status fill_group(struct group *grbuf, char *buf, size_t buflen,
-    struct group *entry, int *errnop) {
-
-    int total_length = 0;
-
-    char **gr_memp = entry->gr_mem;
-
-    int i;
-    for (i = 0; gr_memp[i] != NULL; i++) {
-        total_length += strlen(gr_memp[i]) + 1;
+enum nss_status fill_policy_group(struct group *grbuf, char *buf, size_t buflen,
+    const char *name, gid_t gid, const char *strings, const uint32_t *members,
+    uint32_t num_members, int *errnop) {
+    const char *passwd = "x";
+    size_t total_length = 0;
+    uint32_t i;
+
+    for (i = 0; i < num_members; i++) {
+        total_length += strlen(strings + members[i]) + 1;
     }
 
-    int name_length = strlen(entry->gr_name);
+    size_t name_length = strlen(name);
     total_length += name_length + 1;
 
-    int passwd_length = strlen(entry->gr_passwd);
+    size_t passwd_length = strlen(passwd);
     total_length += passwd_length + 1;
 
     /* Calculate number of extra bytes needed to align on pointer size boundry */
-    /* Should always be 0 */
-    int offset = 0;
+    size_t offset = 0;
     if ((offset = (unsigned long)(buf) % sizeof(char *)) != 0)
         offset = sizeof(char *) - offset;
     total_length += offset;
 
     // The pointers to group members are in buf also!. The array is null terminated, hence the + 1
-    total_length += sizeof(char *) * (i + 1);
+    total_length += sizeof(char *) * (num_members + 1);
 
     if(buflen < total_length) {
         *errnop = ERANGE;
         return NSS_STATUS_TRYAGAIN;
     }
 
-    grbuf->gr_gid = entry->gr_gid;
+    grbuf->gr_gid = gid;
 
     buf += offset;
     grbuf->gr_mem = (char **)(buf);
 
-    buf +=  sizeof(char *) * (i + 1);
+    buf += sizeof(char *) * (num_members + 1);
 
-    gr_memp = entry->gr_mem;
-    for (i = 0; gr_memp[i] != NULL; i++) {
-        strcpy(buf, gr_memp[i]);
+    for (i = 0; i < num_members; i++) {
+        const char *member = strings + members[i];
+        size_t member_length = strlen(member);
+        memcpy(buf, member, member_length + 1);
         grbuf->gr_mem[i] = buf;
-        buf += strlen(gr_memp[i]) + 1;
+        buf += member_length + 1;
     }
     grbuf->gr_mem[i] = NULL; /* Null terminated list */
 
-
-    strcpy(buf, entry->gr_name);
+    memcpy(buf, name, name_length + 1);
     grbuf->gr_name = buf;
     buf += name_length + 1;
 
-    strcpy(buf, entry->gr_passwd);
+    memcpy(buf, passwd, passwd_length + 1);
     grbuf->gr_passwd = buf;
     buf += passwd_length + 1;
 
     return NSS_STATUS_SUCCESS;
 }
-
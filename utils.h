@@ -4,15 +4,116 @@
 #include <grp.h>
 #include <pwd.h>
 #include <shadow.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+/* This must be longer than the fields of any line up to and including gecos.
+ * Public keys are never copied into it, so lines can be of any length. */
+#define POLICY_BUF_SIZE 4096
+
+/* How much of the policy file is read at a time */
+#define POLICY_READ_SIZE 65536
+
+/* The policy file, read through our own buffer so that public keys can be
+ * skipped with memchr rather than copied a character at a time */
+struct rs_policy_file {
+    int fd;
+    long offset;     /* Of buf[0] in the file */
+    size_t pos;      /* Next unread byte in buf */
+    size_t len;      /* Bytes of buf that are valid */
+    int in_keys;     /* Positioned in the keys of a line read_policy_line returned */
+    char buf[POLICY_READ_SIZE];
+};
+
+/* A field of a policy line. Points into the line buffer, not NUL terminated */
+struct rs_span {
+    char *ptr;
+    size_t len;
+};
+
+/* Fields of a policy line up to and including gecos, in file order */
+enum {
+    FIELD_PREFERRED_NAME,
+    FIELD_UNIQUE_NAME,
+    FIELD_RS_UID,
+    FIELD_LOCAL_UID,
+    FIELD_SUPERUSER,
+    FIELD_GECOS,
+    POLICY_ID_FIELDS
+};
+
+/* A policy line being parsed lazily: fields are split as the line is read,
+ * but only decoded as needed */
+struct rs_policy_line {
+    long offset;   /* Of the start of the line in the policy file */
+    int fields;    /* Number of fields up to and including gecos */
+    struct rs_span field[POLICY_ID_FIELDS];
+};
+
+/* A passwd or shadow entry rendered ahead of time, laid out exactly as
+ * fill_passwd or fill_spwd would lay it out in the caller's buffer: the
+ * name, then the other strings of the entry, all NUL terminated. Filling an
+ * entry is then a single copy. The strings follow the header. */
+struct rs_rendered {
+    uint32_t len;       /* Of the strings */
+    uint16_t field[4];  /* Where the strings after the name start */
+};
+
+/* Rendered fields, in order */
+enum {
+    RENDERED_PW_DIR,
+    RENDERED_PW_PASSWD,
+    RENDERED_PW_SHELL,
+    RENDERED_PW_GECOS
+};
+#define RENDERED_SP_PWDP 0
+
+/* A group with members rendered ahead of time, laid out as it goes in the
+ * caller's buffer: the NULL terminated gr_mem array, then the member names,
+ * the group name and its password. The gr_mem array holds offsets from the
+ * start of the layout, which become pointers once it is copied. The layout
+ * follows the header, at a pointer aligned offset. */
+struct rs_rendered_group {
+    uint32_t len;       /* Of the layout */
+    uint32_t num_members;
+    uint32_t name;      /* Offset of the group name */
+    uint32_t passwd;
+};
 
 /* Read and parse entries from the RightScale policy file */
 void set_policy_file(char *);
-FILE* open_policy_file();
-void close_policy_file(FILE *);
-struct rs_user * read_next_policy_entry(FILE *, int *);
+char * get_policy_file();
+int is_default_policy_file();
+char * get_policy_db_file();
+int open_policy_db_file();
+int stat_policy_file(struct stat *);
+struct rs_policy_file * open_policy_file();
+void close_policy_file(struct rs_policy_file *);
+int seek_policy_file(struct rs_policy_file *, long);
+long tell_policy_line(struct rs_policy_file *);
+int read_policy_line(struct rs_policy_file *, char *, size_t, struct rs_policy_line *, int *);
+int read_policy_key(struct rs_policy_file *, char **, size_t *, size_t *, long *);
+int policy_line_name_matches(struct rs_policy_line *, const char *, int *);
+int policy_line_local_uid(struct rs_policy_line *, uid_t *);
+int policy_line_entry(struct rs_policy_line *, struct rs_user *);
+int has_preferred_name(struct rs_user *);
+int read_policy_entry(struct rs_policy_file *, char *, size_t, struct rs_user *, int *);
+int find_policy_entry_by_name(struct rs_policy_file *, char *, size_t, const char *, struct rs_user *, int *);
+int find_policy_entry_by_uid(struct rs_policy_file *, char *, size_t, uid_t, struct rs_user *);
+int policy_key_fingerprint(const char *, size_t, uint8_t *);
+int parse_fingerprint(const char *, uint8_t *);
+int write_policy_key_at(struct rs_policy_file *, uint64_t, size_t, const uint8_t *, FILE *);
+int write_policy_keys(struct rs_policy_file *, const char *, const uint8_t *, FILE *);
 enum nss_status fill_passwd(struct passwd *, char *, size_t, struct rs_user *, int, int *);
 enum nss_status fill_spwd(struct spwd *, char *, size_t, struct rs_user *, int, int *);
-enum nss_status fill_group(struct group *, char *, size_t, struct group *, int *);
-void free_rs_user(struct rs_user *);
+size_t render_passwd(struct rs_rendered *, struct rs_user *, int);
+size_t render_spwd(struct rs_rendered *, struct rs_user *, int);
+enum nss_status fill_rendered_passwd(struct passwd *, char *, size_t, const struct rs_rendered *, uid_t, int *);
+enum nss_status fill_rendered_spwd(struct spwd *, char *, size_t, const struct rs_rendered *, int *);
+size_t render_group(struct rs_rendered_group *, const char *, const char *, const uint32_t *, uint32_t);
+enum nss_status fill_rendered_group(struct group *, char *, size_t, const struct rs_rendered_group *,
+    gid_t, int *);
+enum nss_status fill_policy_group(struct group *, char *, size_t, const char *, gid_t,
+    const char *, const uint32_t *, uint32_t, int *);
 
 #endif